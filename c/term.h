@@ -29,18 +29,61 @@
 /*****************************************************************************/
 
 /*
- * Note that at this point *nix stdout are buffered and windows aren't.
+ * All the state of a terminal lives in a term_Ctx which is bound to an input
+ * and an output file descriptor (stdin / stdout, a pty master, a socket...),
+ * so a single process can drive any number of terminals. The output is
+ * buffered in the context and written with term_flush() or term_end_frame(),
+ * so a whole frame can be written at once.
  *
  * *nix systems doesn't support double click at this point, but it's in my
  * TODO. Contributions are wellcome.
  *
- * Window resize events can be enabled by setting NO_WINDOW_RESIZE_EVENT
- * macro value to 1 and recompile, however you have to provide a event
- * callback for resize events in *nix systems.
+ * Window resize events can be enabled on windows by setting the
+ * NO_WINDOW_RESIZE_EVENT macro value to 0 and recompile. On *nix systems
+ * they're always enabled (the macro only applies to windows): the size is
+ * queried (there is no per-terminal resize signal) by term_render(),
+ * term_getsize() and term_read_event() before it waits for an input, a
+ * change is reported once as a TERM_ET_RESIZE event.
+ *
+ * Define TERM_WRITER_THREAD (and link with pthread) to enable the output
+ * writer thread, see term_start_writer().
+ *
+ * Define TERM_HEADLESS to enable the in-memory terminal for testing and
+ * benchmarking, see term_ctx_new_headless().
+ *
+ * Define TERM_REPLAY to enable recording and replaying the input and the
+ * input parser benchmark, see term_record_input().
+ *
+ * Define TERM_VIEWER (and link with pthread) to enable the file viewer for
+ * huge text files, see term_viewer_open().
+ *
+ * Define TERM_STATS to enable the rendering and input statistics, see
+ * term_stats(). Without it the counters aren't compiled.
+ *
+ * Define TERM_DRAW_QUEUE (requires C11 atomics) to enable drawing from the
+ * worker threads, see term_producer_new().
+ *
+ * The implementation needs POSIX.1-2008 (clock_gettime() and the like) which
+ * a strict -std=c11 hides on linux, the feature test macros are defined below
+ * but they only take effect before the first system header: include term.h
+ * first in the source defining TERM_IMPLEMENT or define them in the compiler
+ * flags.
  *
  */
 
+/* _DEFAULT_SOURCE keeps the extensions visible (the -std=gnu11 default),
+ * which an explicit _POSIX_C_SOURCE alone would hide. */
+#if defined(TERM_IMPLEMENT) && defined(__linux__)
+  #ifndef _POSIX_C_SOURCE
+    #define _POSIX_C_SOURCE 200809L
+  #endif
+  #ifndef _DEFAULT_SOURCE
+    #define _DEFAULT_SOURCE
+  #endif
+#endif
+
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
  * A generic Vector type to pass size, position data around.
@@ -139,13 +182,15 @@ typedef enum {
 typedef enum {
   TERM_ET_UNKNOWN = 0,
   TERM_ET_KEY_DOWN,
+  TERM_ET_KEY_UP, /* Requires TERM_KB_EVENT_TYPES. */
   TERM_ET_DOUBLE_CLICK,
   TERM_ET_MOUSE_DOWN,
   TERM_ET_MOUSE_UP,
   TERM_ET_MOUSE_MOVE,
   TERM_ET_MOUSE_DRAG,
   TERM_ET_MOUSE_SCROLL,
-  #if ! NO_WINDOW_RESIZE_EVENT
+  TERM_ET_CURSOR_POSITION, /* Reply of term_request_position(). */
+  #if ! NO_WINDOW_RESIZE_EVENT || ! defined(_WIN32)
   TERM_ET_RESIZE,
   #endif
 } term_EventType;
@@ -159,9 +204,44 @@ typedef enum {
   TERM_MD_CTRL  = (1 << 1),
   TERM_MD_ALT   = (1 << 2),
   TERM_MD_SHIFT = (1 << 3),
+  TERM_MD_SUPER = (1 << 4), /* Only reported with the kitty keyboard protocol. */
 } term_Modifiers;
 
 
+/*
+ * Keyboard enhancement flags of the kitty keyboard protocol (see
+ * term_enable_kitty_keyboard()). The values are the same as the protocol's
+ * progressive enhancement flags.
+ *
+ * Reference: https://sw.kovidgoyal.net/kitty/keyboard-protocol/
+ */
+typedef enum {
+  TERM_KB_NONE         = 0x0,
+  TERM_KB_DISAMBIGUATE = (1 << 0), /* Tab, Ctrl+I, Enter, Ctrl+M, Esc, ... */
+  TERM_KB_EVENT_TYPES  = (1 << 1), /* Report key repeat and key up events. */
+} term_KeyboardFlags;
+
+
+/*
+ * Event mask, one bit for each term_EventType. Events that aren't in the mask
+ * are dropped by the input parser (before they're fully parsed if possible).
+ */
+#define TERM_EVENT_BIT(type) (1u << (type))
+#define TERM_EVENT_ALL (~0u)
+
+
+/*
+ * Coalescing flags for the noisy mouse events. With any event tracking enabled
+ * the terminal reports every cell the mouse crosses, so if the application is
+ * slower than the mouse, stale reports will queue up in the input buffer.
+ */
+typedef enum {
+  TERM_CO_NONE   = 0x0,
+  TERM_CO_MOTION = (1 << 0), /* Collapse queued move/drag to the latest one. */
+  TERM_CO_SCROLL = (1 << 1), /* Merge consecutive scroll ticks into a delta. */
+} term_Coalesce;
+
+
 /*
  * Mouse button event's button index.
  */
@@ -180,6 +260,7 @@ typedef struct {
   term_KeyCode code;
   char ascii;
   term_Modifiers modifiers;
+  bool repeat; /* Key is held down, requires TERM_KB_EVENT_TYPES. */
 } term_EventKey;
 
 
@@ -190,6 +271,7 @@ typedef struct {
   term_MouseBtn button;
   term_Vec pos;
   bool scroll; /* If true down otherwise up. */
+  int delta; /* Number of scroll ticks merged into this event. */
   term_Modifiers modifiers;
 } term_EventMouse;
 
@@ -201,15 +283,34 @@ typedef struct {
   union {
     term_EventKey key;
     term_EventMouse mouse;
-#if ! NO_WINDOW_RESIZE_EVENT
+    term_Vec position; /* Zero based cursor position. */
+#if ! NO_WINDOW_RESIZE_EVENT || ! defined(_WIN32)
     term_Vec resize;
 #endif
   };
 } term_Event;
 
 
-/* Returns true if both stdin and stdout are tty like device. */
-bool term_isatty();
+/*
+ * Terminal context. It holds the terminal modes, input buffer and parser
+ * state, output buffer and the cell grids of a single terminal.
+ */
+typedef struct term_Ctx term_Ctx;
+
+
+/*
+ * Create a new context bound to the input and output file descriptors (ex:
+ * 0 and 1 for stdin and stdout). Returns NULL if the allocation failed.
+ */
+term_Ctx* term_ctx_new(int in_fd, int out_fd);
+
+
+/* Free the context, term_cleanup() should be called before if initialized. */
+void term_ctx_free(term_Ctx* ctx);
+
+
+/* Returns true if both input and output of the context are tty like device. */
+bool term_isatty(term_Ctx* ctx);
 
 /*
  * Initialize the terminal. On windows it'll enable the virtual terminal
@@ -218,11 +319,14 @@ bool term_isatty();
  *
  * @param capture_events: If true it'll enable input events processing.
  */
-void term_init(bool capture_events);
+void term_init(term_Ctx* ctx, bool capture_events);
 
 
-/* Cleans up all the internals. */
-void term_cleanup(void);
+/*
+ * Restore the terminal modes, it should be called before the program exits
+ * or the terminal is closed.
+ */
+void term_cleanup(term_Ctx* ctx);
 
 
 /*
@@ -233,818 +337,5385 @@ void term_cleanup(void);
  *
  * @return If an event has been read it'll return true.
  */
-bool term_read_event(term_Event* event);
+bool term_read_event(term_Ctx* ctx, term_Event* event);
 
 
-/* Create an alternative screen buffer. */
-void term_new_screen_buffer();
+/*
+ * Set the event mask. Only the events with their TERM_EVENT_BIT() set in
+ * the mask will be reported by term_read_event(). Default is TERM_EVENT_ALL.
+ */
+void term_set_event_mask(term_Ctx* ctx, unsigned int mask);
 
-/* Restore the screen buffer after switching to an alternative buffer with
- * term_new_screen_buffer(). This will also clean entier screen and place
- * the cursor at (0, 0).
+
+/*
+ * Set the mouse event coalescing flags (see term_Coalesce). Default is
+ * TERM_CO_NONE.
  */
-void term_restore_screen_buffer();
+void term_set_coalesce(term_Ctx* ctx, term_Coalesce flags);
 
 
-/* Returns the screen size. */
-term_Vec term_getsize();
+/*
+ * Set the time to wait for the rest of an escape sequence after an ESC byte
+ * in milliseconds. If nothing follows within the timeout it's read as the ESC
+ * key. Default is 25 ms, over a slow connection a bigger value may be needed
+ * to avoid splitting the sequences. It's a no-op on windows.
+ */
+void term_set_escape_timeout(term_Ctx* ctx, int ms);
 
 
-/* Returns the cursor position in a zero based index coordinate. */
-term_Vec term_getposition();
+/*
+ * Enable the kitty keyboard protocol with the given enhancement flags, should
+ * be called after term_init(). On terminals without the protocol support it
+ * has no effect and the keys are read as before. With TERM_KB_EVENT_TYPES
+ * key up and repeat events are reported (on windows they're always
+ * available). The flags are restored by term_cleanup().
+ */
+void term_enable_kitty_keyboard(term_Ctx* ctx, term_KeyboardFlags flags);
 
 
-/* Sets the cursor position in a zero based index coordinate. */
-void term_setposition(term_Vec pos);
+/*
+ * Returns the keyboard enhancement flags the terminal has acknowledged, which
+ * is known once the reply of term_enable_kitty_keyboard() has been read by
+ * term_read_event(). Returns TERM_KB_NONE if not supported (yet).
+ */
+term_KeyboardFlags term_keyboard_flags(term_Ctx* ctx);
 
 
-/*****************************************************************************/
-/* INTERNAL HEADERS AND MACROS                                               */
-/*****************************************************************************/
+/* Terminal capability flags. */
+typedef enum {
+  TERM_CAP_NONE           = 0x0,
+  TERM_CAP_SYNC_OUTPUT    = (1 << 0), /* Synchronized output (mode 2026). */
+  TERM_CAP_REP            = (1 << 1), /* REP (repeat the last character). */
+  TERM_CAP_TRUECOLOR      = (1 << 2), /* 24 bit colors. */
+  TERM_CAP_KITTY_KEYBOARD = (1 << 3), /* Kitty keyboard protocol. */
+} term_Caps;
 
-#ifdef TERM_IMPLEMENT
 
-#include <assert.h>
-#include <ctype.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
+/*
+ * Returns the capabilities of the terminal. On *nix term_init() sends the
+ * queries (DECRQM, XTGETTCAP, kitty keyboard and XTVERSION) in a single
+ * batch followed by DA1, which every terminal replies, and reads the replies
+ * till the DA1 reply or a deadline.
+ */
+term_Caps term_capabilities(term_Ctx* ctx);
 
-#ifdef _WIN32
-  #define TERM_SYS_WIN
-#else
-  #define TERM_SYS_NIX
-#endif
 
-/* Platform specific includes */
-#if defined(TERM_SYS_WIN)
-  #include <windows.h>
-#elif defined(TERM_SYS_NIX)
-  #include <signal.h>
-  #include <termios.h>
-  #include <sys/ioctl.h>
-#endif
+/* Returns the terminal name and version replied to XTVERSION, or "". */
+const char* term_version(term_Ctx* ctx);
 
-#if defined(_MSC_VER) || (defined(TERM_SYS_WIN) && defined(__TINYC__))
-  #include <io.h>
-  #define read _read
-  #define fileno _fileno
-  #define isatty _isatty
-#else
-  #include <unistd.h>
-#endif
 
 /*
- * On *nix window resize are signals, not events so we cannot use readEvent()
- * function to read. However if you want to handle them define this as 0 and
- * add a callback to read resize events. On windows nothing has to be done.
+ * Set the capability cache file, should be called before term_init(). The
+ * probed capabilities are cached with the key of $TERM and the terminal
+ * version ($TERM_PROGRAM and $TERM_PROGRAM_VERSION), so the next
+ * term_init() on the same terminal doesn't wait for the replies. Terminals
+ * which don't export their version are probed every time. A NULL path
+ * disables the cache, the default is $XDG_CACHE_HOME/term_caps or
+ * ~/.cache/term_caps.
  */
-#define NO_WINDOW_RESIZE_EVENT 1
+void term_set_caps_cache(term_Ctx* ctx, const char* path);
+
+
+/* Create an alternative screen buffer. */
+void term_new_screen_buffer(term_Ctx* ctx);
+
+/* Restore the screen buffer after switching to an alternative buffer with
+ * term_new_screen_buffer(). This will also clean entier screen and place
+ * the cursor at (0, 0).
+ */
+void term_restore_screen_buffer(term_Ctx* ctx);
+
 
 /*
- * In older version of windows some terminal attributes are not defined
- * So I'm defining everyting here if they're not already.
- *
- * Note that I have no idea which macros are not defined and not, I'm just
- * re-defining every this looks suspicious.
+ * Returns the screen size. On *nix it's queried from the terminal and a
+ * change is also reported by the next term_read_event() as TERM_ET_RESIZE.
  */
-#ifdef TERM_SYS_WIN
+term_Vec term_getsize(term_Ctx* ctx);
 
-  #ifndef ENABLE_VIRTUALINAL_PROCESSING
-    #define ENABLE_VIRTUALINAL_PROCESSING 0x0004
-  #endif
 
-  #ifndef ENABLE_EXTENDED_FLAGS
-    #define ENABLE_EXTENDED_FLAGS 0x0080
-  #endif
+/*
+ * Set the screen size for the contexts that aren't bound to a tty (ex: a
+ * socket of an SSH channel which receives the window size from the client).
+ * For ttys the size is queried from the terminal. A change is reported by
+ * term_read_event() as TERM_ET_RESIZE on *nix.
+ */
+void term_setsize(term_Ctx* ctx, term_Vec size);
 
-  #ifndef FROM_LEFT_1ST_BUTTON_PRESSED
-    #define FROM_LEFT_1ST_BUTTON_PRESSED 0x0001
-  #endif
 
-  #ifndef RIGHTMOST_BUTTON_PRESSED
-    #define RIGHTMOST_BUTTON_PRESSED 0x0002
-  #endif
+/*
+ * Returns the cursor position in a zero based index coordinate. On *nix this
+ * will block till the terminal replies, any input that arrives before the
+ * reply is kept for term_read_event().
+ */
+term_Vec term_getposition(term_Ctx* ctx);
 
-  #ifndef FROM_LEFT_2ND_BUTTON_PRESSED
-    #define FROM_LEFT_2ND_BUTTON_PRESSED 0x0004
-  #endif
 
-  #ifndef MOUSE_MOVED
-    #define MOUSE_MOVED 0x0001
-  #endif
+/*
+ * Request the cursor position without waiting for the reply. The reply will
+ * be delivered as a TERM_ET_CURSOR_POSITION event by term_read_event().
+ */
+void term_request_position(term_Ctx* ctx);
 
-  #ifndef DOUBLE_CLICK
-    #define DOUBLE_CLICK 0x0002
-  #endif
 
-  #ifndef MOUSE_WHEELED
-    #define MOUSE_WHEELED 0x0004
-  #endif
+/*
+ * Get the last known cursor position without a round-trip to the terminal.
+ * The position is known after a term_setposition() call or a position reply
+ * and it won't track the cursor moved by printing text, in that case call
+ * term_request_position() or term_getposition() to resync.
+ *
+ * @return false if the cursor position isn't known.
+ */
+bool term_known_position(term_Ctx* ctx, term_Vec* pos);
 
-  #ifndef LEFT_ALT_PRESSED
-    #define LEFT_ALT_PRESSED 0x0002
-  #endif
 
-  #ifndef RIGHT_ALT_PRESSED
-    #define RIGHT_ALT_PRESSED 0x0001
-  #endif
+/* Sets the cursor position in a zero based index coordinate. */
+void term_setposition(term_Ctx* ctx, term_Vec pos);
 
-  #ifndef RIGHT_CTRL_PRESSED
-    #define RIGHT_CTRL_PRESSED 0x0004
-  #endif
 
-  #ifndef LEFT_CTRL_PRESSED
-    #define LEFT_CTRL_PRESSED 0x0008
-  #endif
+/*
+ * Begin a frame. If the terminal supports synchronized output (DEC mode 2026,
+ * detected by term_init()) it'll hold the rendering till term_end_frame(),
+ * so the frame will be drawn at once without tearing or flickering.
+ */
+void term_begin_frame(term_Ctx* ctx);
 
-  #ifndef SHIFT_PRESSED
-    #define SHIFT_PRESSED 0x0010
-  #endif
 
-#endif /* TERM_SYS_WIN */
+/* End the frame started with term_begin_frame() and flush the output. */
+void term_end_frame(term_Ctx* ctx);
 
-/* Input read buffer size. */
-#define INPUT_BUFF_SZ 256
 
+/* Write the data to the output buffer. */
+void term_write(term_Ctx* ctx, const char* data, int size);
 
-/* Returns predicate (a <= c <= b). */
-#define BETWEEN(a, c, b) ((a) <= (c) && (c) <= (b))
 
-/*****************************************************************************/
-/* TYPEDEFINES AND DECLARATIONS                                              */
-/*****************************************************************************/
+/* Write the formatted string to the output buffer. */
+void term_printf(term_Ctx* ctx, const char* fmt, ...);
 
 
-#define _veceq(v1, v2) (((v1.x) == (v2).x) && ((v1).y == (v2).y))
+/* Write the output buffer to the output file descriptor. */
+void term_flush(term_Ctx* ctx);
 
-typedef struct {
-  
-#if defined(TERM_SYS_WIN)
-  DWORD outmode, inmode; /* Backup modes. */
-  HANDLE h_stdout, h_stdin; /* Handles. */
-  
-#elif defined(TERM_SYS_NIX)
-  struct termios tios; /* Backup modes. */
-  uint8_t buff[INPUT_BUFF_SZ]; /* Input buffer. */
-  int32_t buffc; /* Buffer element count. */
-#endif
-  
-  term_Vec screensize;
-  term_Vec mousepos;
-  
-  bool capture_events;
-  bool initialized;
-  
-} term_Ctx;
 
+#ifdef TERM_WRITER_THREAD
 
-static term_Ctx _ctx;
+/*
+ * Start a thread which writes the output, so a slow terminal (SSH over a bad
+ * link, a paused tmux pane) never blocks the caller. The flushed output is
+ * pushed to a lock-free queue which the thread drains to a non blocking
+ * output: a reopened file description of the tty, so the other writers of
+ * the tty (stdout, stderr) aren't affected. Any other output (a pipe, a
+ * socket) is switched to O_NONBLOCK itself till the writer is stopped, which
+ * the other users of it will see. If the queue is full the output is
+ * dropped till the next term_render() which redraws the whole screen, so
+ * the stale frames are skipped in favor of the latest one. Must be called
+ * after term_init() and it's stopped by term_cleanup().
+ *
+ * @return false if the thread couldn't be started (not supported on windows).
+ */
+bool term_start_writer(term_Ctx* ctx);
 
-static void _init();
-static void _cleanup(); 
-static term_Vec _getsize();
 
-#ifdef TERM_SYS_NIX
-static void _handle_resize(int sig);
-#endif
+/*
+ * Stop the writer thread after it wrote the queued output (or the terminal
+ * didn't accept it for a while) and restore the output file descriptor.
+ */
+void term_stop_writer(term_Ctx* ctx);
+
+
+/*
+ * Returns true if the writer thread dropped output and the screen wasn't
+ * redrawn yet. Since all the output is dropped till the next term_render(),
+ * applications which render only on changes should call term_render() again
+ * (after the terminal had some time to catch up) if this returns true.
+ */
+bool term_output_dropped(term_Ctx* ctx);
 
-static bool _read_event(term_Event* event);
+#endif /* TERM_WRITER_THREAD */
 
 
 /*****************************************************************************/
-/* IMPLEMENTATIONS                                                           */
+/* CELL GRID                                                                 */
 /*****************************************************************************/
 
+/*
+ * Instead of writing to the output directly, the screen can be drawn into a
+ * cell grid with term_setcell() and term_render() will write only the
+ * changes since the last render. If the content is shifted vertically (ex:
+ * a log tailer adding a new line at the bottom) it'll be scrolled by the
+ * terminal and only the new lines will be written.
+ */
 
-bool term_isatty() {
-  return (!!isatty(fileno(stdout))) && (!!isatty(fileno(stdin)));
-}
+/*
+ * Cell color. It's either a 24 bit RGB value (0xRRGGBB), an index of the 256
+ * color palette created with TERM_COLOR_INDEX() or TERM_COLOR_DEFAULT.
+ */
+typedef uint32_t term_Color;
 
+#define TERM_COLOR_DEFAULT 0xff000000
+#define TERM_COLOR_INDEX(i) (0x01000000 | ((i) & 0xff))
 
-void term_init(bool capture_events) {
-  memset(&_ctx, 0, sizeof(term_Ctx));
-  _ctx.capture_events = capture_events;
-  
-  _init();
-  
-  _ctx.screensize = _getsize();
-  _ctx.initialized = true;
-  atexit(term_cleanup);
-}
 
+/*
+ * Cell attribute flags.
+ */
+typedef enum {
+  TERM_ATTR_NONE      = 0x0,
+  TERM_ATTR_BOLD      = (1 << 0),
+  TERM_ATTR_DIM       = (1 << 1),
+  TERM_ATTR_ITALIC    = (1 << 2),
+  TERM_ATTR_UNDERLINE = (1 << 3),
+  TERM_ATTR_REVERSE   = (1 << 4),
+} term_Attr;
 
-void term_cleanup(void) {
-  assert(_ctx.initialized);
-  _cleanup();
-}
 
+/*
+ * A single character cell of the screen. The grids store the cells packed in
+ * 8 bytes (the character and an index to the interned style table) so the
+ * rows are compared with memcmp() and a large screen still fits in the cache.
+ */
+typedef struct {
+  uint32_t ch; /* Unicode codepoint or a grapheme from term_grapheme(). */
+  term_Color fg;
+  term_Color bg;
+  uint32_t attr; /* term_Attr flags. */
+} term_Cell;
 
-bool term_read_event(term_Event* event) {
-  return _read_event(event);
-}
+/* A macro function to create a cell with the default colors. */
+#define term_cell(ch) (term_Cell) { (ch), TERM_COLOR_DEFAULT, TERM_COLOR_DEFAULT, TERM_ATTR_NONE }
 
 
-#if defined(TERM_SYS_WIN)
-static void _init() {
-  _ctx.h_stdout = GetStdHandle(STD_OUTPUT_HANDLE);
-  GetConsoleMode(_ctx.h_stdout, &_ctx.outmode);
+/* Colors and attributes of the text written with term_put(). */
+typedef struct {
+  term_Color fg;
+  term_Color bg;
+  uint32_t attr; /* term_Attr flags. */
+} term_Style;
 
-  _ctx.h_stdin = GetStdHandle(STD_INPUT_HANDLE);
-  GetConsoleMode(_ctx.h_stdin, &_ctx.inmode);
+/* A macro function to create a style. */
+#define term_style(fg, bg, attr) (term_Style) { (fg), (bg), (attr) }
 
-  DWORD outmode = (_ctx.outmode | ENABLE_VIRTUALINAL_PROCESSING);
-  SetConsoleMode(_ctx.h_stdout, outmode);
+/* Flag of the cell characters which are interned graphemes. */
+#define TERM_CH_GRAPHEME 0x80000000
 
-  if (_ctx.capture_events) {
-    DWORD inmode = ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT;
-    SetConsoleMode(_ctx.h_stdin, inmode);
-  }
-}
 
+/*
+ * Returns a cell character for the grapheme cluster of multiple codepoints
+ * (ex: an emoji with a modifier) encoded in utf8, the length can be -1 if
+ * it's null terminated. The graphemes are interned in the context, so the
+ * same grapheme always has the same value and it's valid till the context is
+ * freed. Single codepoints are returned as is.
+ */
+uint32_t term_grapheme(term_Ctx* ctx, const char* str, int length);
 
-static void _cleanup() {
-  SetConsoleMode(_ctx.h_stdout, _ctx.outmode);
-  SetConsoleMode(_ctx.h_stdin, _ctx.inmode);
-}
 
+/*
+ * Sets a cell of the grid, positions outside of the screen are ignored. A
+ * double width character (see utf8_charWidth()) covers the next cell, which
+ * isn't rendered, and is rendered as a space at the last column.
+ */
+void term_setcell(term_Ctx* ctx, term_Vec pos, term_Cell cell);
 
-#elif defined(TERM_SYS_NIX)
-static void _init() {
-  tcgetattr(fileno(stdin), &_ctx.tios);
-  
-  struct termios raw = _ctx.tios;
-  
-  /*
-   * ECHO   : It won't print character as we type.
-   * ICANON : Disable canonical mode, inputs will
-   *          be byte by byte instead of line by line.
-   * ISIG   : Disable Ctrl+C, Ctrl+Z
-   * IXON   : Disable Ctrl+S, Ctrl+Q
-   * IEXTEN : Disable Ctrl+V
-   * ICRNL  : Fix Ctrl+M. It won't convert '\r' into '\n' anymore.
-   * OPOST  : It won't convert '\n' into '\r\n' anymore.
-   * BRKINT : Disable break condition that'll send a SIGINT.
-   */
-  raw.c_lflag &= ~(ECHO | ICANON);
-  if (_ctx.capture_events) {
-    /*raw.c_oflag &= ~(OPOST);*/
-    raw.c_iflag &= ~(IXON | ICRNL | BRKINT);
-    raw.c_lflag &= ~(ISIG | IEXTEN);
-  }
-  
-  /*
-   * VMIN  : Minimum number of bytes should be read before return from read().
-   * VTIME : Maximum amount of time to be wait before read() returns.
-   *         1 unit is 100 of a second (ie. vtime = n => 1/100 s)
-   *
-   * However on windows running WSL, VTIME won't work, it'll wait till an
-   * input is read.
-   */
-  raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
-  
-  tcsetattr(fileno(stdin), TCSAFLUSH, &raw);
-  
-  /* Enable mouse events. */
-  if (_ctx.capture_events) {
-    fprintf(stdout, "\x1b[?1003h\x1b[?1006h");
-    fflush(stdout);
-  }
-  
-  /* Handle resize events. */
-  signal(SIGWINCH, _handle_resize);
 
-}
+/* Returns a cell of the grid (a blank cell if it's outside of the screen). */
+term_Cell term_getcell(term_Ctx* ctx, term_Vec pos);
 
 
-static void _cleanup() {
-  
-  /* Disable mouse events. */
-  if (_ctx.capture_events) {
-    fprintf(stdout, "\x1b[?1003l\x1b[?1006l\x1b[?25h");
-  }
-  
-  tcsetattr(fileno(stdin), TCSAFLUSH, &_ctx.tios);
-}
+/* Fill the entire grid with blank cells. */
+void term_clear(term_Ctx* ctx);
 
 
-void _handle_resize(int sig) {
-  term_Vec newsize = _getsize();
-  if (!_veceq(_ctx.screensize, newsize)) {
-    return;
-  }
-  _ctx.screensize = newsize;
+/*
+ * Write the printf formatted utf8 text to the grid from the position and
+ * returns the number of columns it takes. The text is formatted to a stack
+ * buffer of PUT_BUFF_SZ bytes and written straight to the cells (clipped to
+ * the screen), double width and combining characters are handled like
+ * term_setcell() and term_grapheme() would. Nothing is allocated, except a
+ * new style or grapheme is interned.
+ */
+int term_put(term_Ctx* ctx, int x, int y, term_Style style, const char* fmt, ...);
 
-#if !NO_WINDOW_RESIZE_EVENT  
-  term_Event event;
-  memset(&event, 0, sizeof(term_Event));
-  event.type = TERM_ET_RESIZE;
-  event.resize = _ctx.screensize;
 
-  #error "Dispatch the event with a callback or something."
-  your_callback(&event);
-#endif /* NO_WINDOW_RESIZE_EVENT */  
-}
+/*
+ * Write the utf8 string (the length can be -1 if it's null terminated) to a
+ * field of the width in columns, like printf a positive width is right
+ * aligned and a negative one left aligned, the string is padded with spaces
+ * or clipped to the field. A width of 0 writes the whole string. Returns the
+ * number of columns written.
+ */
+int term_put_str(term_Ctx* ctx, int x, int y, term_Style style, const char* str, int length, int width);
 
-#endif /* TERM_SYS_NIX */
 
+/*
+ * Write the integer to a field of the width (see term_put_str()), without
+ * going through printf. A number which doesn't fit the field fills it with
+ * '#' instead of being clipped.
+ */
+int term_put_int(term_Ctx* ctx, int x, int y, term_Style style, int64_t value, int width);
 
-void term_new_screen_buffer() {
-  fprintf(stdout, "\x1b[?1049h");
-}
 
+/*
+ * Write the number with the decimals (0 to 9) digits after the point to a
+ * field of the width, like term_put_int(). It's rounded to the nearest as a
+ * fixed point integer (same as printf for the common values).
+ */
+int term_put_fixed(term_Ctx* ctx, int x, int y, term_Style style, double value, int decimals, int width);
 
-void term_restore_screen_buffer() {
-  fprintf(stdout, "\x1b[H\x1b[J"); /* Clear screen and go to (0, 0). */
-  fprintf(stdout, "\x1b[?1049l");
-}
 
+/*
+ * Write the changes of the grid since the last render to the terminal as a
+ * single frame (see term_begin_frame()). Only the damaged cells are compared,
+ * the cells changed by term_setcell() and term_clear() are damaged already.
+ */
+void term_render(term_Ctx* ctx);
 
-term_Vec term_getposition() {
-    term_Vec pos;
 
-  #if defined(TERM_SYS_WIN)
-  CONSOLE_SCREEN_BUFFER_INFO binfo;
-  GetConsoleScreenBufferInfo(_ctx.h_stdout, &binfo);
-  pos.x = binfo.dwCursorPosition.X;
-  pos.y = binfo.dwCursorPosition.Y;
-  return pos;
+/*
+ * Mark the rectangle as damaged, it'll be written by the next render even if
+ * the cells haven't changed (ex: the screen was overwritten by an other
+ * program).
+ */
+void term_damage(term_Ctx* ctx, term_Vec pos, term_Vec size);
 
-  #elif defined(TERM_SYS_NIX)
 
-  struct termios tio;
-  if (tcgetattr(fileno(stdin), &tio) != 0) {
-    assert(false && "tcgetattr(stdin) failed.");
-  }
-  
-  tcsetattr(fileno(stdin), TCSANOW, &tio);
-  assert(((tio.c_lflag & (ICANON | ECHO)) == 0)
-         && "Did you forget to call term_init()");
-  
+/*
+ * Set the maximum frames per second of the render scheduler (0 to disable,
+ * which is the default). If enabled term_read_event() renders the damage
+ * when a frame is due and its wait for input ends at the next frame, so the
+ * grid can be changed as often as needed and it's rendered at most once per
+ * frame interval. Calling term_render() directly isn't capped.
+ */
+void term_set_frame_rate(term_Ctx* ctx, int fps);
 
-  /* 
-   * Request cursor position. stdin will be in the for of ESC[n;mR
-   * here where n is the row and m is the column. (1 based).
-   */
-  fprintf(stdout, "\x1b[6n");
 
-  if (getchar() != '\x1b' || getchar() != '[') {
-    assert(false && "getchar() failed in getposition()");
-  }
+/*****************************************************************************/
+/* LAYERS                                                                    */
+/*****************************************************************************/
 
-  pos.x = 0; pos.y = 0;
-  int* p = &pos.y;
+/*
+ * Layers are cell grids (menus, dialogs, tooltips...) placed over the grid
+ * in z order and composited by term_render(). Cells with the ch value 0 are
+ * transparent and show what's below them. Changing, moving, showing or
+ * hiding a layer damages only its area, so an overlay doesn't cause a full
+ * screen repaint when it appears or closes.
+ */
+typedef struct term_Layer term_Layer;
 
-  while (true) {
-    int c = getchar();
 
-    if (c == EOF) {
-      assert(false && "getchar() failed in getposition()");
-    }
+/*
+ * Create a transparent layer at the position (can be outside of the screen)
+ * of the size. Layers with a higher z are drawn over the lower ones and the
+ * grid is below all of them. Returns NULL if the allocation failed.
+ */
+term_Layer* term_layer_new(term_Ctx* ctx, term_Vec pos, term_Vec size, int z);
 
-    if (c == ';') p = &pos.x;
-    if (c == 'R') break;
 
+/* Remove the layer and free it. */
+void term_layer_free(term_Layer* layer);
 
-    if (BETWEEN('0', c, '9')) {
-      *p = *p * 10 + (c - '0');
-    }
-  }
 
-  /* Since column, row numbers are 1 based substract 1 for 0 based. */
-  pos.x--; pos.y--;
+/* Sets a cell of the layer, the position is relative to the layer. */
+void term_layer_setcell(term_Layer* layer, term_Vec pos, term_Cell cell);
 
-  #endif /* TERM_SYS_NIX */
 
-  return pos;
-}
+/* Fill the entire layer with transparent cells. */
+void term_layer_clear(term_Layer* layer);
 
 
-void term_setposition(term_Vec pos) {
-  fprintf(stdout, "\x1b[%i;%iH", pos.y + 1, pos.x + 1);
-}
+/* Move the layer to the position. */
+void term_layer_move(term_Layer* layer, term_Vec pos);
 
 
-static term_Vec _getsize() {
-  term_Vec size;
+/* Show or hide the layer, layers are visible when created. */
+void term_layer_show(term_Layer* layer, bool visible);
 
-#if defined(TERM_SYS_WIN)
-  CONSOLE_SCREEN_BUFFER_INFO binfo;
-  GetConsoleScreenBufferInfo(_ctx.h_stdout, &binfo);
-  size.x = binfo.srWindow.Right - binfo.srWindow.Left + 1;
-  size.y = binfo.srWindow.Bottom - binfo.srWindow.Top + 1;
 
-#elif defined(TERM_SYS_NIX)
-  struct winsize wsize;
-  ioctl(fileno(stdout), TIOCGWINSZ, &wsize);
-  size.x = wsize.ws_col;
-  size.y = wsize.ws_row;
-#endif
+#ifdef TERM_HEADLESS
 
-  return size;
-}
+/*****************************************************************************/
+/* HEADLESS                                                                  */
+/*****************************************************************************/
+
+/*
+ * Create a context which isn't bound to a terminal. The output is parsed
+ * into an in-memory screen of the size (only the sequences written by term.h
+ * are supported, the rest are ignored) and the input is fed with
+ * term_headless_input(), so the renderer can be tested and benchmarked on a
+ * machine without a tty. The cursor position requests are replied by the
+ * in-memory screen. Returns NULL if the allocation failed.
+ */
+term_Ctx* term_ctx_new_headless(term_Vec size);
 
 
-term_Vec term_getsize() {
-  return _ctx.screensize;
-}
+/* Returns a cell of the in-memory screen. */
+term_Cell term_headless_getcell(term_Ctx* ctx, term_Vec pos);
 
 
-/*****************************************************************************/
-/* INPUT PROCESSING                                                          */
-/*****************************************************************************/
+/* Returns the cursor position of the in-memory screen. */
+term_Vec term_headless_cursor(term_Ctx* ctx);
 
-#if defined(TERM_SYS_WIN)
+
+/* Returns the number of bytes written to the in-memory screen. */
+uint64_t term_headless_bytes(term_Ctx* ctx);
 
 
 /*
- * Convert windows virtual keys to term_KeyCodes. Returns false if the key
- * should be ignored as an event (ex: shift, ctrl, ...).
+ * Append the bytes to the input read by term_read_event(). Returns the number
+ * of bytes appended, which can be less than the size if the input buffer is
+ * full (read the events to make space). Not supported on windows.
  */
-static bool _toTermKeyCode(WORD vk, term_KeyCode * kc) {
+int term_headless_input(term_Ctx* ctx, const char* data, int size);
 
-  if (0x30 <= vk && vk <= 0x39) { *kc = (term_KeyCode)TERM_KC_0 + (vk - 0x30); return true; }
-  if (0x60 <= vk && vk <= 0x69) { *kc = (term_KeyCode)TERM_KC_0 + (vk - 0x60); return true; }
-  if (0x41 <= vk && vk <= 0x5a) { *kc = (term_KeyCode)TERM_KC_A + (vk - 0x41); return true; }
-  if (0x70 <= vk && vk <= 0x7b) { *kc = (term_KeyCode)TERM_KC_F1 + (vk - 0x70); return true; }
+#endif /* TERM_HEADLESS */
 
-  /*
-   * Note that shift, ctrl, alt keys are returned as TERM_KC_UNKNOWN
-   *since *nix systems don't support them.
-   */
-  switch (vk) {
-  case VK_BACK: *kc = TERM_KC_BACKSPACE; break;
-  case VK_TAB: *kc = TERM_KC_TAB; break;
-  case VK_RETURN: *kc = TERM_KC_ENTER; break;
-  case VK_ESCAPE: *kc = TERM_KC_ESC; break;
-  case VK_SPACE: *kc = TERM_KC_SPACE; break;
-  case VK_PRIOR: *kc = TERM_KC_PAGEUP; break;
-  case VK_NEXT: *kc = TERM_KC_PAGEDOWN; break;
-  case VK_END: *kc = TERM_KC_END; break;
-  case VK_HOME: *kc = TERM_KC_HOME; break;
-  case VK_LEFT: *kc = TERM_KC_LEFT; break;
-  case VK_RIGHT: *kc = TERM_KC_RIGHT; break;
-  case VK_UP: *kc = TERM_KC_UP; break;
-  case VK_DOWN: *kc = TERM_KC_DOWN; break;
-  case VK_INSERT: *kc = TERM_KC_INSERT; break;
-  case VK_DELETE: *kc = TERM_KC_DELETE; break;
 
-  case VK_SHIFT:
-  case VK_CONTROL:
-  case VK_MENU:
-  case VK_PAUSE:
-  case VK_CAPITAL: /* Capslock. */
-    return false;
-  }
+#ifdef TERM_REPLAY
 
-  return true;
-}
+/*****************************************************************************/
+/* RECORD AND REPLAY                                                         */
+/*****************************************************************************/
 
+/*
+ * Record the raw input bytes read by term_read_event() with their timestamps
+ * to the file, to reproduce an input heavy problem (mouse floods, pastes, key
+ * repeats) with term_replay_input(). A NULL path stops the recording. Record
+ * and replay are only supported on *nix, where the input is a byte stream.
+ *
+ * @return false if the file couldn't be opened.
+ */
+bool term_record_input(term_Ctx* ctx, const char* path);
 
-static bool _read_event(term_Event* event) {
-  memset(event, 0, sizeof(term_Event));
-  event->type = TERM_ET_UNKNOWN;
 
-  DWORD count;
-  if (!GetNumberOfConsoleInputEvents(_ctx.h_stdin, &count)) {
-    /* TODO: error handle api ("GetNumberOfConsoleInputEvents() failed."). */
-    return false;
-  }
+/*
+ * Replay the recorded input file through the same parsing path instead of
+ * reading the input. If realtime the input arrives with the recorded timing,
+ * otherwise as fast as term_read_event() reads it. Once the file ends the
+ * input is read again.
+ *
+ * @return false if the file couldn't be opened or isn't a record.
+ */
+bool term_replay_input(term_Ctx* ctx, const char* path, bool realtime);
 
-  if (count == 0) return false;
 
-  INPUT_RECORD ir;
-  if (!ReadConsoleInput(_ctx.h_stdin, &ir, 1, &count)) {
-    /* TODO: error handle api ("ReadConsoleInput() failed."). */
-    return false;
-  }
+/* Returns true till the replayed file ends. */
+bool term_replaying(term_Ctx* ctx);
 
-  switch (ir.EventType) {
-    case KEY_EVENT: {
-      KEY_EVENT_RECORD* ker = &ir.Event.KeyEvent;
 
-      /* Key up event not available in *nix systems. So we're ignoring here as well. */
-      if (!ker->bKeyDown) return false;
+/* Canned input traces for the benchmark. */
+typedef enum {
+  TERM_TRACE_MOUSE_STORM,   /* SGR mouse motion reports. */
+  TERM_TRACE_PASTE,         /* Large paste of plain text. */
+  TERM_TRACE_FUNCTION_KEYS, /* Function, arrow and modified keys. */
+} term_Trace;
 
-      if (!_toTermKeyCode(ker->wVirtualKeyCode, &event->key.code)) return false;
 
-      event->type = TERM_ET_KEY_DOWN;
-      event->key.ascii = ker->uChar.AsciiChar;
+/* Write a canned input trace to the file. Returns false on failure. */
+bool term_write_trace(const char* path, term_Trace trace);
 
-      if ((ker->dwControlKeyState & LEFT_ALT_PRESSED) || (ker->dwControlKeyState & RIGHT_ALT_PRESSED))
-        event->key.modifiers |= TERM_MD_ALT;
-      if ((ker->dwControlKeyState & LEFT_CTRL_PRESSED) || (ker->dwControlKeyState & RIGHT_CTRL_PRESSED))
-        event->key.modifiers |= TERM_MD_CTRL;
-      if (ker->dwControlKeyState & SHIFT_PRESSED)
-        event->key.modifiers |= TERM_MD_SHIFT;
 
-    } break;
+/* Result of term_bench_input(). */
+typedef struct {
+  uint64_t bytes; /* Input bytes in the trace. */
+  uint64_t events; /* Events read by term_read_event(). */
+  double loop_ns; /* Nanoseconds per event of the term_read_event() loop. */
+  double parse_ns; /* Nanoseconds per sequence of the escape sequence parser. */
+  double events_per_sec; /* Events per second of the term_read_event() loop. */
+} term_BenchResult;
 
-    case MOUSE_EVENT: {
 
-      MOUSE_EVENT_RECORD* mer = &ir.Event.MouseEvent;
+/*
+ * Replay the recorded input file as fast as possible through a context which
+ * isn't bound to a terminal and measure the event loop, and the escape
+ * sequence parser alone.
+ *
+ * @return false if the file couldn't be read.
+ */
+bool term_bench_input(const char* path, term_BenchResult* result);
 
-      static DWORD last_state = 0; /* Last state to compare if a new button pressed. */
-      bool pressed = mer->dwButtonState; /* If any state is on pressed will be true. */
+#endif /* TERM_REPLAY */
 
-      /* Xor will give != 0 if any button changed. */
-      DWORD change = last_state ^ mer->dwButtonState;
 
-      if (change != 0) {
-        /*
-         * What if the mouse doesn't have the middle button and right
-         * button is the second button?.
-         */
-        if (change & FROM_LEFT_1ST_BUTTON_PRESSED) {
-          pressed = mer->dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED;
-          event->mouse.button = TERM_MB_LEFT;
+#ifdef TERM_VIEWER
 
-        } else if (change & RIGHTMOST_BUTTON_PRESSED) {
-          pressed = mer->dwButtonState & RIGHTMOST_BUTTON_PRESSED;
-          event->mouse.button = TERM_MB_RIGHT;
+/*****************************************************************************/
+/* FILE VIEWER                                                               */
+/*****************************************************************************/
 
-        } else if (change & FROM_LEFT_2ND_BUTTON_PRESSED) {
-          pressed = mer->dwButtonState & FROM_LEFT_2ND_BUTTON_PRESSED;
-          event->mouse.button = TERM_MB_MIDDLE;
-        }
-      }
-      last_state = mer->dwButtonState;
+/*
+ * A scrolling view of a text file of any size. The file is memory mapped and
+ * only the visible lines are decoded, a background thread builds a sparse
+ * index of the line offsets to jump to a line, and the scanned pages are
+ * dropped so the memory use depends on the screen size, not the file size.
+ * The lines appended after the open aren't visible, and the file shouldn't
+ * be truncated while it's open (reading the unmapped pages is a SIGBUS).
+ */
+typedef struct term_Viewer term_Viewer;
 
-      event->mouse.pos.x = mer->dwMousePosition.X;
-      event->mouse.pos.y = mer->dwMousePosition.Y;
 
-      if (mer->dwEventFlags == 0) {
-        event->type = (pressed) ? TERM_ET_MOUSE_DOWN : TERM_ET_MOUSE_UP;
+/* Position of a viewer returned by term_viewer_info(). */
+typedef struct {
+  uint64_t size; /* File size in bytes. */
+  uint64_t offset; /* Byte offset of the top line. */
+  int64_t line; /* Top line number from 0, -1 if it's not indexed yet. */
+  uint64_t lines; /* Number of lines indexed so far. */
+  bool indexed; /* The index is complete and lines is the line count. */
+} term_ViewerInfo;
 
-      } else if (mer->dwEventFlags & MOUSE_MOVED) {
-        if (_veceq(_ctx.mousepos, event->mouse.pos)) {
-          return false;
-        }
-        event->type = (pressed) ? TERM_ET_MOUSE_DRAG : TERM_ET_MOUSE_MOVE;
 
-      } else if (mer->dwEventFlags & MOUSE_WHEELED) {
-        event->type = TERM_ET_MOUSE_SCROLL;
-        event->mouse.scroll = (mer->dwButtonState & 0xFF000000) ? true : false;
+/*
+ * Open the file to draw on the context and start indexing it. Viewing is
+ * only supported on *nix.
+ *
+ * @return NULL if the file couldn't be opened or mapped.
+ */
+term_Viewer* term_viewer_open(term_Ctx* ctx, const char* path);
 
-      } else if (mer->dwEventFlags & DOUBLE_CLICK) {
-        event->type = TERM_ET_DOUBLE_CLICK;
-      }
 
-      _ctx.mousepos.x = event->mouse.pos.x;
-      _ctx.mousepos.y = event->mouse.pos.y;
+/* Stop the index thread, unmap the file and free the viewer. */
+void term_viewer_close(term_Viewer* viewer);
 
-      if ((mer->dwControlKeyState & LEFT_ALT_PRESSED) || (mer->dwControlKeyState & RIGHT_ALT_PRESSED))
-        event->mouse.modifiers |= TERM_MD_ALT;
-      if ((mer->dwControlKeyState & LEFT_CTRL_PRESSED) || (mer->dwControlKeyState & RIGHT_CTRL_PRESSED))
-        event->mouse.modifiers |= TERM_MD_CTRL;
-      if (mer->dwControlKeyState & SHIFT_PRESSED)
-        event->mouse.modifiers |= TERM_MD_SHIFT;
 
-    } break;
+/* Draw the lines from the top line to the cells of the rectangle. */
+void term_viewer_draw(term_Viewer* viewer, term_Vec pos, term_Vec size);
 
-    case WINDOW_BUFFER_SIZE_EVENT: {
-    #if ! NO_WINDOW_RESIZE_EVENT
-      WINDOW_BUFFER_SIZE_RECORD* wbs = &ir.Event.WindowBufferSizeEvent;
-      event->type = TERM_ET_RESIZE;
-      term_Vec newsize = term_vec(wbs->dwSize.X, wbs->dwSize.Y);
-      if (_ctx.screensize.x == newsize.x && _ctx.screensize.y == newsize.y) return false;
-      _ctx.screensize = newsize;
-      event->resize = _ctx.screensize;
-    #else
-      return false;
-    #endif
-    } break;
 
-    /* Not handling as it's not available in *nix. */
-    case MENU_EVENT:
-    case FOCUS_EVENT:
-      return false;
-  }
+/* Scroll by the number of lines (negative is up), stops at the last line. */
+void term_viewer_scroll(term_Viewer* viewer, int64_t lines);
 
-  return event->type != TERM_ET_UNKNOWN;
-}
 
-#elif defined(TERM_SYS_NIX)
+/* Scroll horizontally by the number of columns (negative is left). */
+void term_viewer_hscroll(term_Viewer* viewer, int columns);
 
-/* Returns the length of an escape sequence. */
-static int _escape_length(const char* buff, uint32_t size) {
-  int length = 0;
 
-  while (length < size) {
-    char c = buff[length++];
+/*
+ * Jump to the line (from 0) or the last line if there are fewer. Lines past
+ * the index are scanned from the last indexed line.
+ */
+void term_viewer_goto_line(term_Viewer* viewer, uint64_t line);
 
-    if (BETWEEN('a', c, 'z') || BETWEEN('A', c, 'Z') || (c == '~')) {
-      if (c == 'O' && length < size) {
-        c = buff[length];
-        if (BETWEEN('A', c, 'D') || BETWEEN('P', c, 'S') || c == 'F' || c == 'H') {
-          return length + 1;
-        }
-      }
 
-      return length;
+/* Jump to the line at the percent (0 to 100) of the file size. */
+void term_viewer_goto_percent(term_Viewer* viewer, double percent);
 
-    } else if (c == '\x1b') {
-      return length;
-    }
-  }
 
-  return length;
-}
+/* Get the position of the viewer and the progress of the index. */
+void term_viewer_info(term_Viewer* viewer, term_ViewerInfo* info);
 
+#endif /* TERM_VIEWER */
 
-static void _key_event(char c, term_Event* event) {
-  event->type = TERM_ET_KEY_DOWN;
-  event->key.ascii = c;
 
-  /* Note: Ctrl+M and <enter> both reads as '\r'. */
-  if (c == '\r') { event->key.code = TERM_KC_ENTER; return; }
-  if (c == 127) { event->key.code = TERM_KC_BACKSPACE; return; }
-  if (c == 9) { event->key.code = TERM_KC_TAB; return; }
-  if (c == 32) { event->key.code = TERM_KC_SPACE; return; }
+#ifdef TERM_STATS
 
-  event->key.code = (term_KeyCode) c;
+/*****************************************************************************/
+/* STATISTICS                                                                */
+/*****************************************************************************/
 
-  /* Ctrl + key */
-  if (1 <= c && c <= 26) {
-    event->key.modifiers |= TERM_MD_CTRL;
-    event->key.code = (term_KeyCode)('A' + (c - 1));
+/* Types of the written escape sequences. */
+typedef enum {
+  TERM_SEQ_CURSOR, /* Cursor movement (CUP, CUF, ...). */
+  TERM_SEQ_STYLE,  /* SGR. */
+  TERM_SEQ_ERASE,  /* EL, ED and ECH. */
+  TERM_SEQ_REPEAT, /* REP. */
+  TERM_SEQ_SCROLL, /* Scroll region and scrolling. */
+  TERM_SEQ_MODE,   /* Mode set and reset. */
+  TERM_SEQ_OTHER,  /* Queries, strings and the rest. */
+  TERM_SEQ_COUNT,
+} term_SeqType;
 
-  } else if (BETWEEN('a', c, 'z') || BETWEEN('A', c, 'Z') || BETWEEN('0', c, '9')) {
-    event->key.code = (term_KeyCode) toupper(c);
-    if (BETWEEN('A', c, 'Z')) event->key.modifiers |= TERM_MD_SHIFT;
-  }
-}
 
+/* Number of the histogram buckets. */
+#define TERM_HIST_BUCKETS 24
 
-/* Reference: https://invisible-island.net/xterm/ctlseqs/ctlseqs.html#h2-Mouse-Tracking */
-static void _mouse_event(const char* buff, uint32_t count, term_Event * event) {
+/*
+ * Histogram of power of 2 buckets, the bucket 0 counts the 0 values, the
+ * bucket i counts the values in [2^(i-1), 2^i) and the last one the rest.
+ */
+typedef struct {
+  uint64_t count, sum, max;
+  uint64_t buckets[TERM_HIST_BUCKETS];
+} term_Histogram;
 
-  /* buff = cb ; cx ; cy m|M */
 
-  const char* c = buff;
-  if (!(BETWEEN('0', *c, '9'))) return;
+/* Counters of a context, the input counters are only collected on *nix. */
+typedef struct {
+  uint64_t bytes_written; /* Bytes flushed to the terminal. */
+  uint64_t write_calls; /* write() calls, including the writer thread. */
+  uint64_t sequences[TERM_SEQ_COUNT]; /* Written escape sequences by type. */
+  uint64_t frames; /* Rendered frames. */
+  uint64_t cells_diffed; /* Cells compared with the front grid. */
+  uint64_t cells_emitted; /* Cells written to the terminal. */
+  term_Histogram frame_us; /* Time to build a frame in microseconds. */
+  term_Histogram flush_us; /* Time to flush the output in microseconds. */
 
-  int cb = 0, cx = 0, cy = 0;
-  char m;
+  uint64_t input_bytes; /* Bytes read from the input. */
+  uint64_t events_parsed; /* Events parsed from the input. */
+  uint64_t events_dropped; /* Events not reported (masked, unknown, ...). */
+  uint64_t events_coalesced; /* Mouse reports merged into another event. */
+  term_Histogram parse_ns; /* Time to parse an event in nanoseconds. */
+} term_Stats;
 
-  while (BETWEEN('0', *c, '9')) cb = cb * 10 + (*c++ - '0');
-  if (*c++ != ';') return;
-  while (BETWEEN('0', *c, '9')) cx = cx * 10 + (*c++ - '0');
-  if (*c++ != ';') return;
-  while (BETWEEN('0', *c, '9')) cy = cy * 10 + (*c++ - '0');
 
-  m = *c++;
-  if (m != 'm' && m != 'M') return;
+/* Copy the counters since the context was created or reset. */
+void term_stats(term_Ctx* ctx, term_Stats* stats);
+
+
+/* Reset the counters to zero. */
+void term_stats_reset(term_Ctx* ctx);
+
+
+/* Write the counters as text to the file descriptor. */
+void term_stats_dump(term_Ctx* ctx, int fd);
+
+
+/*
+ * Dump the counters to the file descriptor every interval (checked after
+ * each term_render()), 0 disables the periodic dump.
+ */
+void term_set_stats_dump(term_Ctx* ctx, int fd, int interval_ms);
+
+#endif /* TERM_STATS */
+
+
+#ifdef TERM_DRAW_QUEUE
+
+/*****************************************************************************/
+/* DRAW QUEUE                                                                */
+/*****************************************************************************/
+
+/*
+ * The context isn't thread safe, so a worker thread draws by submitting
+ * batches of cells to the context's lock-free queue, which are applied in
+ * the submission order by term_apply_batches() on the render thread
+ * (term_render() calls it). Each worker thread owns a producer, which
+ * allocates the batches from its own ring arena, so the workers never
+ * contend with each other or with the render thread except for a single
+ * atomic exchange per batch.
+ *
+ * The cells of a batch can't be graphemes created on the worker thread since
+ * term_grapheme() isn't thread safe, but the grapheme values created on the
+ * render thread can be used.
+ */
+typedef struct term_Producer term_Producer;
+typedef struct term_Batch term_Batch;
+
+
+/*
+ * Create a producer for the calling thread with an arena of the size in bytes
+ * (0 for the default 256 KiB), returns NULL if it couldn't be allocated.
+ */
+term_Producer* term_producer_new(term_Ctx* ctx, uint32_t arena_size);
+
+
+/*
+ * Free the producer, the arena is freed once its submitted batches are
+ * applied (or the context is freed).
+ */
+void term_producer_free(term_Producer* producer);
+
+
+/*
+ * Begin a batch to update the rectangle of the grid, its cells are blank.
+ * A producer has a single batch at a time which should be submitted before
+ * the next one. Returns NULL if the arena doesn't have the space till the
+ * render thread applies the submitted batches.
+ */
+term_Batch* term_batch_begin(term_Producer* producer, term_Vec pos, term_Vec size);
+
+
+/* Set a cell of the batch, the position is relative to the rectangle. */
+void term_batch_setcell(term_Batch* batch, term_Vec pos, term_Cell cell);
+
+
+/* Submit the batch to the queue of the context. */
+void term_batch_submit(term_Batch* batch);
+
+
+/* Apply the submitted batches to the grid, call it on the render thread. */
+void term_apply_batches(term_Ctx* ctx);
+
+#endif /* TERM_DRAW_QUEUE */
+
+
+/*****************************************************************************/
+/* INTERNAL HEADERS AND MACROS                                               */
+/*****************************************************************************/
+
+#ifdef TERM_IMPLEMENT
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #define TERM_SYS_WIN
+#else
+  #define TERM_SYS_NIX
+#endif
+
+/* Platform specific includes */
+#if defined(TERM_SYS_WIN)
+  #include <windows.h>
+  #include <io.h>
+#elif defined(TERM_SYS_NIX)
+  #include <poll.h>
+  #include <termios.h>
+  #include <time.h>
+  #include <sys/ioctl.h>
+  #include <sys/stat.h>
+  #if defined(TERM_WRITER_THREAD) || defined(TERM_VIEWER)
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <stdatomic.h>
+  #endif
+  #ifdef TERM_VIEWER
+    #include <sys/mman.h>
+    #ifdef __SSE2__
+      #include <emmintrin.h>
+    #endif
+  #endif
+#endif
+
+#ifdef TERM_DRAW_QUEUE
+  #include <stdatomic.h>
+#endif
+
+/*
+ * The cells are encoded with utf8.h which is implemented here, if it's
+ * already implemented in another source define TERM_NO_UTF8_IMPLEMENT.
+ */
+#ifndef TERM_NO_UTF8_IMPLEMENT
+  #define UTF8_IMPLEMENT
+#endif
+#include "utf8.h"
+
+#if defined(_MSC_VER) || (defined(TERM_SYS_WIN) && defined(__TINYC__))
+  #include <io.h>
+  #define read _read
+  #define write _write
+  #define isatty _isatty
+#else
+  #include <unistd.h>
+#endif
+
+/*
+ * On *nix window resize are signals, not events so we cannot use readEvent()
+ * function to read, and a signal can't tell which terminal was resized. The
+ * size is queried from the terminal instead and a change is reported as an
+ * event (see _check_resize()) whatever this value is. On windows define
+ * this as 0 to read the console's resize events.
+ */
+#define NO_WINDOW_RESIZE_EVENT 1
+
+/*
+ * In older version of windows some terminal attributes are not defined
+ * So I'm defining everyting here if they're not already.
+ *
+ * Note that I have no idea which macros are not defined and not, I'm just
+ * re-defining every this looks suspicious.
+ */
+#ifdef TERM_SYS_WIN
+
+  #ifndef ENABLE_VIRTUALINAL_PROCESSING
+    #define ENABLE_VIRTUALINAL_PROCESSING 0x0004
+  #endif
+
+  #ifndef ENABLE_EXTENDED_FLAGS
+    #define ENABLE_EXTENDED_FLAGS 0x0080
+  #endif
+
+  #ifndef FROM_LEFT_1ST_BUTTON_PRESSED
+    #define FROM_LEFT_1ST_BUTTON_PRESSED 0x0001
+  #endif
+
+  #ifndef RIGHTMOST_BUTTON_PRESSED
+    #define RIGHTMOST_BUTTON_PRESSED 0x0002
+  #endif
+
+  #ifndef FROM_LEFT_2ND_BUTTON_PRESSED
+    #define FROM_LEFT_2ND_BUTTON_PRESSED 0x0004
+  #endif
+
+  #ifndef MOUSE_MOVED
+    #define MOUSE_MOVED 0x0001
+  #endif
+
+  #ifndef DOUBLE_CLICK
+    #define DOUBLE_CLICK 0x0002
+  #endif
+
+  #ifndef MOUSE_WHEELED
+    #define MOUSE_WHEELED 0x0004
+  #endif
+
+  #ifndef LEFT_ALT_PRESSED
+    #define LEFT_ALT_PRESSED 0x0002
+  #endif
+
+  #ifndef RIGHT_ALT_PRESSED
+    #define RIGHT_ALT_PRESSED 0x0001
+  #endif
+
+  #ifndef RIGHT_CTRL_PRESSED
+    #define RIGHT_CTRL_PRESSED 0x0004
+  #endif
+
+  #ifndef LEFT_CTRL_PRESSED
+    #define LEFT_CTRL_PRESSED 0x0008
+  #endif
+
+  #ifndef SHIFT_PRESSED
+    #define SHIFT_PRESSED 0x0010
+  #endif
+
+#endif /* TERM_SYS_WIN */
+
+/* Input read buffer size. */
+#define INPUT_BUFF_SZ 256
+
+/* Maximum size the input buffer grows to while waiting for a reply. */
+#define INPUT_BUFF_MAX (64 * 1024)
+
+/* Output buffer size. */
+#define OUTPUT_BUFF_SZ (64 * 1024)
+
+/* Maximum bytes of the text formatted by term_put(). */
+#define PUT_BUFF_SZ 512
+
+/* Maximum time to wait for the terminal to reply a query in milliseconds. */
+#define PROBE_TIMEOUT_MS 200
+
+/* Maximum time term_getposition() waits for the reply in milliseconds. */
+#define POSITION_TIMEOUT_MS 1000
+
+/* Maximum number of terminals in the capability cache file. */
+#define CAPS_CACHE_MAX 64
+
+/* Maximum time term_read_event() waits for an input in milliseconds. */
+#define INPUT_WAIT_MS 100
+
+/* Default time to wait for the rest of an escape sequence in milliseconds. */
+#define ESC_TIMEOUT_MS 25
+
+/* Default arena size of a draw queue producer in bytes. */
+#define DRAW_ARENA_SZ (256 * 1024)
+
+/* Writer thread queue size in bytes, must be a power of 2. */
+#define WRITER_QUEUE_SZ (1024 * 1024)
+
+/* Maximum time to wait for the writer thread to drain the queue on stop. */
+#define WRITER_DRAIN_MS 1000
+
+/* Number of lines between the offsets of the viewer line index. */
+#define VIEWER_INDEX_STRIDE 4096
+
+/* Bytes the viewer scans before dropping the scanned pages. */
+#define VIEWER_CHUNK_SZ (4 * 1024 * 1024)
+
+/* Tab stop width of the viewer. */
+#define VIEWER_TAB_SZ 8
+
+
+/* Returns predicate (a <= c <= b). */
+#define BETWEEN(a, c, b) ((a) <= (c) && (c) <= (b))
+
+/* Update the statistics, compiled out without TERM_STATS. */
+#ifdef TERM_STATS
+  #define _STAT(expr) do { expr; } while (false)
+  #define _STAT_START(name) int64_t name = _time_ns()
+#else
+  #define _STAT(expr) do {} while (false)
+  #define _STAT_START(name) do {} while (false)
+#endif
+
+/*****************************************************************************/
+/* TYPEDEFINES AND DECLARATIONS                                              */
+/*****************************************************************************/
+
+
+#define _veceq(v1, v2) (((v1.x) == (v2).x) && ((v1).y == (v2).y))
+
+/* Packed cell of the grids, the style is an offset in the style table. */
+typedef struct {
+  uint32_t ch;
+  uint32_t style;
+} _Cell;
+
+
+/* Style of the cells, interned in the style table. */
+typedef term_Style _Style;
+
+
+/*
+ * Interned byte strings (upto 255 bytes), each entry is a length byte
+ * followed by the bytes and its id is the offset of the entry in the data.
+ */
+typedef struct {
+  uint8_t* data;
+  uint32_t size, capacity;
+  uint32_t* map; /* Open addressing hash table of ids + 1, 0 if empty. */
+  uint32_t map_cap; /* Power of 2. */
+  uint32_t count;
+} _Intern;
+
+
+#ifdef TERM_HEADLESS
+/* In-memory screen of the headless contexts. */
+typedef struct {
+  term_Vec size;
+  term_Cell* cells;
+  term_Vec cursor;
+  bool wrap_pending; /* The cursor is past the last column. */
+  int top, bottom; /* Scroll region. */
+  term_Cell pen; /* Current style, the ch is not used. */
+  uint32_t last_ch; /* Last written character for REP. */
+  uint8_t seq[64]; /* Incomplete escape sequence or utf8 character. */
+  uint32_t seqc;
+  uint64_t bytes;
+} _Screen;
+#endif
+
+
+#ifdef TERM_DRAW_QUEUE
+/* Link of the draw queue, the first member of the batches. */
+typedef struct _DrawNode {
+  _Atomic(struct _DrawNode*) next;
+} _DrawNode;
+#endif
+
+
+struct term_Layer {
+  term_Ctx* ctx;
+  term_Vec pos, size;
+  int z;
+  bool visible;
+  _Cell* cells;
+  term_Layer* next; /* Next layer in the z order. */
+};
+
+
+struct term_Ctx {
+
+  int in_fd, out_fd; /* Bound file descriptors. */
+
+#if defined(TERM_SYS_WIN)
+  DWORD outmode, inmode; /* Backup modes. */
+  HANDLE h_out, h_in; /* Handles. */
+  DWORD mouse_buttons; /* Last state to compare if a new button pressed. */
+
+#elif defined(TERM_SYS_NIX)
+  struct termios tios; /* Backup modes. */
+  uint8_t* buff; /* Input buffer, buff_inline or grown by _buff_reserve(). */
+  int32_t buffc; /* Buffer element count. */
+  int32_t buff_size; /* Buffer capacity. */
+  uint8_t buff_inline[INPUT_BUFF_SZ];
+  int esc_timeout; /* Escape timeout in milliseconds. */
+
+#ifdef TERM_WRITER_THREAD
+  pthread_t writer; /* Writer thread, valid if writer_running. */
+  bool writer_running;
+  char* queue; /* Output queue ring buffer (WRITER_QUEUE_SZ). */
+  _Atomic uint32_t queue_head; /* Written count, updated by the writer. */
+  _Atomic uint32_t queue_tail; /* Pushed count, updated by the caller. */
+  atomic_bool writer_stop;
+  int wake[2]; /* Pipe to wake up the writer thread. */
+  int writer_fd; /* Non blocking output of the writer, see _writer_open(). */
+  int out_flags; /* Backup file status flags of out_fd if it's writer_fd. */
+#ifdef TERM_STATS
+  _Atomic uint64_t writer_calls; /* write() calls of the writer thread. */
+#endif
+#endif
+
+#ifdef TERM_REPLAY
+  FILE* record; /* Input record file. */
+  int64_t record_time; /* Time of the last record in microseconds. */
+  FILE* replay; /* Replayed input file. */
+  bool replay_realtime;
+  int64_t replay_start; /* Time the replay started in microseconds. */
+  int64_t replay_time; /* Time of the pending record from the start. */
+  uint8_t replay_data[INPUT_BUFF_SZ]; /* Pending record bytes. */
+  uint32_t replay_count, replay_offset;
+#endif
+#endif
+
+#ifdef TERM_HEADLESS
+  _Screen* screen; /* In-memory screen, NULL if bound to a terminal. */
+#endif
+
+  char outbuff[OUTPUT_BUFF_SZ]; /* Output buffer. */
+  uint32_t outc; /* Output buffer element count. */
+  bool out_dropped; /* Output dropped since the last full redraw. */
+  bool out_resync; /* Cancel the partial sequence before the next output. */
+  
+  term_Vec screensize;
+  bool resize_pending; /* The screensize changed and wasn't reported yet. */
+  term_Vec mousepos;
+  
+  term_Vec cursor; /* Shadow cursor, valid if cursor_known. */
+  bool cursor_known;
+  int position_pending; /* Number of position requests not replied yet. */
+
+  term_KeyboardFlags kb_flags; /* Requested keyboard enhancement flags. */
+  term_KeyboardFlags kb_active; /* Flags acknowledged by the terminal. */
+  int last_key; /* Last pressed key to detect the repeats on windows. */
+
+  term_Caps caps; /* Terminal capabilities. */
+  char version[64]; /* XTVERSION reply. */
+  char caps_cache[256]; /* Capability cache file, "" for the default. */
+  bool caps_cache_off; /* Capability cache is disabled. */
+  bool in_frame; /* Between term_begin_frame() and term_end_frame(). */
+
+  term_Vec gridsize; /* Size of the cell grids. */
+  _Cell* base; /* Cells drawn by term_setcell() (same as back without layers). */
+  _Cell* back; /* Cells to be rendered. */
+  _Cell* front; /* Cells that are on the terminal. */
+  uint64_t* back_hash; /* Hash of each row of the back grid. */
+  uint64_t* front_hash; /* Hash of each row of the front grid. */
+  term_Vec* damage; /* Damaged columns of each row (x: first, y: last). */
+  bool damaged; /* Any damage since the last render. */
+  term_Layer* layers; /* Layers in ascending z order. */
+
+  _Intern styles; /* Style table, the default style is at 0. */
+  _Intern graphemes; /* Grapheme arena. */
+  _Style last_style; /* Last interned style and its id to skip the lookup. */
+  uint32_t last_style_id;
+
+  int frame_interval; /* Minimum time between scheduled frames in ms. */
+  int64_t last_frame; /* Time of the last render. */
+
+  unsigned int event_mask; /* Events to report, see TERM_EVENT_BIT(). */
+  term_Coalesce coalesce;
+
+  bool capture_events;
+  bool initialized;
+
+#ifdef TERM_DRAW_QUEUE
+  _DrawNode* draw_head; /* Oldest node, only used by the render thread. */
+  _Atomic(_DrawNode*) draw_tail; /* Newest node, exchanged by the producers. */
+  _DrawNode draw_stub; /* Keeps the queue non empty. */
+#endif
+
+#ifdef TERM_STATS
+  term_Stats stats;
+  int seq_state; /* State of the escape sequence scanner of the output. */
+  int stats_fd; /* Periodic dump file descriptor. */
+  int stats_interval; /* Periodic dump interval in ms, 0 if disabled. */
+  int64_t stats_last; /* Time of the last periodic dump. */
+#endif
+  
+};
+
+static void _init(term_Ctx* ctx);
+static void _cleanup(term_Ctx* ctx); 
+static term_Vec _getsize(term_Ctx* ctx);
+
+#ifdef TERM_SYS_NIX
+static bool _take_position_report(term_Ctx* ctx, term_Vec* pos);
+static bool _buff_fill(term_Ctx* ctx, int timeout_ms);
+static bool _buff_reserve(term_Ctx* ctx);
+static void _probe_terminal(term_Ctx* ctx);
+#ifdef TERM_WRITER_THREAD
+static void _writer_flush(term_Ctx* ctx);
+#endif
+#endif
+
+#ifdef TERM_HEADLESS
+static void _screen_feed(term_Ctx* ctx, const uint8_t* data, uint32_t size);
+#endif
+
+#if defined(TERM_REPLAY) && defined(TERM_SYS_NIX)
+static void _record(term_Ctx* ctx, const uint8_t* data, uint32_t size);
+static bool _replay_fill(term_Ctx* ctx, int timeout_ms);
+#endif
+
+static bool _read_event(term_Ctx* ctx, term_Event* event, int wait_ms);
+
+#ifdef TERM_DRAW_QUEUE
+static void _draw_drain(term_Ctx* ctx, bool apply);
+#endif
+
+static void _grid_free(term_Ctx* ctx);
+static uint32_t _intern(_Intern* in, const void* bytes, uint32_t length);
+static void _intern_free(_Intern* in);
+
+
+/* Returns the monotonic time in milliseconds. */
+static int64_t _time_ms() {
+#if defined(TERM_SYS_WIN)
+  return (int64_t) GetTickCount64();
+#elif defined(TERM_SYS_NIX)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+
+#if defined(TERM_STATS) || defined(TERM_REPLAY)
+
+/* Returns the monotonic time in nanoseconds. */
+static int64_t _time_ns() {
+#if defined(TERM_SYS_WIN)
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (int64_t) (counter.QuadPart * (1000000000.0 / frequency.QuadPart));
+#elif defined(TERM_SYS_NIX)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#endif
+
+
+#ifdef TERM_STATS
+
+static void _hist_add(term_Histogram* hist, int64_t value) {
+  uint64_t v = (value < 0) ? 0 : (uint64_t) value;
+  int bucket = 0;
+  while (bucket < TERM_HIST_BUCKETS - 1 && v >= ((uint64_t) 1 << bucket)) bucket++;
+  hist->buckets[bucket]++;
+  hist->count++;
+  hist->sum += v;
+  if (v > hist->max) hist->max = v;
+}
+
+
+/*
+ * Count the escape sequences of the output by their type. The sequences can
+ * be split between the flushes so the scanner state is kept in the context:
+ * 0: text, 1: after ESC, 2: CSI, 3: string (DCS, OSC, ...), 4: ESC in a
+ * string.
+ */
+static void _stats_output(term_Ctx* ctx, const char* data, uint32_t size) {
+  ctx->stats.bytes_written += size;
+  uint64_t* seqs = ctx->stats.sequences;
+
+  for (uint32_t i = 0; i < size; i++) {
+    char c = data[i];
+    if (c == '\x18') { ctx->seq_state = 0; continue; } /* CAN. */
+
+    switch (ctx->seq_state) {
+      case 0:
+        if (c == '\x1b') ctx->seq_state = 1;
+        break;
+
+      case 1:
+        if (c == '[') ctx->seq_state = 2;
+        else if (c == 'P' || c == ']' || c == '_' || c == '^') ctx->seq_state = 3;
+        else { seqs[TERM_SEQ_OTHER]++; ctx->seq_state = 0; }
+        break;
+
+      case 2:
+        if (!BETWEEN('@', c, '~')) break; /* Parameter or intermediate. */
+        switch (c) {
+          case 'H': case 'f': case 'A': case 'B': case 'C': case 'D': case 'G': case 'd':
+            seqs[TERM_SEQ_CURSOR]++; break;
+          case 'm': seqs[TERM_SEQ_STYLE]++; break;
+          case 'K': case 'J': case 'X': seqs[TERM_SEQ_ERASE]++; break;
+          case 'b': seqs[TERM_SEQ_REPEAT]++; break;
+          case 'r': case 'S': case 'T': seqs[TERM_SEQ_SCROLL]++; break;
+          case 'h': case 'l': seqs[TERM_SEQ_MODE]++; break;
+          default: seqs[TERM_SEQ_OTHER]++; break;
+        }
+        ctx->seq_state = 0;
+        break;
+
+      case 3:
+        if (c == '\x07') { seqs[TERM_SEQ_OTHER]++; ctx->seq_state = 0; }
+        else if (c == '\x1b') ctx->seq_state = 4;
+        break;
+
+      case 4:
+        seqs[TERM_SEQ_OTHER]++;
+        ctx->seq_state = 0;
+        break;
+    }
+  }
+}
+
+#endif /* TERM_STATS */
+
+
+/*****************************************************************************/
+/* OUTPUT                                                                    */
+/*****************************************************************************/
+
+
+/* Write the output buffer to the output file descriptor. */
+static void _out_drain(term_Ctx* ctx) {
+#ifdef TERM_HEADLESS
+  if (ctx->screen != NULL) {
+    _screen_feed(ctx, (const uint8_t*) ctx->outbuff, ctx->outc);
+    ctx->outc = 0;
+    return;
+  }
+#endif
+
+#if defined(TERM_SYS_NIX) && defined(TERM_WRITER_THREAD)
+  if (ctx->writer_running) {
+    _writer_flush(ctx);
+    return;
+  }
+#endif
+
+  uint32_t done = 0;
+
+  while (done < ctx->outc) {
+    _STAT(ctx->stats.write_calls++);
+    int count = write(ctx->out_fd, ctx->outbuff + done, ctx->outc - done);
+    if (count >= 0) {
+      done += count;
+      continue;
+    }
+
+#if defined(TERM_SYS_NIX)
+    if (errno == EINTR) continue;
+
+    /* Non blocking file descriptor, wait till it's writable. */
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      struct pollfd pfd;
+      pfd.fd = ctx->out_fd;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, -1) > 0) continue;
+    }
+#endif
+
+    break; /* The terminal is gone, drop the output. */
+  }
+
+  ctx->outc = 0;
+}
+
+
+static void _out_flush(term_Ctx* ctx) {
+#ifdef TERM_STATS
+  if (ctx->outc == 0) {
+    _out_drain(ctx);
+    return;
+  }
+  int64_t start = _time_ns();
+  _stats_output(ctx, ctx->outbuff, ctx->outc);
+  _out_drain(ctx);
+  _hist_add(&ctx->stats.flush_us, (_time_ns() - start) / 1000);
+#else
+  _out_drain(ctx);
+#endif
+}
+
+
+static void _out_write(term_Ctx* ctx, const char* data, uint32_t size) {
+  while (size > 0) {
+    if (ctx->outc == OUTPUT_BUFF_SZ) _out_flush(ctx);
+
+    uint32_t count = OUTPUT_BUFF_SZ - ctx->outc;
+    if (count > size) count = size;
+
+    memcpy(ctx->outbuff + ctx->outc, data, count);
+    ctx->outc += count;
+    data += count;
+    size -= count;
+  }
+}
+
+
+static void _out_puts(term_Ctx* ctx, const char* str) {
+  _out_write(ctx, str, (uint32_t) strlen(str));
+}
+
+
+static void _out_vprintf(term_Ctx* ctx, const char* fmt, va_list args) {
+  va_list copy;
+  va_copy(copy, args);
+  int count = vsnprintf(ctx->outbuff + ctx->outc, OUTPUT_BUFF_SZ - ctx->outc, fmt, copy);
+  va_end(copy);
+
+  if (count < 0) return;
+  if (ctx->outc + count < OUTPUT_BUFF_SZ) {
+    ctx->outc += count;
+    return;
+  }
+
+  /* Doesn't fit, flush and try again (if it's still too long it'll be cut). */
+  _out_flush(ctx);
+  count = vsnprintf(ctx->outbuff, OUTPUT_BUFF_SZ, fmt, args);
+  if (count < 0) return;
+  ctx->outc = (count < OUTPUT_BUFF_SZ) ? count : OUTPUT_BUFF_SZ - 1;
+}
+
+
+static void _out_printf(term_Ctx* ctx, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  _out_vprintf(ctx, fmt, args);
+  va_end(args);
+}
+
+
+/*****************************************************************************/
+/* IMPLEMENTATIONS                                                           */
+/*****************************************************************************/
+
+
+term_Ctx* term_ctx_new(int in_fd, int out_fd) {
+  term_Ctx* ctx = (term_Ctx*) calloc(1, sizeof(term_Ctx));
+  if (ctx == NULL) return NULL;
+
+  ctx->in_fd = in_fd;
+  ctx->out_fd = out_fd;
+  ctx->event_mask = TERM_EVENT_ALL;
+#if defined(TERM_SYS_NIX)
+  ctx->esc_timeout = ESC_TIMEOUT_MS;
+  ctx->buff = ctx->buff_inline;
+  ctx->buff_size = INPUT_BUFF_SZ;
+#endif
+
+  /* The default style is the first entry of the style table. */
+  _Style style = { TERM_COLOR_DEFAULT, TERM_COLOR_DEFAULT, TERM_ATTR_NONE };
+  ctx->last_style = style;
+  ctx->last_style_id = _intern(&ctx->styles, &style, sizeof(_Style));
+  assert(ctx->last_style_id == 0);
+
+#ifdef TERM_DRAW_QUEUE
+  atomic_init(&ctx->draw_stub.next, NULL);
+  atomic_init(&ctx->draw_tail, &ctx->draw_stub);
+  ctx->draw_head = &ctx->draw_stub;
+#endif
+
+  return ctx;
+}
+
+
+void term_ctx_free(term_Ctx* ctx) {
+  if (ctx == NULL) return;
+#ifdef TERM_WRITER_THREAD
+  term_stop_writer(ctx);
+#endif
+#ifdef TERM_DRAW_QUEUE
+  _draw_drain(ctx, false);
+#endif
+  while (ctx->layers != NULL) {
+    term_Layer* layer = ctx->layers;
+    ctx->layers = layer->next;
+    free(layer->cells);
+    free(layer);
+  }
+  _grid_free(ctx);
+#if defined(TERM_SYS_NIX)
+  if (ctx->buff != ctx->buff_inline) free(ctx->buff);
+#endif
+#if defined(TERM_REPLAY) && defined(TERM_SYS_NIX)
+  if (ctx->record != NULL) fclose(ctx->record);
+  if (ctx->replay != NULL) fclose(ctx->replay);
+#endif
+#ifdef TERM_HEADLESS
+  if (ctx->screen != NULL) free(ctx->screen->cells);
+  free(ctx->screen);
+#endif
+  _intern_free(&ctx->styles);
+  _intern_free(&ctx->graphemes);
+  free(ctx);
+}
+
+
+bool term_isatty(term_Ctx* ctx) {
+  return (!!isatty(ctx->out_fd)) && (!!isatty(ctx->in_fd));
+}
+
+
+void term_init(term_Ctx* ctx, bool capture_events) {
+  ctx->capture_events = capture_events;
+  
+#ifdef TERM_HEADLESS
+  if (ctx->screen == NULL) _init(ctx);
+#else
+  _init(ctx);
+#endif
+  
+  ctx->screensize = _getsize(ctx);
+  ctx->initialized = true;
+}
+
+
+void term_cleanup(term_Ctx* ctx) {
+  assert(ctx->initialized);
+#ifdef TERM_WRITER_THREAD
+  term_stop_writer(ctx);
+#endif
+#ifdef TERM_HEADLESS
+  if (ctx->screen == NULL) _cleanup(ctx);
+#else
+  _cleanup(ctx);
+#endif
+  ctx->initialized = false;
+}
+
+
+bool term_read_event(term_Ctx* ctx, term_Event* event) {
+  int wait = INPUT_WAIT_MS;
+
+  /* Render the damage if the frame is due, otherwise wait till it's due. */
+  if (ctx->frame_interval > 0 && (ctx->damaged || ctx->out_dropped)) {
+    int64_t due = ctx->last_frame + ctx->frame_interval - _time_ms();
+    if (due <= 0) term_render(ctx);
+    else if (due < wait) wait = (int) due;
+  }
+
+  return _read_event(ctx, event, wait);
+}
+
+
+void term_set_event_mask(term_Ctx* ctx, unsigned int mask) {
+  ctx->event_mask = mask;
+}
+
+
+void term_set_coalesce(term_Ctx* ctx, term_Coalesce flags) {
+  ctx->coalesce = flags;
+}
+
+
+void term_set_escape_timeout(term_Ctx* ctx, int ms) {
+#if defined(TERM_SYS_NIX)
+  ctx->esc_timeout = ms;
+#endif
+}
+
+
+void term_enable_kitty_keyboard(term_Ctx* ctx, term_KeyboardFlags flags) {
+  ctx->kb_flags = flags;
+
+#if defined(TERM_SYS_WIN)
+  ctx->kb_active = flags;
+
+#elif defined(TERM_SYS_NIX)
+  /*
+   * Push the flags to the terminal's stack and query the current flags, the
+   * reply (ESC[?<flags>u) only comes from terminals that support it.
+   */
+  _out_printf(ctx, "\x1b[>%iu\x1b[?u", (int) flags);
+  _out_flush(ctx);
+#endif
+}
+
+
+term_KeyboardFlags term_keyboard_flags(term_Ctx* ctx) {
+  return ctx->kb_active;
+}
+
+
+term_Caps term_capabilities(term_Ctx* ctx) {
+  return ctx->caps;
+}
+
+
+const char* term_version(term_Ctx* ctx) {
+  return ctx->version;
+}
+
+
+void term_set_caps_cache(term_Ctx* ctx, const char* path) {
+  ctx->caps_cache_off = (path == NULL);
+  ctx->caps_cache[0] = '\0';
+  if (path != NULL) snprintf(ctx->caps_cache, sizeof(ctx->caps_cache), "%s", path);
+}
+
+
+#ifdef TERM_STATS
+
+void term_stats(term_Ctx* ctx, term_Stats* stats) {
+  *stats = ctx->stats;
+#if defined(TERM_SYS_NIX) && defined(TERM_WRITER_THREAD)
+  stats->write_calls += atomic_load_explicit(&ctx->writer_calls, memory_order_relaxed);
+#endif
+}
+
+
+void term_stats_reset(term_Ctx* ctx) {
+  memset(&ctx->stats, 0, sizeof(term_Stats));
+#if defined(TERM_SYS_NIX) && defined(TERM_WRITER_THREAD)
+  atomic_store_explicit(&ctx->writer_calls, 0, memory_order_relaxed);
+#endif
+}
+
+
+/*
+ * Write a histogram line: count, mean, max and the p50 / p99 upper bounds of
+ * their buckets.
+ */
+static int _hist_format(char* buff, int size, const char* name, const term_Histogram* hist) {
+  uint64_t p50 = 0, p99 = 0, seen = 0;
+  for (int i = TERM_HIST_BUCKETS - 1; i >= 0; i--) {
+    uint64_t upper = (i == 0) ? 0 : ((uint64_t) 1 << i) - 1;
+    if (upper > hist->max) upper = hist->max;
+    if ((hist->count - seen) * 2 >= hist->count) p50 = upper;
+    if ((hist->count - seen) * 100 >= hist->count * 99) p99 = upper;
+    seen += hist->buckets[i];
+  }
+  return snprintf(buff, size, "%-10s n=%llu mean=%.1f p50<=%llu p99<=%llu max=%llu\n", name,
+                  (unsigned long long) hist->count,
+                  hist->count ? (double) hist->sum / hist->count : 0.0,
+                  (unsigned long long) p50, (unsigned long long) p99,
+                  (unsigned long long) hist->max);
+}
+
+
+void term_stats_dump(term_Ctx* ctx, int fd) {
+  term_Stats st;
+  term_stats(ctx, &st);
+
+  char buff[1024];
+  int n = 0;
+  #define _APPEND(...) n += snprintf(buff + n, sizeof(buff) - n, __VA_ARGS__)
+  #define _U(v) ((unsigned long long) (v))
+
+  _APPEND("output    bytes=%llu writes=%llu frames=%llu cells diffed=%llu emitted=%llu\n",
+          _U(st.bytes_written), _U(st.write_calls), _U(st.frames),
+          _U(st.cells_diffed), _U(st.cells_emitted));
+  _APPEND("sequences cursor=%llu style=%llu erase=%llu repeat=%llu scroll=%llu mode=%llu other=%llu\n",
+          _U(st.sequences[TERM_SEQ_CURSOR]), _U(st.sequences[TERM_SEQ_STYLE]),
+          _U(st.sequences[TERM_SEQ_ERASE]), _U(st.sequences[TERM_SEQ_REPEAT]),
+          _U(st.sequences[TERM_SEQ_SCROLL]), _U(st.sequences[TERM_SEQ_MODE]),
+          _U(st.sequences[TERM_SEQ_OTHER]));
+  _APPEND("input     bytes=%llu events=%llu dropped=%llu coalesced=%llu\n",
+          _U(st.input_bytes), _U(st.events_parsed), _U(st.events_dropped),
+          _U(st.events_coalesced));
+  n += _hist_format(buff + n, sizeof(buff) - n, "frame_us", &st.frame_us);
+  n += _hist_format(buff + n, sizeof(buff) - n, "flush_us", &st.flush_us);
+  n += _hist_format(buff + n, sizeof(buff) - n, "parse_ns", &st.parse_ns);
+
+  #undef _APPEND
+  #undef _U
+
+  if (n > (int) sizeof(buff)) n = (int) sizeof(buff);
+  for (int done = 0; done < n;) {
+    int count = write(fd, buff + done, n - done);
+    if (count <= 0) break;
+    done += count;
+  }
+}
+
+
+void term_set_stats_dump(term_Ctx* ctx, int fd, int interval_ms) {
+  ctx->stats_fd = fd;
+  ctx->stats_interval = interval_ms;
+  ctx->stats_last = _time_ms();
+}
+
+#endif /* TERM_STATS */
+
+
+#if defined(TERM_SYS_WIN)
+static void _init(term_Ctx* ctx) {
+  ctx->h_out = (HANDLE) _get_osfhandle(ctx->out_fd);
+  GetConsoleMode(ctx->h_out, &ctx->outmode);
+
+  ctx->h_in = (HANDLE) _get_osfhandle(ctx->in_fd);
+  GetConsoleMode(ctx->h_in, &ctx->inmode);
+
+  DWORD outmode = (ctx->outmode | ENABLE_VIRTUALINAL_PROCESSING);
+  SetConsoleMode(ctx->h_out, outmode);
+
+  if (ctx->capture_events) {
+    DWORD inmode = ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT;
+    SetConsoleMode(ctx->h_in, inmode);
+  }
+}
+
+
+static void _cleanup(term_Ctx* ctx) {
+  SetConsoleMode(ctx->h_out, ctx->outmode);
+  SetConsoleMode(ctx->h_in, ctx->inmode);
+}
+
+
+#elif defined(TERM_SYS_NIX)
+static void _init(term_Ctx* ctx) {
+  tcgetattr(ctx->in_fd, &ctx->tios);
+  
+  struct termios raw = ctx->tios;
+  
+  /*
+   * ECHO   : It won't print character as we type.
+   * ICANON : Disable canonical mode, inputs will
+   *          be byte by byte instead of line by line.
+   * ISIG   : Disable Ctrl+C, Ctrl+Z
+   * IXON   : Disable Ctrl+S, Ctrl+Q
+   * IEXTEN : Disable Ctrl+V
+   * ICRNL  : Fix Ctrl+M. It won't convert '\r' into '\n' anymore.
+   * OPOST  : It won't convert '\n' into '\r\n' anymore.
+   * BRKINT : Disable break condition that'll send a SIGINT.
+   */
+  raw.c_lflag &= ~(ECHO | ICANON);
+  if (ctx->capture_events) {
+    /*raw.c_oflag &= ~(OPOST);*/
+    raw.c_iflag &= ~(IXON | ICRNL | BRKINT);
+    raw.c_lflag &= ~(ISIG | IEXTEN);
+  }
+  
+  /*
+   * VMIN  : Minimum number of bytes should be read before return from read().
+   * VTIME : Maximum amount of time to be wait before read() returns.
+   *         1 unit is 100 of a second (ie. vtime = n => 1/100 s)
+   *
+   * read() won't block since the waiting is done with poll() (which also
+   * works on WSL, where VTIME will wait till an input is read).
+   */
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+  
+  tcsetattr(ctx->in_fd, TCSAFLUSH, &raw);
+
+  _probe_terminal(ctx);
+  
+  /* Enable mouse events. */
+  if (ctx->capture_events) {
+    _out_printf(ctx, "\x1b[?1003h\x1b[?1006h");
+    _out_flush(ctx);
+  }
+}
+
+
+static void _cleanup(term_Ctx* ctx) {
+  
+  /* Disable mouse events. */
+  if (ctx->capture_events) {
+    _out_printf(ctx, "\x1b[?1003l\x1b[?1006l\x1b[?25h");
+  }
+
+  /* Pop the keyboard enhancement flags. */
+  if (ctx->kb_flags != TERM_KB_NONE) {
+    _out_printf(ctx, "\x1b[<u");
+  }
+  _out_flush(ctx);
+  
+  tcsetattr(ctx->in_fd, TCSAFLUSH, &ctx->tios);
+}
+
+
+#endif /* TERM_SYS_NIX */
+
+
+void term_new_screen_buffer(term_Ctx* ctx) {
+  _out_printf(ctx, "\x1b[?1049h");
+  ctx->cursor_known = false;
+}
+
+
+void term_restore_screen_buffer(term_Ctx* ctx) {
+  _out_printf(ctx, "\x1b[H\x1b[J"); /* Clear screen and go to (0, 0). */
+  _out_printf(ctx, "\x1b[?1049l");
+  ctx->cursor_known = false;
+}
+
+
+term_Vec term_getposition(term_Ctx* ctx) {
+    term_Vec pos;
+
+  #if defined(TERM_SYS_WIN)
+  CONSOLE_SCREEN_BUFFER_INFO binfo;
+  GetConsoleScreenBufferInfo(ctx->h_out, &binfo);
+  pos.x = binfo.dwCursorPosition.X;
+  pos.y = binfo.dwCursorPosition.Y;
+  return pos;
+
+  #elif defined(TERM_SYS_NIX)
+
+  /* The input that isn't a tty (ex: headless) has no modes to check. */
+  struct termios tio;
+  if (isatty(ctx->in_fd)) {
+    if (tcgetattr(ctx->in_fd, &tio) != 0) {
+      assert(false && "tcgetattr(in_fd) failed.");
+    }
+
+    tcsetattr(ctx->in_fd, TCSANOW, &tio);
+    assert(((tio.c_lflag & (ICANON | ECHO)) == 0)
+           && "Did you forget to call term_init()");
+  }
+
+  /*
+   * Request cursor position and wait for the reply, the input that was read
+   * while waiting stays in the buffer for the event parser (which grows if
+   * it's full). If the terminal doesn't reply in POSITION_TIMEOUT_MS, the
+   * last known position is returned and a late reply will be delivered as a
+   * TERM_ET_CURSOR_POSITION event.
+   */
+  term_request_position(ctx);
+
+  int64_t deadline = _time_ms() + POSITION_TIMEOUT_MS;
+  while (!_take_position_report(ctx, &pos)) {
+    int remaining = (int) (deadline - _time_ms());
+    if (remaining <= 0 || !_buff_reserve(ctx)) return ctx->cursor;
+
+    /* Without an input nothing could arrive (ex: headless). */
+    if (!_buff_fill(ctx, remaining) && ctx->in_fd < 0) return ctx->cursor;
+  }
+
+  #endif /* TERM_SYS_NIX */
+
+  return pos;
+}
+
+
+void term_setposition(term_Ctx* ctx, term_Vec pos) {
+  _out_printf(ctx, "\x1b[%i;%iH", pos.y + 1, pos.x + 1);
+  ctx->cursor = pos;
+  ctx->cursor_known = true;
+}
+
+
+void term_begin_frame(term_Ctx* ctx) {
+  assert(!ctx->in_frame && "term_end_frame() wasn't called.");
+  ctx->in_frame = true;
+  if (ctx->caps & TERM_CAP_SYNC_OUTPUT) _out_puts(ctx, "\x1b[?2026h");
+}
+
+
+void term_end_frame(term_Ctx* ctx) {
+  assert(ctx->in_frame && "term_begin_frame() wasn't called.");
+  ctx->in_frame = false;
+  if (ctx->caps & TERM_CAP_SYNC_OUTPUT) _out_puts(ctx, "\x1b[?2026l");
+  _out_flush(ctx);
+}
+
+
+void term_write(term_Ctx* ctx, const char* data, int size) {
+  _out_write(ctx, data, (uint32_t) size);
+}
+
+
+void term_printf(term_Ctx* ctx, const char* fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  _out_vprintf(ctx, fmt, args);
+  va_end(args);
+}
+
+
+void term_flush(term_Ctx* ctx) {
+  _out_flush(ctx);
+}
+
+
+void term_request_position(term_Ctx* ctx) {
+  ctx->position_pending++;
+
+#if defined(TERM_SYS_NIX)
+  /* The reply will be in the form of ESC[n;mR (see _parse_position_report). */
+  _out_printf(ctx, "\x1b[6n");
+  _out_flush(ctx);
+#endif
+}
+
+
+bool term_known_position(term_Ctx* ctx, term_Vec* pos) {
+  if (ctx->cursor_known) *pos = ctx->cursor;
+  return ctx->cursor_known;
+}
+
+
+/* Query the screen size, if it fails the last known size is returned. */
+static term_Vec _getsize(term_Ctx* ctx) {
+  term_Vec size;
+
+#if defined(TERM_SYS_WIN)
+  CONSOLE_SCREEN_BUFFER_INFO binfo;
+  if (!GetConsoleScreenBufferInfo(ctx->h_out, &binfo)) return ctx->screensize;
+  size.x = binfo.srWindow.Right - binfo.srWindow.Left + 1;
+  size.y = binfo.srWindow.Bottom - binfo.srWindow.Top + 1;
+
+#elif defined(TERM_SYS_NIX)
+  struct winsize wsize;
+  if (ioctl(ctx->out_fd, TIOCGWINSZ, &wsize) != 0) return ctx->screensize;
+  size.x = wsize.ws_col;
+  size.y = wsize.ws_row;
+#endif
+
+  return size;
+}
+
+
+/*
+ * Query the screen size and update ctx->screensize, a change is reported by
+ * the next _read_event() on *nix (so is a term_setsize() change).
+ */
+static void _check_resize(term_Ctx* ctx) {
+  term_Vec size = _getsize(ctx);
+  if (_veceq(size, ctx->screensize)) return;
+  ctx->screensize = size;
+  ctx->resize_pending = true;
+}
+
+
+term_Vec term_getsize(term_Ctx* ctx) {
+  _check_resize(ctx);
+  return ctx->screensize;
+}
+
+
+void term_setsize(term_Ctx* ctx, term_Vec size) {
+  if (!_veceq(size, ctx->screensize)) ctx->resize_pending = true;
+  ctx->screensize = size;
+}
+
+
+/*****************************************************************************/
+/* WRITER THREAD                                                             */
+/*****************************************************************************/
+
+#ifdef TERM_WRITER_THREAD
+
+#if defined(TERM_SYS_WIN)
+
+bool term_start_writer(term_Ctx* ctx) {
+  return false;
+}
+
+
+void term_stop_writer(term_Ctx* ctx) {
+}
+
+#elif defined(TERM_SYS_NIX)
+
+/*
+ * Push the data to the queue (prefixed with a CAN to abort the sequence cut
+ * by the last drop if needed). Returns false if there isn't enough space.
+ * Only called by the thread which owns the context.
+ */
+static bool _writer_push(term_Ctx* ctx, const char* data, uint32_t size) {
+  uint32_t head = atomic_load_explicit(&ctx->queue_head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&ctx->queue_tail, memory_order_relaxed);
+
+  uint32_t prefix = ctx->out_resync ? 1 : 0;
+  if (WRITER_QUEUE_SZ - (tail - head) < size + prefix) return false;
+
+  if (prefix) ctx->queue[tail++ & (WRITER_QUEUE_SZ - 1)] = '\x18';
+
+  uint32_t offset = tail & (WRITER_QUEUE_SZ - 1);
+  uint32_t count = WRITER_QUEUE_SZ - offset;
+  if (count > size) count = size;
+  memcpy(ctx->queue + offset, data, count);
+  memcpy(ctx->queue, data + count, size - count);
+
+  atomic_store_explicit(&ctx->queue_tail, tail + size, memory_order_release);
+  ctx->out_resync = false;
+
+  /* If the pipe is full the writer is already awake. */
+  if (write(ctx->wake[1], "", 1) < 0) {}
+  return true;
+}
+
+
+/* Push the output buffer to the queue or drop it if there is no space. */
+static void _writer_flush(term_Ctx* ctx) {
+  if (ctx->outc == 0) return;
+
+  if (!ctx->out_dropped && !_writer_push(ctx, ctx->outbuff, ctx->outc)) {
+    ctx->out_dropped = true;
+    ctx->out_resync = true;
+    ctx->cursor_known = false;
+  }
+  ctx->outc = 0;
+}
+
+
+/*
+ * Open the non blocking output of the writer. O_NONBLOCK is a flag of the open
+ * file description, which a tty shares with stdout, stderr and the other
+ * processes of the session, so setting it on out_fd would make their writes
+ * fail with EAGAIN. The tty is reopened instead (a new open file description
+ * of the same device). Other outputs (a pipe, a socket) are switched to non
+ * blocking till term_stop_writer() restores them.
+ */
+static void _writer_open(term_Ctx* ctx) {
+  char path[256];
+  struct stat out_st, st;
+  if (isatty(ctx->out_fd) && ttyname_r(ctx->out_fd, path, sizeof(path)) == 0 &&
+      fstat(ctx->out_fd, &out_st) == 0) {
+    int fd = open(path, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    /* A pty master has no name of its own (ex: /dev/ptmx). */
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_rdev == out_st.st_rdev) {
+      ctx->writer_fd = fd;
+      return;
+    }
+    if (fd >= 0) close(fd);
+  }
+
+  ctx->writer_fd = ctx->out_fd;
+  ctx->out_flags = fcntl(ctx->out_fd, F_GETFL);
+  fcntl(ctx->out_fd, F_SETFL, ctx->out_flags | O_NONBLOCK);
+}
+
+
+static void _writer_close(term_Ctx* ctx) {
+  if (ctx->writer_fd != ctx->out_fd) close(ctx->writer_fd);
+  else fcntl(ctx->out_fd, F_SETFL, ctx->out_flags);
+  ctx->writer_fd = -1;
+}
+
+
+static void* _writer_main(void* arg) {
+  term_Ctx* ctx = (term_Ctx*) arg;
+  int64_t deadline = -1; /* Drain deadline after the stop request. */
+
+  while (true) {
+    /* The stop flag is read before the tail: term_stop_writer() publishes the
+     * last bytes before it sets the flag, so they are seen before the exit. */
+    bool stop = atomic_load_explicit(&ctx->writer_stop, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&ctx->queue_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ctx->queue_tail, memory_order_acquire);
+
+    if (stop && deadline < 0) {
+      deadline = _time_ms() + WRITER_DRAIN_MS;
+    }
+
+    if (head == tail || (deadline >= 0 && _time_ms() >= deadline)) {
+      if (deadline >= 0) break;
+
+      /* Wait for the caller to push, then clear the wake up bytes. */
+      struct pollfd pfd;
+      pfd.fd = ctx->wake[0];
+      pfd.events = POLLIN;
+      poll(&pfd, 1, -1);
+
+      char drain[64];
+      while (read(ctx->wake[0], drain, sizeof(drain)) > 0);
+      continue;
+    }
+
+    uint32_t offset = head & (WRITER_QUEUE_SZ - 1);
+    uint32_t count = tail - head;
+    if (count > WRITER_QUEUE_SZ - offset) count = WRITER_QUEUE_SZ - offset;
+
+    _STAT(atomic_fetch_add_explicit(&ctx->writer_calls, 1, memory_order_relaxed));
+    int written = write(ctx->writer_fd, ctx->queue + offset, count);
+    if (written > 0) {
+      atomic_store_explicit(&ctx->queue_head, head + written, memory_order_release);
+      continue;
+    }
+
+    if (written < 0 && errno == EINTR) continue;
+
+    /*
+     * The terminal is slow, wait till it's writable or a stop request. The
+     * wake up bytes of the pushes are cleared, otherwise the poll returns
+     * immediately till the terminal catches up.
+     */
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfds[2];
+      pfds[0].fd = ctx->writer_fd;
+      pfds[0].events = POLLOUT;
+      pfds[1].fd = ctx->wake[0];
+      pfds[1].events = POLLIN;
+      if (poll(pfds, 2, (deadline >= 0) ? PROBE_TIMEOUT_MS : -1) > 0 && (pfds[1].revents & POLLIN)) {
+        char drain[64];
+        while (read(ctx->wake[0], drain, sizeof(drain)) > 0);
+      }
+      continue;
+    }
+
+    /* The terminal is gone, drop the output. */
+    atomic_store_explicit(&ctx->queue_head, tail, memory_order_release);
+  }
+
+  return NULL;
+}
+
+
+bool term_start_writer(term_Ctx* ctx) {
+  assert(ctx->initialized && "Did you forget to call term_init()");
+  if (ctx->writer_running) return true;
+
+  ctx->queue = (char*) malloc(WRITER_QUEUE_SZ);
+  if (ctx->queue == NULL) return false;
+
+  if (pipe(ctx->wake) != 0) {
+    free(ctx->queue); ctx->queue = NULL;
+    return false;
+  }
+
+  for (int i = 0; i < 2; i++) {
+    fcntl(ctx->wake[i], F_SETFL, fcntl(ctx->wake[i], F_GETFL) | O_NONBLOCK);
+  }
+
+  _out_flush(ctx);
+  _writer_open(ctx);
+
+  atomic_init(&ctx->queue_head, 0);
+  atomic_init(&ctx->queue_tail, 0);
+  atomic_init(&ctx->writer_stop, false);
+
+  if (pthread_create(&ctx->writer, NULL, _writer_main, ctx) != 0) {
+    _writer_close(ctx);
+    close(ctx->wake[0]); close(ctx->wake[1]);
+    free(ctx->queue); ctx->queue = NULL;
+    return false;
+  }
+
+  ctx->writer_running = true;
+  return true;
+}
+
+
+void term_stop_writer(term_Ctx* ctx) {
+  if (!ctx->writer_running) return;
+
+  _out_flush(ctx);
+  atomic_store(&ctx->writer_stop, true);
+  if (write(ctx->wake[1], "", 1) < 0) {}
+  pthread_join(ctx->writer, NULL);
+  ctx->writer_running = false;
+
+  _writer_close(ctx);
+  close(ctx->wake[0]); close(ctx->wake[1]);
+  free(ctx->queue); ctx->queue = NULL;
+
+  /* Abort the sequence which might be cut by a drop, out_dropped is kept
+   * so the next term_render() will redraw the screen. */
+  if (ctx->out_resync) _out_puts(ctx, "\x18");
+  ctx->out_resync = false;
+}
+
+#endif /* TERM_SYS_NIX */
+
+
+bool term_output_dropped(term_Ctx* ctx) {
+  return ctx->out_dropped;
+}
+
+#endif /* TERM_WRITER_THREAD */
+
+
+#ifdef TERM_HEADLESS
+
+/*****************************************************************************/
+/* HEADLESS                                                                  */
+/*****************************************************************************/
+
+term_Ctx* term_ctx_new_headless(term_Vec size) {
+  term_Ctx* ctx = term_ctx_new(-1, -1);
+  if (ctx == NULL) return NULL;
+
+  _Screen* screen = (_Screen*) calloc(1, sizeof(_Screen));
+  term_Cell* cells = (term_Cell*) malloc(sizeof(term_Cell) * size.x * size.y);
+  if (screen == NULL || cells == NULL) {
+    free(screen); free(cells);
+    term_ctx_free(ctx);
+    return NULL;
+  }
+
+  screen->size = size;
+  screen->cells = cells;
+  screen->bottom = size.y - 1;
+  screen->pen = term_cell(' ');
+  screen->last_ch = ' ';
+  for (int i = 0; i < size.x * size.y; i++) cells[i] = term_cell(' ');
+
+  ctx->screen = screen;
+  ctx->screensize = size;
+  return ctx;
+}
+
+
+term_Cell term_headless_getcell(term_Ctx* ctx, term_Vec pos) {
+  _Screen* sc = ctx->screen;
+  if (!BETWEEN(0, pos.x, sc->size.x - 1)) return term_cell(' ');
+  if (!BETWEEN(0, pos.y, sc->size.y - 1)) return term_cell(' ');
+  return sc->cells[pos.y * sc->size.x + pos.x];
+}
+
+
+term_Vec term_headless_cursor(term_Ctx* ctx) {
+  return ctx->screen->cursor;
+}
+
+
+uint64_t term_headless_bytes(term_Ctx* ctx) {
+  _out_flush(ctx);
+  return ctx->screen->bytes;
+}
+
+
+int term_headless_input(term_Ctx* ctx, const char* data, int size) {
+#if defined(TERM_SYS_NIX)
+  int count = ctx->buff_size - ctx->buffc;
+  if (count > size) count = size;
+  memcpy(ctx->buff + ctx->buffc, data, count);
+  _STAT(ctx->stats.input_bytes += count);
+  ctx->buffc += count;
+  return count;
+#else
+  return 0;
+#endif
+}
+
+
+/* Erase the cells [first, last] of the row with the current background. */
+static void _screen_erase(_Screen* sc, int y, int first, int last) {
+  term_Cell blank = term_cell(' ');
+  blank.bg = sc->pen.bg;
+  if (first < 0) first = 0;
+  if (last >= sc->size.x) last = sc->size.x - 1;
+  for (int x = first; x <= last; x++) sc->cells[y * sc->size.x + x] = blank;
+}
+
+
+/* Scroll the region up by n lines (down if negative). */
+static void _screen_scroll(_Screen* sc, int n) {
+  int width = sc->size.x, rows = sc->bottom - sc->top + 1;
+  int count = (n > 0) ? n : -n;
+  if (count > rows) count = rows;
+
+  term_Cell* region = sc->cells + sc->top * width;
+  size_t moved = sizeof(term_Cell) * width * (rows - count);
+  if (n > 0) memmove(region, region + count * width, moved);
+  else memmove(region + count * width, region, moved);
+
+  int exposed = (n > 0) ? (sc->bottom - count + 1) : sc->top;
+  for (int y = exposed; y < exposed + count; y++) _screen_erase(sc, y, 0, width - 1);
+}
+
+
+static void _screen_linefeed(_Screen* sc) {
+  if (sc->cursor.y == sc->bottom) _screen_scroll(sc, 1);
+  else if (sc->cursor.y < sc->size.y - 1) sc->cursor.y++;
+}
+
+
+static void _screen_put(_Screen* sc, uint32_t ch) {
+  if (sc->wrap_pending) {
+    sc->wrap_pending = false;
+    sc->cursor.x = 0;
+    _screen_linefeed(sc);
+  }
+
+  /* A double width character which doesn't fit wraps to the next line. */
+  int width = (ch >= 0x1100 && utf8_charWidth((int) ch) == 2 && sc->size.x > 1) ? 2 : 1;
+  if (width == 2 && sc->cursor.x == sc->size.x - 1) {
+    _screen_erase(sc, sc->cursor.y, sc->cursor.x, sc->cursor.x);
+    sc->cursor.x = 0;
+    _screen_linefeed(sc);
+  }
+
+  term_Cell cell = sc->pen;
+  cell.ch = ch;
+  term_Cell* dst = sc->cells + sc->cursor.y * sc->size.x + sc->cursor.x;
+  dst[0] = cell;
+  if (width == 2) { cell.ch = ' '; dst[1] = cell; }
+  sc->last_ch = ch;
+
+  if (sc->cursor.x + width >= sc->size.x) sc->wrap_pending = true;
+  else sc->cursor.x += width;
+  if (width == 2 && sc->wrap_pending) sc->cursor.x = sc->size.x - 1;
+}
+
+
+/* Set the cursor position clamped to the screen. */
+static void _screen_move(_Screen* sc, int x, int y) {
+  sc->cursor.x = (x < 0) ? 0 : (x >= sc->size.x) ? sc->size.x - 1 : x;
+  sc->cursor.y = (y < 0) ? 0 : (y >= sc->size.y) ? sc->size.y - 1 : y;
+  sc->wrap_pending = false;
+}
+
+
+static void _screen_sgr(_Screen* sc, const int* params, int count) {
+  if (count == 0) count = 1; /* ESC[m is ESC[0m. */
+
+  for (int i = 0; i < count; i++) {
+    int p = params[i];
+    term_Cell* pen = &sc->pen;
+
+    if (p == 0) *pen = term_cell(' ');
+    else if (p == 1) pen->attr |= TERM_ATTR_BOLD;
+    else if (p == 2) pen->attr |= TERM_ATTR_DIM;
+    else if (p == 3) pen->attr |= TERM_ATTR_ITALIC;
+    else if (p == 4) pen->attr |= TERM_ATTR_UNDERLINE;
+    else if (p == 7) pen->attr |= TERM_ATTR_REVERSE;
+    else if (p == 22) pen->attr &= ~(TERM_ATTR_BOLD | TERM_ATTR_DIM);
+    else if (p == 23) pen->attr &= ~TERM_ATTR_ITALIC;
+    else if (p == 24) pen->attr &= ~TERM_ATTR_UNDERLINE;
+    else if (p == 27) pen->attr &= ~TERM_ATTR_REVERSE;
+    else if (BETWEEN(30, p, 37)) pen->fg = TERM_COLOR_INDEX(p - 30);
+    else if (BETWEEN(40, p, 47)) pen->bg = TERM_COLOR_INDEX(p - 40);
+    else if (BETWEEN(90, p, 97)) pen->fg = TERM_COLOR_INDEX(p - 90 + 8);
+    else if (BETWEEN(100, p, 107)) pen->bg = TERM_COLOR_INDEX(p - 100 + 8);
+    else if (p == 39) pen->fg = TERM_COLOR_DEFAULT;
+    else if (p == 49) pen->bg = TERM_COLOR_DEFAULT;
+
+    else if (p == 38 || p == 48) {
+      term_Color* color = (p == 38) ? &pen->fg : &pen->bg;
+      if (i + 2 < count && params[i + 1] == 5) {
+        *color = TERM_COLOR_INDEX(params[i + 2]);
+        i += 2;
+      } else if (i + 4 < count && params[i + 1] == 2) {
+        *color = ((params[i + 2] & 0xff) << 16) | ((params[i + 3] & 0xff) << 8) |
+                 (params[i + 4] & 0xff);
+        i += 4;
+      }
+    }
+  }
+}
+
+
+/* Execute the CSI sequence (ESC [ ... final). */
+static void _screen_csi(term_Ctx* ctx, const uint8_t* seq, uint32_t length) {
+  _Screen* sc = ctx->screen;
+
+  /* Private (ESC[?...) and intermediate ($, space...) sequences are modes
+   * and queries which doesn't change the screen. */
+  for (uint32_t i = 2; i < length - 1; i++) {
+    if (!isdigit(seq[i]) && seq[i] != ';') return;
+  }
+
+  int params[16], count = 0, value = 0;
+  bool has_value = false;
+  for (uint32_t i = 2; i < length - 1; i++) {
+    if (seq[i] == ';') {
+      if (count < 16) params[count++] = value;
+      value = 0;
+      has_value = false;
+    } else {
+      value = value * 10 + (seq[i] - '0');
+      has_value = true;
+    }
+  }
+  if ((has_value || count > 0) && count < 16) params[count++] = value;
+
+  int p1 = (count > 0 && params[0] > 0) ? params[0] : 1; /* Count defaults to 1. */
+  int p0 = (count > 0) ? params[0] : 0; /* Mode defaults to 0. */
+  term_Vec* cur = &sc->cursor;
+
+  switch (seq[length - 1]) {
+    case 'H': case 'f':
+      _screen_move(sc, ((count > 1 && params[1] > 0) ? params[1] : 1) - 1, p1 - 1);
+      break;
+
+    case 'A': _screen_move(sc, cur->x, cur->y - p1); break;
+    case 'B': _screen_move(sc, cur->x, cur->y + p1); break;
+    case 'C': _screen_move(sc, cur->x + p1, cur->y); break;
+    case 'D': _screen_move(sc, cur->x - p1, cur->y); break;
+
+    case 'J':
+      if (p0 == 0 || p0 == 1) {
+        _screen_erase(sc, cur->y, (p0 == 0) ? cur->x : 0, (p0 == 0) ? sc->size.x - 1 : cur->x);
+      }
+      for (int y = 0; y < sc->size.y; y++) {
+        if ((p0 == 0 && y > cur->y) || (p0 == 1 && y < cur->y) || p0 == 2) {
+          _screen_erase(sc, y, 0, sc->size.x - 1);
+        }
+      }
+      break;
+
+    case 'K':
+      if (p0 == 0) _screen_erase(sc, cur->y, cur->x, sc->size.x - 1);
+      else if (p0 == 1) _screen_erase(sc, cur->y, 0, cur->x);
+      else if (p0 == 2) _screen_erase(sc, cur->y, 0, sc->size.x - 1);
+      break;
+
+    case 'X': _screen_erase(sc, cur->y, cur->x, cur->x + p1 - 1); break;
+
+    case 'b':
+      for (int i = 0; i < p1; i++) _screen_put(sc, sc->last_ch);
+      break;
+
+    case 'r':
+      sc->top = p1 - 1;
+      sc->bottom = ((count > 1 && params[1] > 0) ? params[1] : sc->size.y) - 1;
+      if (sc->bottom >= sc->size.y) sc->bottom = sc->size.y - 1;
+      if (sc->top >= sc->bottom) { sc->top = 0; sc->bottom = sc->size.y - 1; }
+      _screen_move(sc, 0, 0);
+      break;
+
+    case 'S': _screen_scroll(sc, p1); break;
+    case 'T': _screen_scroll(sc, -p1); break;
+
+    case 'm': _screen_sgr(sc, params, count); break;
+
+    case 'n':
+      /* Reply the cursor position request. */
+      if (p0 == 6) {
+        char reply[32];
+        int size = snprintf(reply, sizeof(reply), "\x1b[%i;%iR", cur->y + 1, cur->x + 1);
+        term_headless_input(ctx, reply, size);
+      }
+      break;
+  }
+}
+
+
+/*
+ * Returns the length of the escape sequence at the start of the sequence
+ * buffer, 0 if it's not complete yet.
+ */
+static uint32_t _screen_seq_length(const uint8_t* seq, uint32_t count) {
+  if (count < 2) return 0;
+
+  if (seq[1] == '[') {
+    for (uint32_t i = 2; i < count; i++) {
+      if (BETWEEN(0x40, seq[i], 0x7e)) return i + 1;
+    }
+    return 0;
+  }
+
+  /* DCS, OSC... terminated by ST (ESC \) or BEL. */
+  if (seq[1] == 'P' || seq[1] == ']' || seq[1] == '_' || seq[1] == '^') {
+    for (uint32_t i = 2; i < count; i++) {
+      if (seq[i] == '\a') return i + 1;
+      if (seq[i] == '\\' && seq[i - 1] == '\x1b') return i + 1;
+    }
+    return 0;
+  }
+
+  return 2;
+}
+
+
+static void _screen_feed(term_Ctx* ctx, const uint8_t* data, uint32_t size) {
+  _Screen* sc = ctx->screen;
+  sc->bytes += size;
+
+  for (uint32_t i = 0; i < size; i++) {
+    uint8_t c = data[i];
+
+    /* CAN and SUB abort the sequence. */
+    if (c == 0x18 || c == 0x1a) {
+      sc->seqc = 0;
+      continue;
+    }
+
+    if (sc->seqc > 0 || c == '\x1b' || c >= 0xc0) {
+      /* Too long to be something we support, drop it. */
+      if (sc->seqc == sizeof(sc->seq)) sc->seqc = 0;
+      sc->seq[sc->seqc++] = c;
+
+      if (sc->seq[0] == '\x1b') {
+        uint32_t length = _screen_seq_length(sc->seq, sc->seqc);
+        if (length == 0) continue;
+        if (sc->seq[1] == '[') _screen_csi(ctx, sc->seq, length);
+        sc->seqc = 0;
+
+      } else if (sc->seqc == (uint32_t) utf8_decodeBytesCount(sc->seq[0])) {
+        int value;
+        if (utf8_decodeBytes(sc->seq, &value) > 0) _screen_put(sc, (uint32_t) value);
+        sc->seqc = 0;
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '\r': sc->cursor.x = 0; sc->wrap_pending = false; break;
+      case '\n': _screen_linefeed(sc); sc->wrap_pending = false; break;
+      case '\b': _screen_move(sc, sc->cursor.x - 1, sc->cursor.y); break;
+      default:
+        if (c >= ' ' && c < 0x7f) _screen_put(sc, c);
+        break;
+    }
+  }
+}
+
+#endif /* TERM_HEADLESS */
+
+
+/*****************************************************************************/
+/* RENDERING                                                                 */
+/*****************************************************************************/
+
+/*
+ * Estimated number of bytes to set a scroll region and scroll it, used to
+ * decide if scrolling is cheaper than redrawing the shifted lines.
+ */
+#define SCROLL_COST 24
+
+/* Blank cell with the default style. */
+static const _Cell _blank = { ' ', 0 };
+
+/* Cell which never matches, set to the front grid to force a redraw. */
+static const _Cell _invalid = { 0, 0xffffffff };
+
+/* Transparent cell of the layers. */
+static const _Cell _transparent = { 0, 0 };
+
+
+/* FNV-1a hash of the bytes. */
+static uint64_t _hash(const void* data, size_t size) {
+  const uint8_t* bytes = (const uint8_t*) data;
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+
+/* Insert the id to the hash table of the intern (which has space for it). */
+static void _intern_insert(_Intern* in, uint32_t id) {
+  uint32_t mask = in->map_cap - 1;
+  uint32_t slot = (uint32_t) _hash(in->data + id + 1, in->data[id]) & mask;
+  while (in->map[slot] != 0) slot = (slot + 1) & mask;
+  in->map[slot] = id + 1;
+}
+
+
+/* Returns the id of the bytes, they're added if not interned already. */
+static uint32_t _intern(_Intern* in, const void* bytes, uint32_t length) {
+  assert(length <= 0xff && "Interned strings are limited to 255 bytes.");
+
+  if (in->map_cap > 0) {
+    uint32_t mask = in->map_cap - 1;
+    uint32_t slot = (uint32_t) _hash(bytes, length) & mask;
+    for (; in->map[slot] != 0; slot = (slot + 1) & mask) {
+      uint32_t id = in->map[slot] - 1;
+      if (in->data[id] == length && memcmp(in->data + id + 1, bytes, length) == 0) return id;
+    }
+  }
+
+  /* Keep the load factor of the hash table under 0.5. */
+  if ((in->count + 1) * 2 > in->map_cap) {
+    uint32_t* old = in->map;
+    uint32_t old_cap = in->map_cap;
+    in->map_cap = (old_cap == 0) ? 64 : old_cap * 2;
+    in->map = (uint32_t*) calloc(in->map_cap, sizeof(uint32_t));
+    assert(in->map != NULL && "calloc() failed.");
+    for (uint32_t i = 0; i < old_cap; i++) {
+      if (old[i] != 0) _intern_insert(in, old[i] - 1);
+    }
+    free(old);
+  }
+
+  if (in->size + length + 1 > in->capacity) {
+    while (in->size + length + 1 > in->capacity) {
+      in->capacity = (in->capacity == 0) ? 1024 : in->capacity * 2;
+    }
+    in->data = (uint8_t*) realloc(in->data, in->capacity);
+    assert(in->data != NULL && "realloc() failed.");
+  }
+
+  uint32_t id = in->size;
+  in->data[id] = (uint8_t) length;
+  memcpy(in->data + id + 1, bytes, length);
+  in->size += length + 1;
+  in->count++;
+  _intern_insert(in, id);
+
+  return id;
+}
+
+
+static void _intern_free(_Intern* in) {
+  free(in->data);
+  free(in->map);
+  memset(in, 0, sizeof(_Intern));
+}
+
+
+/* Returns the style of the id. */
+static _Style _style_get(term_Ctx* ctx, uint32_t id) {
+  _Style style;
+  memcpy(&style, ctx->styles.data + id + 1, sizeof(_Style));
+  return style;
+}
+
+
+/* Returns the id of the style interned to the style table. */
+static uint32_t _style_id(term_Ctx* ctx, _Style style) {
+  if (memcmp(&style, &ctx->last_style, sizeof(_Style)) != 0) {
+    ctx->last_style = style;
+    ctx->last_style_id = _intern(&ctx->styles, &style, sizeof(_Style));
+  }
+  return ctx->last_style_id;
+}
+
+
+/* Pack the cell, its style is interned to the style table. */
+static _Cell _pack(term_Ctx* ctx, term_Cell cell) {
+  _Style style = { cell.fg, cell.bg, cell.attr };
+  _Cell packed = { cell.ch, _style_id(ctx, style) };
+  return packed;
+}
+
+
+static term_Cell _unpack(term_Ctx* ctx, _Cell cell) {
+  _Style style = _style_get(ctx, cell.style);
+  term_Cell unpacked = { cell.ch, style.fg, style.bg, style.attr };
+  return unpacked;
+}
+
+
+uint32_t term_grapheme(term_Ctx* ctx, const char* str, int length) {
+  if (length < 0) length = (int) strlen(str);
+  if (length == 0) return ' ';
+
+  int value;
+  if (utf8_decodeBytesCount((uint8_t) *str) == length &&
+      utf8_decodeBytes((uint8_t*) str, &value) == length) {
+    return (uint32_t) value;
+  }
+
+  if (length > 0xff) length = 0xff;
+  return TERM_CH_GRAPHEME | _intern(&ctx->graphemes, str, (uint32_t) length);
+}
+
+
+static void _grid_free(term_Ctx* ctx) {
+  if (ctx->base != ctx->back) free(ctx->base);
+  ctx->base = NULL;
+  free(ctx->back); ctx->back = NULL;
+  free(ctx->front); ctx->front = NULL;
+  free(ctx->back_hash); ctx->back_hash = NULL;
+  free(ctx->front_hash); ctx->front_hash = NULL;
+  free(ctx->damage); ctx->damage = NULL;
+  ctx->gridsize = term_vec(0, 0);
+}
+
+
+static void _fill_cells(_Cell* cells, int count, _Cell cell) {
+  for (int i = 0; i < count; i++) cells[i] = cell;
+}
+
+
+/* Hash of a row of the grid. */
+static uint64_t _row_hash(const _Cell* row, int width) {
+  return _hash(row, sizeof(_Cell) * width);
+}
+
+
+/* Merge the columns [first, last] of the row to its damage. */
+static void _damage_span(term_Ctx* ctx, int y, int first, int last) {
+  term_Vec* span = ctx->damage + y;
+  if (first < span->x) span->x = first;
+  if (last > span->y) span->y = last;
+  ctx->damaged = true;
+}
+
+
+/* Damage the entire rows [top, bottom]. */
+static void _damage_rows(term_Ctx* ctx, int top, int bottom) {
+  for (int y = top; y <= bottom; y++) _damage_span(ctx, y, 0, ctx->gridsize.x - 1);
+}
+
+
+/* Clear the damage of all rows. */
+static void _damage_reset(term_Ctx* ctx) {
+  for (int y = 0; y < ctx->gridsize.y; y++) ctx->damage[y] = term_vec(ctx->gridsize.x, -1);
+  ctx->damaged = false;
+}
+
+
+/*
+ * Resize the grids if the screen size has changed. The front grid is cleared
+ * since the terminal content is unknown after a resize and the screen will
+ * be cleared before the next render.
+ */
+static bool _grid_resize(term_Ctx* ctx, term_Vec size) {
+  if (_veceq(ctx->gridsize, size) && ctx->back != NULL) return false;
+
+  _grid_free(ctx);
+  int count = size.x * size.y;
+
+  ctx->back = (_Cell*) malloc(sizeof(_Cell) * count);
+  ctx->front = (_Cell*) malloc(sizeof(_Cell) * count);
+  ctx->back_hash = (uint64_t*) malloc(sizeof(uint64_t) * size.y);
+  ctx->front_hash = (uint64_t*) malloc(sizeof(uint64_t) * size.y);
+  ctx->damage = (term_Vec*) malloc(sizeof(term_Vec) * size.y);
+  assert(ctx->back && ctx->front && ctx->back_hash && ctx->front_hash && ctx->damage &&
+         "malloc() failed.");
+
+  /* With layers the grid is composited with them to the back grid. */
+  ctx->base = ctx->back;
+  if (ctx->layers != NULL) {
+    ctx->base = (_Cell*) malloc(sizeof(_Cell) * count);
+    assert(ctx->base != NULL && "malloc() failed.");
+    _fill_cells(ctx->base, count, _blank);
+  }
+
+  ctx->gridsize = size;
+  _fill_cells(ctx->back, count, _blank);
+  _fill_cells(ctx->front, count, _blank);
+
+  uint64_t hash = _row_hash(ctx->front, size.x);
+  for (int y = 0; y < size.y; y++) ctx->front_hash[y] = hash;
+
+  _damage_reset(ctx);
+  _damage_rows(ctx, 0, size.y - 1);
+
+  return true;
+}
+
+
+void term_setcell(term_Ctx* ctx, term_Vec pos, term_Cell cell) {
+  _grid_resize(ctx, ctx->screensize);
+  if (!BETWEEN(0, pos.x, ctx->gridsize.x - 1)) return;
+  if (!BETWEEN(0, pos.y, ctx->gridsize.y - 1)) return;
+
+  _Cell packed = _pack(ctx, cell);
+  _Cell* target = ctx->base + pos.y * ctx->gridsize.x + pos.x;
+  if (memcmp(target, &packed, sizeof(_Cell)) == 0) return;
+  *target = packed;
+  _damage_span(ctx, pos.y, pos.x, pos.x);
+}
+
+
+term_Cell term_getcell(term_Ctx* ctx, term_Vec pos) {
+  _grid_resize(ctx, ctx->screensize);
+  if (!BETWEEN(0, pos.x, ctx->gridsize.x - 1)) return term_cell(' ');
+  if (!BETWEEN(0, pos.y, ctx->gridsize.y - 1)) return term_cell(' ');
+  return _unpack(ctx, ctx->base[pos.y * ctx->gridsize.x + pos.x]);
+}
+
+
+void term_clear(term_Ctx* ctx) {
+  _grid_resize(ctx, ctx->screensize);
+
+  /* Only the cells which weren't blank are damaged. */
+  int width = ctx->gridsize.x;
+  for (int y = 0; y < ctx->gridsize.y; y++) {
+    _Cell* row = ctx->base + y * width;
+    int first = 0, last = width - 1;
+    while (first <= last && memcmp(row + first, &_blank, sizeof(_Cell)) == 0) first++;
+    while (last > first && memcmp(row + last, &_blank, sizeof(_Cell)) == 0) last--;
+    if (first > last) continue;
+
+    _fill_cells(row + first, last - first + 1, _blank);
+    _damage_span(ctx, y, first, last);
+  }
+}
+
+
+/*
+ * Decode the next character of the utf8 text to the value and returns its
+ * byte count, invalid and truncated sequences are a single U+FFFD byte.
+ */
+static int _put_decode(const char* str, int length, int* value) {
+  uint8_t byte = (uint8_t) *str;
+  if (byte < 0x80) {
+    *value = byte;
+    return 1;
+  }
+
+  int count = utf8_decodeBytesCount(byte);
+  if (byte < 0xc0 || count > length || utf8_decodeBytes((uint8_t*) str, value) != count) {
+    *value = 0xfffd;
+    return 1;
+  }
+  return count;
+}
+
+
+/* Returns the columns of the decoded character, controls take a column. */
+static int _put_char_width(int value) {
+  if (value < 0x300) return 1; /* Fast path of the latin text. */
+  int width = utf8_charWidth(value);
+  return (width < 0) ? 1 : width;
+}
+
+
+/* Returns the number of columns the utf8 text takes. */
+static int _put_width(const char* str, int length) {
+  int columns = 0;
+  for (int i = 0; i < length;) {
+    int value;
+    i += _put_decode(str + i, length - i, &value);
+    columns += _put_char_width(value);
+  }
+  return columns;
+}
+
+
+/* State of writing a run of cells to a row of the grid. */
+typedef struct {
+  _Cell* row;  /* NULL if the row is outside of the screen. */
+  int width;   /* Width of the grid. */
+  int first;   /* The changed span of the row. */
+  int last;
+} _PutRow;
+
+
+static _PutRow _put_row(term_Ctx* ctx, int y) {
+  _grid_resize(ctx, ctx->screensize);
+  _PutRow pr = { NULL, ctx->gridsize.x, INT_MAX, -1 };
+  if (BETWEEN(0, y, ctx->gridsize.y - 1)) pr.row = ctx->base + y * pr.width;
+  return pr;
+}
+
+
+/* Sets the cell of the row (it must be in the screen) and track the change. */
+static inline void _put_cell(_PutRow* pr, int x, _Cell cell) {
+  if (memcmp(pr->row + x, &cell, sizeof(_Cell)) == 0) return;
+  pr->row[x] = cell;
+  if (x < pr->first) pr->first = x;
+  if (x > pr->last) pr->last = x;
+}
+
+
+/* Sets the count cells from x, clipped to the screen. */
+static void _put_fill(_PutRow* pr, int x, int count, _Cell cell) {
+  if (pr->row == NULL) return;
+  int end = x + count;
+  if (x < 0) x = 0;
+  if (end > pr->width) end = pr->width;
+  for (; x < end; x++) _put_cell(pr, x, cell);
+}
+
+
+/*
+ * Write the utf8 text from x, clipped to the columns and the screen, and
+ * returns the number of columns written. A combining character is merged
+ * with the previous one to a grapheme.
+ */
+static int _put_text(term_Ctx* ctx, _PutRow* pr, int x, uint32_t style, const char* str, int length, int columns) {
+  int col = 0;
+  int prev = -1;               /* The cell of the previous character. */
+  const char* prev_str = NULL; /* The text of the previous character. */
+
+  for (int i = 0; i < length;) {
+    int value;
+    int count = _put_decode(str + i, length - i, &value);
+    int width = _put_char_width(value);
+
+    if (width == 0) {
+      if (prev >= 0) {
+        _Cell cell = { term_grapheme(ctx, prev_str, (int) (str + i + count - prev_str)), style };
+        _put_cell(pr, prev, cell);
+      }
+      i += count;
+      continue;
+    }
+    if (col + width > columns) break;
+
+    int cx = x + col;
+    prev = -1;
+    if (pr->row != NULL && cx >= 0 && cx < pr->width) {
+      if (value < 0x20 || BETWEEN(0x7f, value, 0x9f)) value = ' ';
+      if (width == 2 && cx + 1 == pr->width) {
+        /* Rendered as a space anyway, see term_setcell(). */
+        _Cell cell = { ' ', style };
+        _put_cell(pr, cx, cell);
+      } else {
+        _Cell cell = { (uint32_t) value, style };
+        _put_cell(pr, cx, cell);
+        if (width == 2) _put_cell(pr, cx + 1, (_Cell) { ' ', style });
+        prev = cx;
+        prev_str = str + i;
+      }
+    }
+
+    col += width;
+    i += count;
+  }
+
+  return col;
+}
+
+
+/* Damage the changed span of the row. */
+static void _put_done(term_Ctx* ctx, _PutRow* pr, int y) {
+  if (pr->first <= pr->last) _damage_span(ctx, y, pr->first, pr->last);
+}
+
+
+/* Write the text to the field of the width (see term_put_str()). */
+static int _put_field(term_Ctx* ctx, int x, int y, term_Style style, const char* str, int length, int width) {
+  uint32_t id = _style_id(ctx, style);
+  _Cell space = { ' ', id };
+  _PutRow pr = _put_row(ctx, y);
+
+  int written;
+  if (width == 0) {
+    written = _put_text(ctx, &pr, x, id, str, length, INT_MAX);
+
+  } else {
+    written = (width < 0) ? -width : width;
+    int pad = 0;
+    if (width > 0) {
+      pad = written - _put_width(str, length);
+      if (pad < 0) pad = 0;
+      _put_fill(&pr, x, pad, space);
+    }
+    int text = _put_text(ctx, &pr, x + pad, id, str, length, written - pad);
+    _put_fill(&pr, x + pad + text, written - pad - text, space);
+  }
+
+  _put_done(ctx, &pr, y);
+  return written;
+}
+
+
+/* Write the ascii number to the field, it's filled with '#' if it doesn't fit. */
+static int _put_number(term_Ctx* ctx, int x, int y, term_Style style, const char* str, int length, int width) {
+  int field = (width < 0) ? -width : width;
+  if (width == 0 || length <= field) return _put_field(ctx, x, y, style, str, length, width);
+
+  _PutRow pr = _put_row(ctx, y);
+  _put_fill(&pr, x, field, (_Cell) { '#', _style_id(ctx, style) });
+  _put_done(ctx, &pr, y);
+  return field;
+}
+
+
+/* Format the unsigned integer to the end of the buffer, returns its start. */
+static char* _put_digits(char* end, uint64_t value) {
+  do {
+    *--end = (char) ('0' + value % 10);
+    value /= 10;
+  } while (value != 0);
+  return end;
+}
+
+
+int term_put(term_Ctx* ctx, int x, int y, term_Style style, const char* fmt, ...) {
+  char buff[PUT_BUFF_SZ];
+  va_list args;
+  va_start(args, fmt);
+  int length = vsnprintf(buff, sizeof(buff), fmt, args);
+  va_end(args);
+
+  if (length < 0) return 0;
+  if (length >= (int) sizeof(buff)) length = sizeof(buff) - 1;
+  return _put_field(ctx, x, y, style, buff, length, 0);
+}
+
+
+int term_put_str(term_Ctx* ctx, int x, int y, term_Style style, const char* str, int length, int width) {
+  if (length < 0) length = (int) strlen(str);
+  return _put_field(ctx, x, y, style, str, length, width);
+}
+
+
+int term_put_int(term_Ctx* ctx, int x, int y, term_Style style, int64_t value, int width) {
+  char buff[24];
+  char* end = buff + sizeof(buff);
+  uint64_t magnitude = (value < 0) ? 0 - (uint64_t) value : (uint64_t) value;
+  char* start = _put_digits(end, magnitude);
+  if (value < 0) *--start = '-';
+  return _put_number(ctx, x, y, style, start, (int) (end - start), width);
+}
+
+
+int term_put_fixed(term_Ctx* ctx, int x, int y, term_Style style, double value, int decimals, int width) {
+  static const uint64_t scales[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+  };
+
+  if (decimals < 0) decimals = 0;
+  if (decimals > 9) decimals = 9;
+
+  if (isnan(value)) return _put_number(ctx, x, y, style, "nan", 3, width);
+  if (isinf(value)) {
+    if (value < 0) return _put_number(ctx, x, y, style, "-inf", 4, width);
+    return _put_number(ctx, x, y, style, "inf", 3, width);
+  }
+
+  char buff[48];
+  double scaled = ((value < 0) ? -value : value) * (double) scales[decimals] + 0.5;
+
+  /* Too large for the fixed point integer, rare enough to go through printf. */
+  if (scaled >= 1e18) {
+    int length = snprintf(buff, sizeof(buff), "%.*f", decimals, value);
+    if (length >= (int) sizeof(buff)) length = sizeof(buff) - 1;
+    return _put_number(ctx, x, y, style, buff, length, width);
+  }
+
+  uint64_t fixed = (uint64_t) scaled;
+  char* end = buff + sizeof(buff);
+  char* start = end;
+  if (decimals > 0) {
+    uint64_t fraction = fixed % scales[decimals];
+    for (int i = 0; i < decimals; i++) {
+      *--start = (char) ('0' + fraction % 10);
+      fraction /= 10;
+    }
+    *--start = '.';
+  }
+  start = _put_digits(start, fixed / scales[decimals]);
+  if (value < 0 && fixed != 0) *--start = '-'; /* Not "-0.00". */
+  return _put_number(ctx, x, y, style, start, (int) (end - start), width);
+}
+
+
+/*
+ * Damage the rectangle clipped to the grid, if invalidate the front cells are
+ * invalidated so they'll be written even if they haven't changed.
+ */
+static void _damage_rect(term_Ctx* ctx, term_Vec pos, term_Vec size, bool invalidate) {
+  int first = (pos.x < 0) ? 0 : pos.x;
+  int last = pos.x + size.x - 1;
+  if (last >= ctx->gridsize.x) last = ctx->gridsize.x - 1;
+  if (first > last) return;
+
+  int width = ctx->gridsize.x;
+  for (int y = (pos.y < 0) ? 0 : pos.y; y < pos.y + size.y && y < ctx->gridsize.y; y++) {
+    if (invalidate) {
+      _fill_cells(ctx->front + y * width + first, last - first + 1, _invalid);
+      ctx->front_hash[y] = _row_hash(ctx->front + y * width, width);
+    }
+    _damage_span(ctx, y, first, last);
+  }
+}
+
+
+void term_damage(term_Ctx* ctx, term_Vec pos, term_Vec size) {
+  _grid_resize(ctx, ctx->screensize);
+  _damage_rect(ctx, pos, size, true);
+}
+
+
+void term_set_frame_rate(term_Ctx* ctx, int fps) {
+  ctx->frame_interval = (fps > 0) ? (1000 / fps) : 0;
+}
+
+
+term_Layer* term_layer_new(term_Ctx* ctx, term_Vec pos, term_Vec size, int z) {
+  term_Layer* layer = (term_Layer*) calloc(1, sizeof(term_Layer));
+  if (layer == NULL) return NULL;
+
+  layer->cells = (_Cell*) malloc(sizeof(_Cell) * size.x * size.y);
+  if (layer->cells == NULL) {
+    free(layer);
+    return NULL;
+  }
+
+  layer->ctx = ctx;
+  layer->pos = pos;
+  layer->size = size;
+  layer->z = z;
+  layer->visible = true;
+  _fill_cells(layer->cells, size.x * size.y, _transparent);
+
+  /* The grid drawn by term_setcell() is now separate from the back grid. */
+  _grid_resize(ctx, ctx->screensize);
+  if (ctx->base == ctx->back) {
+    int count = ctx->gridsize.x * ctx->gridsize.y;
+    ctx->base = (_Cell*) malloc(sizeof(_Cell) * count);
+    assert(ctx->base != NULL && "malloc() failed.");
+    memcpy(ctx->base, ctx->back, sizeof(_Cell) * count);
+  }
+
+  /* Insert after the layers with the same or lower z. */
+  term_Layer** link = &ctx->layers;
+  while (*link != NULL && (*link)->z <= z) link = &(*link)->next;
+  layer->next = *link;
+  *link = layer;
+
+  return layer;
+}
+
+
+void term_layer_free(term_Layer* layer) {
+  term_Ctx* ctx = layer->ctx;
+  term_layer_show(layer, false);
+
+  term_Layer** link = &ctx->layers;
+  while (*link != layer) link = &(*link)->next;
+  *link = layer->next;
+
+  free(layer->cells);
+  free(layer);
+}
+
+
+void term_layer_setcell(term_Layer* layer, term_Vec pos, term_Cell cell) {
+  if (!BETWEEN(0, pos.x, layer->size.x - 1)) return;
+  if (!BETWEEN(0, pos.y, layer->size.y - 1)) return;
+
+  _Cell packed = _pack(layer->ctx, cell);
+  _Cell* target = layer->cells + pos.y * layer->size.x + pos.x;
+  if (memcmp(target, &packed, sizeof(_Cell)) == 0) return;
+  *target = packed;
+
+  if (!layer->visible) return;
+  _grid_resize(layer->ctx, layer->ctx->screensize);
+  term_Vec screen = term_vec(layer->pos.x + pos.x, layer->pos.y + pos.y);
+  _damage_rect(layer->ctx, screen, term_vec(1, 1), false);
+}
+
+
+void term_layer_clear(term_Layer* layer) {
+  _fill_cells(layer->cells, layer->size.x * layer->size.y, _transparent);
+  if (!layer->visible) return;
+  _grid_resize(layer->ctx, layer->ctx->screensize);
+  _damage_rect(layer->ctx, layer->pos, layer->size, false);
+}
+
+
+void term_layer_move(term_Layer* layer, term_Vec pos) {
+  if (_veceq(layer->pos, pos)) return;
+  if (layer->visible) {
+    _grid_resize(layer->ctx, layer->ctx->screensize);
+    _damage_rect(layer->ctx, layer->pos, layer->size, false);
+    _damage_rect(layer->ctx, pos, layer->size, false);
+  }
+  layer->pos = pos;
+}
+
+
+void term_layer_show(term_Layer* layer, bool visible) {
+  if (layer->visible == visible) return;
+  layer->visible = visible;
+  _grid_resize(layer->ctx, layer->ctx->screensize);
+  _damage_rect(layer->ctx, layer->pos, layer->size, false);
+}
+
+
+/* Composite the damaged cells of the grid and the visible layers. */
+static void _composite(term_Ctx* ctx) {
+  int width = ctx->gridsize.x;
+
+  for (int y = 0; y < ctx->gridsize.y; y++) {
+    term_Vec span = ctx->damage[y];
+    if (span.x > span.y) continue;
+
+    _Cell* row = ctx->back + y * width;
+    memcpy(row + span.x, ctx->base + y * width + span.x, sizeof(_Cell) * (span.y - span.x + 1));
+
+    for (term_Layer* layer = ctx->layers; layer != NULL; layer = layer->next) {
+      if (!layer->visible) continue;
+      int ly = y - layer->pos.y;
+      if (!BETWEEN(0, ly, layer->size.y - 1)) continue;
+
+      int first = (layer->pos.x > span.x) ? layer->pos.x : span.x;
+      int last = layer->pos.x + layer->size.x - 1;
+      if (last > span.y) last = span.y;
+
+      const _Cell* cells = layer->cells + ly * layer->size.x - layer->pos.x;
+      for (int x = first; x <= last; x++) {
+        if (cells[x].ch != 0) row[x] = cells[x];
+      }
+    }
+  }
+}
+
+
+/* Returns true if the back row y is the same as the front row fy. */
+static bool _row_match(term_Ctx* ctx, int y, int fy) {
+  int width = ctx->gridsize.x;
+  return ctx->back_hash[y] == ctx->front_hash[fy] &&
+         memcmp(ctx->back + y * width, ctx->front + fy * width, sizeof(_Cell) * width) == 0;
+}
+
+
+/*
+ * Returns the number of rows in [top, bottom] that would be the same as the
+ * back grid if the front rows are shifted up by the shift (down if negative),
+ * but aren't the same in their current place.
+ */
+static int _shift_gain(term_Ctx* ctx, int top, int bottom, int shift) {
+  int gain = 0;
+  for (int y = top; y <= bottom; y++) {
+    int fy = y + shift;
+    if (fy < top || fy > bottom) continue;
+    if (ctx->back_hash[y] == ctx->front_hash[y]) continue; /* Already the same. */
+    if (_row_match(ctx, y, fy)) gain++;
+  }
+  return gain;
+}
+
+
+/*
+ * Detect the vertical shift of the content between the front and back grid
+ * and scroll the terminal's region, so only the newly exposed lines have to
+ * be written. The front grid is updated to what's on the terminal after
+ * scrolling.
+ */
+static bool _render_scroll(term_Ctx* ctx) {
+  int width = ctx->gridsize.x, height = ctx->gridsize.y;
+
+  int top = 0, bottom = height - 1;
+  while (top <= bottom && ctx->back_hash[top] == ctx->front_hash[top]) top++;
+  while (bottom > top && ctx->back_hash[bottom] == ctx->front_hash[bottom]) bottom--;
+  if (bottom - top < 1) return false;
+
+  /*
+   * Candidate shifts are where the first changed row (content moved up) or
+   * the last changed row (content moved down) is in the front grid.
+   */
+  int best_shift = 0, best_gain = 0;
+  for (int fy = top; fy <= bottom; fy++) {
+    int shift = 0;
+    if (fy > top && ctx->front_hash[fy] == ctx->back_hash[top]) shift = fy - top;
+    else if (fy < bottom && ctx->front_hash[fy] == ctx->back_hash[bottom]) shift = fy - bottom;
+    if (shift == 0) continue;
+
+    int gain = _shift_gain(ctx, top, bottom, shift);
+    if (gain > best_gain) {
+      best_gain = gain;
+      best_shift = shift;
+    }
+  }
+
+  if (best_gain * width <= SCROLL_COST) return false;
+
+  /*
+   * Set the scroll region (DECSTBM) and scroll up (SU) or down (SD). The
+   * exposed lines are filled with the current background so the attributes
+   * are reset first. Setting and resetting the region homes the cursor.
+   */
+  int n = (best_shift > 0) ? best_shift : -best_shift;
+  _out_printf(ctx, "\x1b[0m\x1b[%i;%ir\x1b[%i%c\x1b[r",
+          top + 1, bottom + 1, n, (best_shift > 0) ? 'S' : 'T');
+
+  _Cell* region = ctx->front + top * width;
+  uint64_t* hashes = ctx->front_hash + top;
+  int rows = bottom - top + 1;
+  int exposed = (best_shift > 0) ? (rows - n) : 0; /* First exposed row. */
+
+  if (best_shift > 0) {
+    memmove(region, region + n * width, sizeof(_Cell) * width * (rows - n));
+    memmove(hashes, hashes + n, sizeof(uint64_t) * (rows - n));
+  } else {
+    memmove(region + n * width, region, sizeof(_Cell) * width * (rows - n));
+    memmove(hashes + n, hashes, sizeof(uint64_t) * (rows - n));
+  }
+
+  _fill_cells(region + exposed * width, n * width, _blank);
+  uint64_t blank_hash = _row_hash(region + exposed * width, width);
+  for (int i = exposed; i < exposed + n; i++) hashes[i] = blank_hash;
+
+  /* The rows of the region moved on the terminal, all of them are compared. */
+  _damage_rows(ctx, top, bottom);
+
+  return true;
+}
+
+
+/* Write the SGR sequence to set the style. */
+static void _render_style(term_Ctx* ctx, uint32_t id) {
+  _Style style = _style_get(ctx, id);
+  _out_puts(ctx, "\x1b[0");
+
+  if (style.attr & TERM_ATTR_BOLD) _out_puts(ctx, ";1");
+  if (style.attr & TERM_ATTR_DIM) _out_puts(ctx, ";2");
+  if (style.attr & TERM_ATTR_ITALIC) _out_puts(ctx, ";3");
+  if (style.attr & TERM_ATTR_UNDERLINE) _out_puts(ctx, ";4");
+  if (style.attr & TERM_ATTR_REVERSE) _out_puts(ctx, ";7");
+
+  term_Color colors[2] = { style.fg, style.bg };
+  for (int i = 0; i < 2; i++) {
+    term_Color c = colors[i];
+    if (c == TERM_COLOR_DEFAULT) continue;
+    if (c & 0x01000000) _out_printf(ctx, ";%i8;5;%i", 3 + i, (int) (c & 0xff));
+    else _out_printf(ctx, ";%i8;2;%i;%i;%i", 3 + i,
+                 (int) ((c >> 16) & 0xff), (int) ((c >> 8) & 0xff), (int) (c & 0xff));
+  }
+
+  _out_puts(ctx, "m");
+}
+
+
+/* Returns the number of decimal digits of n. */
+static int _digits(int n) {
+  int count = 1;
+  while (n >= 10) { n /= 10; count++; }
+  return count;
+}
+
+
+/* Returns true if the cell is a double width character (covers the next cell). */
+static bool _cell_wide(term_Ctx* ctx, _Cell cell) {
+  int value = (int) cell.ch;
+  if (cell.ch & TERM_CH_GRAPHEME) {
+    const uint8_t* entry = ctx->graphemes.data + (cell.ch & ~TERM_CH_GRAPHEME);
+    if (utf8_decodeBytesCount(entry[1]) > entry[0]) return false;
+    if (utf8_decodeBytes((uint8_t*) entry + 1, &value) <= 0) return false;
+  }
+  return value >= 0x1100 && utf8_charWidth(value) == 2;
+}
+
+
+/*
+ * Write the run of identical cells starting at x of the row (which is
+ * already styled and the cursor is at x) and returns the number of cells
+ * written. Blank runs are erased with ECH (or EL at the end of the row) and
+ * repeated characters are written with REP if the terminal supports it,
+ * whichever takes fewer bytes. A double width character is written alone
+ * and the covered cell is counted as written.
+ */
+static int _render_run(term_Ctx* ctx, const _Cell* back, const _Cell* front, int x, int width,
+                       term_Vec* cursor) {
+  const _Cell* cell = back + x;
+
+  /* The run ends at the last cell that needs to be written. */
+  int full = 1, count = 1;
+  while (x + full < width && memcmp(cell, back + x + full, sizeof(_Cell)) == 0) {
+    if (memcmp(back + x + full, front + x + full, sizeof(_Cell)) != 0) count = full + 1;
+    full++;
+  }
+
+  uint8_t buff[4];
+  const uint8_t* bytes = buff;
+  int ch = ' ', length = 1;
+  if (cell->ch & TERM_CH_GRAPHEME) {
+    const uint8_t* entry = ctx->graphemes.data + (cell->ch & ~TERM_CH_GRAPHEME);
+    bytes = entry + 1;
+    length = entry[0];
+    ch = -1;
+  } else {
+    ch = (cell->ch < ' ') ? ' ' : (int) cell->ch;
+    length = utf8_encodeValue(ch, buff);
+    if (length <= 0) { buff[0] = ' '; length = 1; }
+  }
+
+  if (_cell_wide(ctx, *cell)) {
+    if (x + 1 == width) { bytes = buff; buff[0] = ' '; length = 1; }
+    _out_write(ctx, (const char*) bytes, length);
+    cursor->x += (x + 1 == width) ? 1 : 2;
+    return (x + 1 == width) ? 1 : 2;
+  }
+
+  int cost = count * length; /* Cost of writing the cells. */
+  _Style style = _style_get(ctx, cell->style);
+  bool blank = (ch == ' ' && style.attr == TERM_ATTR_NONE && style.bg == TERM_COLOR_DEFAULT);
+
+  /* Erase to the end of line: ESC[K, the cursor doesn't move. */
+  if (blank && x + full == width && 3 < cost) {
+    _out_puts(ctx, "\x1b[K");
+    return full;
+  }
+
+  /* Erase characters: ESC[nX then move the cursor forward with ESC[nC. */
+  if (blank && (3 + _digits(count)) * 2 < cost) {
+    _out_printf(ctx, "\x1b[%iX\x1b[%iC", count, count);
+    cursor->x += count;
+    return count;
+  }
+
+  /* Write the character once and repeat it: ESC[nb (not a grapheme). */
+  if ((ctx->caps & TERM_CAP_REP) && ch >= 0 && count > 1 && length + 3 + _digits(count - 1) < cost) {
+    _out_write(ctx, (const char*) bytes, length);
+    _out_printf(ctx, "\x1b[%ib", count - 1);
+    cursor->x += count;
+    return count;
+  }
+
+  for (int i = 0; i < count; i++) _out_write(ctx, (const char*) bytes, length);
+  cursor->x += count;
+  return count;
+}
+
+
+void term_render(term_Ctx* ctx) {
+  _STAT_START(start);
+  bool frame = !ctx->in_frame;
+  if (frame) term_begin_frame(ctx);
+
+  /* The size is queried once per frame, the grid functions till the next
+   * frame resize to the same ctx->screensize. */
+  _check_resize(ctx);
+  bool resized = _grid_resize(ctx, ctx->screensize);
+
+  /* The terminal missed some output, redraw everything. */
+  if (!resized && ctx->out_dropped) {
+    int count = ctx->gridsize.x * ctx->gridsize.y;
+    _fill_cells(ctx->front, count, _blank);
+    uint64_t hash = _row_hash(ctx->front, ctx->gridsize.x);
+    for (int y = 0; y < ctx->gridsize.y; y++) ctx->front_hash[y] = hash;
+  }
+
+  if (resized || ctx->out_dropped) {
+    ctx->out_dropped = false;
+    _out_puts(ctx, "\x1b[0m\x1b[2J");
+    _damage_rows(ctx, 0, ctx->gridsize.y - 1);
+  }
+
+#ifdef TERM_DRAW_QUEUE
+  _draw_drain(ctx, true);
+#endif
+
+  if (ctx->layers != NULL) _composite(ctx);
+
+  /* The rows without damage are the same as the front grid. */
+  int width = ctx->gridsize.x, height = ctx->gridsize.y;
+  for (int y = 0; y < height; y++) {
+    if (ctx->damage[y].x > ctx->damage[y].y) ctx->back_hash[y] = ctx->front_hash[y];
+    else ctx->back_hash[y] = _row_hash(ctx->back + y * width, width);
+  }
+
+  uint32_t style = _blank.style; /* Current style of the terminal. */
+  term_Vec cursor = term_vec(-1, -1); /* Current cursor position. */
+
+  if (_render_scroll(ctx)) {
+    cursor = term_vec(0, 0);
+  } else {
+    _out_puts(ctx, "\x1b[0m");
+  }
+
+  for (int y = 0; y < height; y++) {
+    term_Vec span = ctx->damage[y];
+    if (span.x > span.y) continue;
+    if (ctx->back_hash[y] == ctx->front_hash[y] && _row_match(ctx, y, y)) continue;
+
+    _Cell* back = ctx->back + y * width;
+    _Cell* front = ctx->front + y * width;
+    _STAT(ctx->stats.cells_diffed += span.y - span.x + 1);
+
+    for (int x = span.x; x <= span.y; x++) {
+      if (memcmp(back + x, front + x, sizeof(_Cell)) == 0) continue;
+      if (x > 0 && _cell_wide(ctx, back[x - 1])) continue;
+
+      /* Overwriting a double width character clears the cell it covered. */
+      if (x + 1 < width && _cell_wide(ctx, front[x]) && !_cell_wide(ctx, back[x])) {
+        front[x + 1] = _invalid;
+        if (span.y < x + 1) span.y = ctx->damage[y].y = x + 1;
+      }
+
+      if (cursor.x != x || cursor.y != y) {
+        _out_printf(ctx, "\x1b[%i;%iH", y + 1, x + 1);
+        cursor = term_vec(x, y);
+      }
+
+      if (back[x].style != style) {
+        _render_style(ctx, back[x].style);
+        style = back[x].style;
+      }
+
+      int count = _render_run(ctx, back, front, x, width, &cursor);
+      _STAT(ctx->stats.cells_emitted += count);
+      x += count - 1;
+    }
+  }
+
+  if (style != _blank.style) {
+    _out_puts(ctx, "\x1b[0m");
+  }
+
+  for (int y = 0; y < height; y++) {
+    term_Vec span = ctx->damage[y];
+    if (span.x > span.y) continue;
+    memcpy(ctx->front + y * width + span.x, ctx->back + y * width + span.x,
+           sizeof(_Cell) * (span.y - span.x + 1));
+  }
+  memcpy(ctx->front_hash, ctx->back_hash, sizeof(uint64_t) * height);
+  _damage_reset(ctx);
+  ctx->last_frame = _time_ms();
+
+  /* After writing the last column the cursor is waiting to wrap. */
+  if (cursor.x >= 0) {
+    ctx->cursor = cursor;
+    ctx->cursor_known = (cursor.x < width);
+  }
+
+  _STAT(ctx->stats.frames++);
+  _STAT(_hist_add(&ctx->stats.frame_us, (_time_ns() - start) / 1000));
+
+  if (frame) term_end_frame(ctx);
+
+#ifdef TERM_STATS
+  if (ctx->stats_interval > 0 && ctx->last_frame - ctx->stats_last >= ctx->stats_interval) {
+    ctx->stats_last = ctx->last_frame;
+    term_stats_dump(ctx, ctx->stats_fd);
+  }
+#endif
+}
+
+
+/*****************************************************************************/
+/* INPUT PROCESSING                                                          */
+/*****************************************************************************/
+
+#if defined(TERM_SYS_WIN)
+
+
+/*
+ * Convert windows virtual keys to term_KeyCodes. Returns false if the key
+ * should be ignored as an event (ex: shift, ctrl, ...).
+ */
+static bool _toTermKeyCode(WORD vk, term_KeyCode * kc) {
+
+  if (0x30 <= vk && vk <= 0x39) { *kc = (term_KeyCode)TERM_KC_0 + (vk - 0x30); return true; }
+  if (0x60 <= vk && vk <= 0x69) { *kc = (term_KeyCode)TERM_KC_0 + (vk - 0x60); return true; }
+  if (0x41 <= vk && vk <= 0x5a) { *kc = (term_KeyCode)TERM_KC_A + (vk - 0x41); return true; }
+  if (0x70 <= vk && vk <= 0x7b) { *kc = (term_KeyCode)TERM_KC_F1 + (vk - 0x70); return true; }
+
+  /*
+   * Note that shift, ctrl, alt keys are returned as TERM_KC_UNKNOWN
+   *since *nix systems don't support them.
+   */
+  switch (vk) {
+  case VK_BACK: *kc = TERM_KC_BACKSPACE; break;
+  case VK_TAB: *kc = TERM_KC_TAB; break;
+  case VK_RETURN: *kc = TERM_KC_ENTER; break;
+  case VK_ESCAPE: *kc = TERM_KC_ESC; break;
+  case VK_SPACE: *kc = TERM_KC_SPACE; break;
+  case VK_PRIOR: *kc = TERM_KC_PAGEUP; break;
+  case VK_NEXT: *kc = TERM_KC_PAGEDOWN; break;
+  case VK_END: *kc = TERM_KC_END; break;
+  case VK_HOME: *kc = TERM_KC_HOME; break;
+  case VK_LEFT: *kc = TERM_KC_LEFT; break;
+  case VK_RIGHT: *kc = TERM_KC_RIGHT; break;
+  case VK_UP: *kc = TERM_KC_UP; break;
+  case VK_DOWN: *kc = TERM_KC_DOWN; break;
+  case VK_INSERT: *kc = TERM_KC_INSERT; break;
+  case VK_DELETE: *kc = TERM_KC_DELETE; break;
+
+  case VK_SHIFT:
+  case VK_CONTROL:
+  case VK_MENU:
+  case VK_PAUSE:
+  case VK_CAPITAL: /* Capslock. */
+    return false;
+  }
+
+  return true;
+}
+
+
+static bool _read_event(term_Ctx* ctx, term_Event* event, int wait_ms) {
+  memset(event, 0, sizeof(term_Event));
+  event->type = TERM_ET_UNKNOWN;
+
+  /* The console API replies immediately, no need to wait for the events. */
+  if (ctx->position_pending > 0) {
+    ctx->position_pending--;
+    event->type = TERM_ET_CURSOR_POSITION;
+    event->position = term_getposition(ctx);
+    ctx->cursor = event->position;
+    ctx->cursor_known = true;
+    return true;
+  }
+
+  DWORD count;
+  if (!GetNumberOfConsoleInputEvents(ctx->h_in, &count)) {
+    /* TODO: error handle api ("GetNumberOfConsoleInputEvents() failed."). */
+    return false;
+  }
+
+  if (count == 0) return false;
+
+  INPUT_RECORD ir;
+  if (!ReadConsoleInput(ctx->h_in, &ir, 1, &count)) {
+    /* TODO: error handle api ("ReadConsoleInput() failed."). */
+    return false;
+  }
+
+  switch (ir.EventType) {
+    case KEY_EVENT: {
+      KEY_EVENT_RECORD* ker = &ir.Event.KeyEvent;
+
+      /*
+       * Key up events are only available in *nix systems with the kitty
+       * keyboard protocol, so they're reported only if it's enabled.
+       */
+      bool events = (ctx->kb_flags & TERM_KB_EVENT_TYPES);
+      if (!ker->bKeyDown) {
+        if (ctx->last_key == ker->wVirtualKeyCode) ctx->last_key = 0;
+        if (!events) return false;
+      }
+
+      if (!_toTermKeyCode(ker->wVirtualKeyCode, &event->key.code)) return false;
+
+      event->type = (ker->bKeyDown) ? TERM_ET_KEY_DOWN : TERM_ET_KEY_UP;
+      event->key.ascii = ker->uChar.AsciiChar;
+
+      if (ker->bKeyDown) {
+        event->key.repeat = events && (ctx->last_key == ker->wVirtualKeyCode);
+        ctx->last_key = ker->wVirtualKeyCode;
+      }
+
+      if ((ker->dwControlKeyState & LEFT_ALT_PRESSED) || (ker->dwControlKeyState & RIGHT_ALT_PRESSED))
+        event->key.modifiers |= TERM_MD_ALT;
+      if ((ker->dwControlKeyState & LEFT_CTRL_PRESSED) || (ker->dwControlKeyState & RIGHT_CTRL_PRESSED))
+        event->key.modifiers |= TERM_MD_CTRL;
+      if (ker->dwControlKeyState & SHIFT_PRESSED)
+        event->key.modifiers |= TERM_MD_SHIFT;
+
+    } break;
+
+    case MOUSE_EVENT: {
+
+      MOUSE_EVENT_RECORD* mer = &ir.Event.MouseEvent;
+
+      bool pressed = mer->dwButtonState; /* If any state is on pressed will be true. */
+
+      /* Xor will give != 0 if any button changed. */
+      DWORD change = ctx->mouse_buttons ^ mer->dwButtonState;
+
+      if (change != 0) {
+        /*
+         * What if the mouse doesn't have the middle button and right
+         * button is the second button?.
+         */
+        if (change & FROM_LEFT_1ST_BUTTON_PRESSED) {
+          pressed = mer->dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED;
+          event->mouse.button = TERM_MB_LEFT;
+
+        } else if (change & RIGHTMOST_BUTTON_PRESSED) {
+          pressed = mer->dwButtonState & RIGHTMOST_BUTTON_PRESSED;
+          event->mouse.button = TERM_MB_RIGHT;
+
+        } else if (change & FROM_LEFT_2ND_BUTTON_PRESSED) {
+          pressed = mer->dwButtonState & FROM_LEFT_2ND_BUTTON_PRESSED;
+          event->mouse.button = TERM_MB_MIDDLE;
+        }
+      }
+      ctx->mouse_buttons = mer->dwButtonState;
+
+      event->mouse.pos.x = mer->dwMousePosition.X;
+      event->mouse.pos.y = mer->dwMousePosition.Y;
+
+      if (mer->dwEventFlags == 0) {
+        event->type = (pressed) ? TERM_ET_MOUSE_DOWN : TERM_ET_MOUSE_UP;
+
+      } else if (mer->dwEventFlags & MOUSE_MOVED) {
+        if (_veceq(ctx->mousepos, event->mouse.pos)) {
+          return false;
+        }
+        event->type = (pressed) ? TERM_ET_MOUSE_DRAG : TERM_ET_MOUSE_MOVE;
+
+      } else if (mer->dwEventFlags & MOUSE_WHEELED) {
+        event->type = TERM_ET_MOUSE_SCROLL;
+        event->mouse.scroll = (mer->dwButtonState & 0xFF000000) ? true : false;
+        event->mouse.delta = 1;
+
+      } else if (mer->dwEventFlags & DOUBLE_CLICK) {
+        event->type = TERM_ET_DOUBLE_CLICK;
+      }
+
+      ctx->mousepos.x = event->mouse.pos.x;
+      ctx->mousepos.y = event->mouse.pos.y;
+
+      if ((mer->dwControlKeyState & LEFT_ALT_PRESSED) || (mer->dwControlKeyState & RIGHT_ALT_PRESSED))
+        event->mouse.modifiers |= TERM_MD_ALT;
+      if ((mer->dwControlKeyState & LEFT_CTRL_PRESSED) || (mer->dwControlKeyState & RIGHT_CTRL_PRESSED))
+        event->mouse.modifiers |= TERM_MD_CTRL;
+      if (mer->dwControlKeyState & SHIFT_PRESSED)
+        event->mouse.modifiers |= TERM_MD_SHIFT;
+
+    } break;
+
+    case WINDOW_BUFFER_SIZE_EVENT: {
+    #if ! NO_WINDOW_RESIZE_EVENT
+      WINDOW_BUFFER_SIZE_RECORD* wbs = &ir.Event.WindowBufferSizeEvent;
+      event->type = TERM_ET_RESIZE;
+      term_Vec newsize = term_vec(wbs->dwSize.X, wbs->dwSize.Y);
+      if (ctx->screensize.x == newsize.x && ctx->screensize.y == newsize.y) return false;
+      ctx->screensize = newsize;
+      event->resize = ctx->screensize;
+    #else
+      return false;
+    #endif
+    } break;
+
+    /* Not handling as it's not available in *nix. */
+    case MENU_EVENT:
+    case FOCUS_EVENT:
+      return false;
+  }
+
+  if (!(ctx->event_mask & TERM_EVENT_BIT(event->type))) return false;
+
+  return event->type != TERM_ET_UNKNOWN;
+}
+
+#elif defined(TERM_SYS_NIX)
+
+/*
+ * Returns the length of the escape sequence at the start of the buffer
+ * (including the ESC) or 0 if it's not complete yet. A lone ESC and the start
+ * of an escape sequence look the same, so an incomplete sequence is resolved
+ * with the escape timeout in _read_event().
+ */
+static uint32_t _escape_length(const char* buff, uint32_t size) {
+  assert(size > 0 && buff[0] == '\x1b');
+  if (size == 1) return 0;
+
+  switch (buff[1]) {
+
+    /* Another escape sequence starts, this one is a lone ESC. */
+    case '\x1b':
+      return 1;
+
+    /* SS3 sequence: ESC O <final>, otherwise it's Alt+O. */
+    case 'O': {
+      if (size == 2) return 0;
+      char c = buff[2];
+      if (BETWEEN('A', c, 'D') || BETWEEN('P', c, 'S') || c == 'F' || c == 'H') {
+        return 3;
+      }
+      return 2;
+    }
+
+    /*
+     * DCS sequence (replies of the terminal queries): ESC P <data> ST where
+     * ST is ESC \ or BEL. Otherwise it's Alt+P.
+     */
+    case 'P': {
+      if (size == 2) return 0;
+      char c = buff[2];
+      if (!BETWEEN('0', c, '9') && c != '>' && c != '+' && c != '$') return 2;
+
+      for (uint32_t length = 3; length < size; length++) {
+        if (buff[length] == '\a') return length + 1;
+        if (buff[length] == '\x1b') {
+          if (length + 1 == size) return 0;
+          return length + ((buff[length + 1] == '\\') ? 2 : 0);
+        }
+      }
+      return 0;
+    }
+
+    /*
+     * CSI sequence: ESC [ <parameters> <final> where final byte is in the
+     * range 0x40 - 0x7e. The linux console sends ESC [ [ <final> for F1-F5.
+     */
+    case '[': {
+      uint32_t length = (size > 2 && buff[2] == '[') ? 3 : 2;
+      while (length < size) {
+        char c = buff[length++];
+        if (BETWEEN(0x40, c, 0x7e)) return length;
+        if (c == '\x1b') return length - 1; /* Broken sequence. */
+      }
+      return 0;
+    }
+  }
+
+  /* Alt + key. */
+  return 2;
+}
+
+
+/*
+ * Wait for input upto timeout_ms milliseconds (0 won't block, negative will
+ * block forever) and append it to the input buffer. Returns true if any bytes
+ * were read.
+ */
+static bool _buff_fill(term_Ctx* ctx, int timeout_ms) {
+#ifdef TERM_REPLAY
+  if (ctx->replay != NULL) return _replay_fill(ctx, timeout_ms);
+#endif
+
+  if (ctx->buffc >= ctx->buff_size || ctx->in_fd < 0) return false;
+
+  struct pollfd pfd;
+  pfd.fd = ctx->in_fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, timeout_ms) <= 0) return false;
+
+  /* A read is at most INPUT_BUFF_SZ even in a grown buffer (the record size). */
+  int space = ctx->buff_size - ctx->buffc;
+  if (space > INPUT_BUFF_SZ) space = INPUT_BUFF_SZ;
+  int count = read(ctx->in_fd, ctx->buff + ctx->buffc, space);
+  if (count <= 0) return false;
+
+#ifdef TERM_REPLAY
+  if (ctx->record != NULL) _record(ctx, ctx->buff + ctx->buffc, count);
+#endif
+
+  _STAT(ctx->stats.input_bytes += count);
+  ctx->buffc += count;
+  return true;
+}
+
+
+/*
+ * Make space in the input buffer while waiting for a reply, the buffered input
+ * is kept for the event parser so the buffer grows if it's full. Returns false
+ * if it's already INPUT_BUFF_MAX.
+ */
+static bool _buff_reserve(term_Ctx* ctx) {
+  if (ctx->buffc < ctx->buff_size) return true;
+  if (ctx->buff_size >= INPUT_BUFF_MAX) return false;
+
+  int32_t size = ctx->buff_size * 2;
+  uint8_t* buff = (uint8_t*) malloc(size);
+  if (buff == NULL) return false;
+  memcpy(buff, ctx->buff, ctx->buffc);
+  if (ctx->buff != ctx->buff_inline) free(ctx->buff);
+  ctx->buff = buff;
+  ctx->buff_size = size;
+  return true;
+}
+
+
+static void _key_event(char c, term_Event* event) {
+  event->type = TERM_ET_KEY_DOWN;
+  event->key.ascii = c;
+
+  /* Note: Ctrl+M and <enter> both reads as '\r'. */
+  if (c == '\r') { event->key.code = TERM_KC_ENTER; return; }
+  if (c == 127) { event->key.code = TERM_KC_BACKSPACE; return; }
+  if (c == 9) { event->key.code = TERM_KC_TAB; return; }
+  if (c == 32) { event->key.code = TERM_KC_SPACE; return; }
+
+  event->key.code = (term_KeyCode) c;
+
+  /* Ctrl + key */
+  if (1 <= c && c <= 26) {
+    event->key.modifiers |= TERM_MD_CTRL;
+    event->key.code = (term_KeyCode)('A' + (c - 1));
+
+  } else if (BETWEEN('a', c, 'z') || BETWEEN('A', c, 'Z') || BETWEEN('0', c, '9')) {
+    event->key.code = (term_KeyCode) toupper(c);
+    if (BETWEEN('A', c, 'Z')) event->key.modifiers |= TERM_MD_SHIFT;
+  }
+}
+
+
+/* Reference: https://invisible-island.net/xterm/ctlseqs/ctlseqs.html#h2-Mouse-Tracking */
+static void _mouse_event(const char* buff, uint32_t count, term_Event * event) {
+
+  /* buff = cb ; cx ; cy m|M */
+
+  const char* c = buff;
+  if (!(BETWEEN('0', *c, '9'))) return;
+
+  int cb = 0, cx = 0, cy = 0;
+  char m;
+
+  while (BETWEEN('0', *c, '9')) cb = cb * 10 + (*c++ - '0');
+  if (*c++ != ';') return;
+  while (BETWEEN('0', *c, '9')) cx = cx * 10 + (*c++ - '0');
+  if (*c++ != ';') return;
+  while (BETWEEN('0', *c, '9')) cy = cy * 10 + (*c++ - '0');
+
+  m = *c++;
+  if (m != 'm' && m != 'M') return;
+
+  /*
+   * low two bits = button information.
+   * next three bits = modifiers.
+   * next bits = event type.
+   */
+  int low = cb & 0b11;
+  int high = (cb & 0b11100) >> 2;
+  int type = cb >> 5;
+
+  /* Note that the modifiers won't work/incorrect in WSL. */
+  if (high & 0b001) event->mouse.modifiers |= TERM_MD_SHIFT;
+  if (high & 0b010) event->mouse.modifiers |= TERM_MD_ALT;
+  if (high & 0b100) event->mouse.modifiers |= TERM_MD_CTRL;
+
+  event->mouse.pos.x = cx - 1;
+  event->mouse.pos.y = cy - 1;
+
+  switch (type) {
+    case 0: {
+      event->type = (m == 'M') ? TERM_ET_MOUSE_DOWN : TERM_ET_MOUSE_UP;
+      event->mouse.button = (term_MouseBtn)(low + 1);
+    } break;
+
+    case 1: {
+      if (low == 0b11) {  /* Mouse move. */
+        event->type = TERM_ET_MOUSE_MOVE;
+
+      } else { /* Drag. */
+        event->type = TERM_ET_MOUSE_DRAG;
+        event->mouse.button = (term_MouseBtn)(low + 1);
+      }
+    } break;
+
+    case 2: { /* Scroll. */
+      event->type = TERM_ET_MOUSE_SCROLL;
+
+      if (low == 0) event->mouse.scroll = false;
+      else if (low == 1) event->mouse.scroll = true;
+      event->mouse.delta = 1;
+
+    } break;
+  }
+}
+
+
+/*
+ * Returns the event type of an SGR mouse report without parsing the position,
+ * used to filter the events with the event mask. buff = cb ; cx ; cy m|M
+ */
+static term_EventType _mouse_event_type(const char* buff, uint32_t count) {
+  if (count == 0) return TERM_ET_UNKNOWN;
+
+  int cb = 0;
+  for (const char* c = buff; BETWEEN('0', *c, '9'); c++) cb = cb * 10 + (*c - '0');
+
+  switch (cb >> 5) {
+    case 0: return (buff[count - 1] == 'M') ? TERM_ET_MOUSE_DOWN : TERM_ET_MOUSE_UP;
+    case 1: return ((cb & 0b11) == 0b11) ? TERM_ET_MOUSE_MOVE : TERM_ET_MOUSE_DRAG;
+    case 2: return TERM_ET_MOUSE_SCROLL;
+  }
+  return TERM_ET_UNKNOWN;
+}
+
+
+/*
+ * Parse a cursor position report of the form ESC[n;mR where n is the row and
+ * m is the column (1 based). Returns false if it's not a position report.
+ */
+static bool _parse_position_report(const char* buff, uint32_t count, term_Vec* pos) {
+  if (count < 6 || buff[1] != '[' || buff[count - 1] != 'R') return false;
+
+  const char* c = buff + 2;
+  int row = 0, col = 0;
+
+  if (!BETWEEN('0', *c, '9')) return false;
+  while (BETWEEN('0', *c, '9')) row = row * 10 + (*c++ - '0');
+  if (*c++ != ';') return false;
+  if (!BETWEEN('0', *c, '9')) return false;
+  while (BETWEEN('0', *c, '9')) col = col * 10 + (*c++ - '0');
+  if (c != buff + count - 1) return false;
+
+  /* Since column, row numbers are 1 based substract 1 for 0 based. */
+  pos->x = col - 1;
+  pos->y = row - 1;
+  return true;
+}
+
+
+/*
+ * Find a cursor position report in the input buffer and remove it, without
+ * touching the rest of the buffered input.
+ */
+static bool _take_position_report(term_Ctx* ctx, term_Vec* pos) {
+  const char* buff = (const char*) ctx->buff;
+
+  for (int32_t i = 0; i < ctx->buffc; i++) {
+    if (buff[i] != '\x1b') continue;
+
+    uint32_t length = _escape_length(buff + i, ctx->buffc - i);
+    if (length == 0 || !_parse_position_report(buff + i, length, pos)) continue;
+
+    memmove(ctx->buff + i, ctx->buff + i + length, ctx->buffc - i - length);
+    ctx->buffc -= length;
+
+    if (ctx->position_pending > 0) ctx->position_pending--;
+    ctx->cursor = *pos;
+    ctx->cursor_known = true;
+    return true;
+  }
+
+  return false;
+}
+
+
+/* Convert a kitty keyboard protocol's key code to term_KeyCode. */
+static term_KeyCode _kitty_keycode(int key, char* ascii) {
+  *ascii = (key < 128) ? (char) key : 0;
+
+  switch (key) {
+    case 9: return TERM_KC_TAB;
+    case 13: return TERM_KC_ENTER;
+    case 27: return TERM_KC_ESC;
+    case 32: return TERM_KC_SPACE;
+    case 127: return TERM_KC_BACKSPACE;
+    case 57414: *ascii = '\r'; return TERM_KC_ENTER; /* Keypad enter. */
+  }
+
+  /* Keypad 0-9. */
+  if (BETWEEN(57399, key, 57408)) {
+    *ascii = (char) ('0' + (key - 57399));
+    return (term_KeyCode) *ascii;
+  }
+
+  if (BETWEEN('a', key, 'z')) return (term_KeyCode) toupper(key);
+  if (key < 128) return (term_KeyCode) key;
+
+  /* Modifier keys and the rest of the functional keys. */
+  return TERM_KC_UNKNOWN;
+}
+
+
+/* Convert the number of a legacy ESC[<number>~ key to term_KeyCode. */
+static term_KeyCode _tilde_keycode(int number) {
+  switch (number) {
+    case 1: case 7: return TERM_KC_HOME;
+    case 2: return TERM_KC_INSERT;
+    case 3: return TERM_KC_DELETE;
+    case 4: case 8: return TERM_KC_END;
+    case 5: return TERM_KC_PAGEUP;
+    case 6: return TERM_KC_PAGEDOWN;
+    case 23: return TERM_KC_F11;
+    case 24: return TERM_KC_F12;
+  }
+  if (BETWEEN(11, number, 15)) return (term_KeyCode) (TERM_KC_F1 + (number - 11));
+  if (BETWEEN(17, number, 21)) return (term_KeyCode) (TERM_KC_F6 + (number - 17));
+  return TERM_KC_UNKNOWN;
+}
+
+
+/*
+ * Parse the kitty keyboard protocol's key reports and the legacy keys with
+ * modifiers, which are of the form:
+ *
+ *   ESC [ key[:alternates] ; modifiers[:event] [; text] u
+ *   ESC [ 1 ; modifiers[:event] A|B|C|D|H|F|P|Q|R|S
+ *   ESC [ number ; modifiers[:event] ~
+ *
+ * Modifiers value is 1 + bit flags (shift: 1, alt: 2, ctrl: 4, super: 8)
+ * and the event is 1 for press, 2 for repeat and 3 for release.
+ *
+ * Reference: https://sw.kovidgoyal.net/kitty/keyboard-protocol/
+ */
+static bool _csi_key_event(const char* buff, uint32_t count, term_Event* event) {
+  char final = buff[count - 1];
+  const char* c = buff + 2;
+
+  int key = 0, mods = 1, type = 1;
+
+  while (BETWEEN('0', *c, '9')) key = key * 10 + (*c++ - '0');
+  while (*c == ':' || BETWEEN('0', *c, '9')) c++; /* Alternate keys. */
+
+  if (*c == ';') {
+    c++;
+    mods = 0;
+    while (BETWEEN('0', *c, '9')) mods = mods * 10 + (*c++ - '0');
+    if (*c == ':') {
+      c++;
+      type = 0;
+      while (BETWEEN('0', *c, '9')) type = type * 10 + (*c++ - '0');
+    }
+  } else if (final != 'u') {
+    return false; /* Legacy key without modifiers. */
+  }
+
+  /* Associated text is ignored. */
+  while (*c == ';' || *c == ':' || BETWEEN('0', *c, '9')) c++;
+  if (c != buff + count - 1) return false;
+
+  term_KeyCode code = TERM_KC_UNKNOWN;
+  char ascii = 0;
+
+  switch (final) {
+    case 'u': code = _kitty_keycode(key, &ascii); break;
+    case '~': code = _tilde_keycode(key); break;
+    case 'A': code = TERM_KC_UP; break;
+    case 'B': code = TERM_KC_DOWN; break;
+    case 'C': code = TERM_KC_RIGHT; break;
+    case 'D': code = TERM_KC_LEFT; break;
+    case 'H': code = TERM_KC_HOME; break;
+    case 'F': code = TERM_KC_END; break;
+    case 'P': code = TERM_KC_F1; break;
+    case 'Q': code = TERM_KC_F2; break;
+    case 'R': code = TERM_KC_F3; break;
+    case 'S': code = TERM_KC_F4; break;
+    default: return false;
+  }
+
+  if (code == TERM_KC_UNKNOWN) return true; /* Ignored key. */
+
+  mods = (mods > 0) ? mods - 1 : 0;
+  if (mods & 0b0001) event->key.modifiers |= TERM_MD_SHIFT;
+  if (mods & 0b0010) event->key.modifiers |= TERM_MD_ALT;
+  if (mods & 0b0100) event->key.modifiers |= TERM_MD_CTRL;
+  if (mods & 0b1000) event->key.modifiers |= TERM_MD_SUPER;
+
+  if ((mods & 0b0001) && BETWEEN('a', ascii, 'z')) ascii = (char) toupper(ascii);
+
+  event->type = (type == 3) ? TERM_ET_KEY_UP : TERM_ET_KEY_DOWN;
+  event->key.code = code;
+  event->key.ascii = ascii;
+  event->key.repeat = (type == 2);
+  return true;
+}
+
+
+/*
+ * Handle the replies of the terminal queries (ESC[?... and DCS) and returns
+ * false if the sequence isn't a reply.
+ */
+static bool _device_reply(term_Ctx* ctx, const char* buff, uint32_t count) {
+  char final = buff[count - 1];
+
+  /* The DCS replies end with ST (ESC \) or BEL. */
+  uint32_t st = (final == '\a') ? 1 : 2;
+
+  /* XTVERSION reply: DCS > | <name and version> ST */
+  if (count >= 4 + st && strncmp(buff + 1, "P>|", 3) == 0) {
+    int length = (int) (count - 4 - st);
+    if (length >= (int) sizeof(ctx->version)) length = (int) sizeof(ctx->version) - 1;
+    memcpy(ctx->version, buff + 4, length);
+    ctx->version[length] = '\0';
+    return true;
+  }
+
+  /*
+   * XTGETTCAP reply: DCS 1 + r <hex name>[=<hex value>] ST if the capability
+   * is available and DCS 0 + r <hex name> ST if not.
+   */
+  if (count > 5 && buff[1] == 'P') {
+    if (strncmp(buff + 3, "+r", 2) != 0) return true; /* Unknown reply. */
+    if (buff[2] != '1') return true;
+
+    const char* name = buff + 5;
+    uint32_t length = 0;
+    while (5 + length + st < count && name[length] != '=') length++;
+
+    #define _CAP_NAME(hex) (length == strlen(hex) && strncmp(name, (hex), length) == 0)
+    if (_CAP_NAME("726570")) ctx->caps |= TERM_CAP_REP; /* "rep" */
+    if (_CAP_NAME("524742") || _CAP_NAME("5463")) ctx->caps |= TERM_CAP_TRUECOLOR; /* "RGB", "Tc" */
+    #undef _CAP_NAME
+    return true;
+  }
+
+  if (count < 4 || strncmp(buff, "\x1b[?", 3) != 0) return false;
+
+  /* Primary device attributes (DA1): ESC[?<attributes>c */
+  if (final == 'c') return true;
+
+  /* Keyboard enhancement flags: ESC[?<flags>u */
+  if (final == 'u') {
+    ctx->kb_active = (term_KeyboardFlags) atoi(buff + 3);
+    ctx->caps |= TERM_CAP_KITTY_KEYBOARD;
+    return true;
+  }
+
+  /*
+   * DEC private mode report (DECRPM): ESC[?<mode>;<value>$y where value is
+   * 0: not recognized, 1: set, 2: reset, 3: permanently set, 4: permanently
+   * reset.
+   */
+  if (final == 'y' && count >= 4 && buff[count - 2] == '$') {
+    const char* c = buff + 3;
+    int mode = 0, value = 0;
+    while (BETWEEN('0', *c, '9')) mode = mode * 10 + (*c++ - '0');
+    if (*c++ != ';') return false;
+    while (BETWEEN('0', *c, '9')) value = value * 10 + (*c++ - '0');
+
+    if (mode == 2026 && (value == 1 || value == 2)) ctx->caps |= TERM_CAP_SYNC_OUTPUT;
+    return true;
+  }
+
+  return false;
+}
+
+
+/*
+ * Write the cache key of the terminal: "$TERM\t$TERM_PROGRAM $TERM_PROGRAM_VERSION".
+ * Returns false if the terminal doesn't export its version.
+ */
+static bool _caps_key(char* key, int size) {
+  const char* term = getenv("TERM");
+  const char* program = getenv("TERM_PROGRAM");
+  const char* version = getenv("TERM_PROGRAM_VERSION");
+  if (term == NULL || version == NULL || *version == '\0') return false;
+  if (program == NULL) program = "";
+  if (strchr(term, '\t') || strchr(program, '\t') || strchr(version, '\t')) return false;
+  int length = snprintf(key, size, "%s\t%s %s", term, program, version);
+  return length > 0 && length < size;
+}
+
+
+/* Write the cache file path, returns false if it's disabled. */
+static bool _caps_cache_path(term_Ctx* ctx, char* path, int size) {
+  if (ctx->caps_cache_off) return false;
+  if (ctx->caps_cache[0] != '\0') {
+    snprintf(path, size, "%s", ctx->caps_cache);
+    return true;
+  }
+
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir != NULL && *dir != '\0') {
+    snprintf(path, size, "%s/term_caps", dir);
+    return true;
+  }
+
+  const char* home = getenv("HOME");
+  if (home == NULL || *home == '\0') return false;
+  snprintf(path, size, "%s/.cache", home);
+  mkdir(path, 0755); /* Might not exist yet. */
+  snprintf(path, size, "%s/.cache/term_caps", home);
+  return true;
+}
+
+
+/*
+ * The cache file has a line for each terminal:
+ * "<key>\t<capability flags in hex>\t<XTVERSION reply>".
+ */
+static bool _caps_cache_load(term_Ctx* ctx, const char* path, const char* key) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL) return false;
+
+  char line[512];
+  size_t key_length = strlen(key);
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, key, key_length) != 0 || line[key_length] != '\t') continue;
+
+    char* end = NULL;
+    unsigned long caps = strtoul(line + key_length + 1, &end, 16);
+    if (end == NULL || *end != '\t') continue;
+
+    ctx->caps = (term_Caps) caps;
+    snprintf(ctx->version, sizeof(ctx->version), "%s", end + 1);
+    ctx->version[strcspn(ctx->version, "\r\n")] = '\0';
+    found = true;
+  }
+
+  fclose(file);
+  return found;
+}
+
+
+/* Replace the line of the key, and drop the oldest lines over the limit. */
+static void _caps_cache_store(term_Ctx* ctx, const char* path, const char* key) {
+  char lines[CAPS_CACHE_MAX][512];
+  int count = 0;
+
+  FILE* file = fopen(path, "r");
+  if (file != NULL) {
+    size_t key_length = strlen(key);
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (strchr(line, '\n') == NULL) continue; /* Truncated. */
+      if (strncmp(line, key, key_length) == 0 && line[key_length] == '\t') continue;
+      if (count == CAPS_CACHE_MAX - 1) {
+        memmove(lines[0], lines[1], sizeof(lines[0]) * (CAPS_CACHE_MAX - 2));
+        count--;
+      }
+      memcpy(lines[count++], line, sizeof(line));
+    }
+    fclose(file);
+  }
+
+  /* Write to a temporary file and rename, so a reader never sees a part. */
+  char tmp[300];
+  snprintf(tmp, sizeof(tmp), "%s.%i", path, (int) getpid());
+  file = fopen(tmp, "w");
+  if (file == NULL) return;
+  for (int i = 0; i < count; i++) fputs(lines[i], file);
+  fprintf(file, "%s\t%x\t%s\n", key, (unsigned) ctx->caps, ctx->version);
+  bool ok = !ferror(file);
+  if (fclose(file) != 0 || !ok || rename(tmp, path) != 0) remove(tmp);
+}
+
+
+/*
+ * Query the terminal capabilities with DECRQM (synchronized output),
+ * XTGETTCAP (REP and truecolor), the kitty keyboard flags and XTVERSION.
+ * They're followed by a primary device attributes request (DA1) which every
+ * terminal replies, so we don't have to wait till the timeout if the queries
+ * aren't supported. The replies are read with the event parser, and any
+ * other input read while waiting is kept in the buffer. The result is cached
+ * for the next run on the same terminal, see term_set_caps_cache().
+ */
+static void _probe_terminal(term_Ctx* ctx) {
+  if (!term_isatty(ctx)) return;
+
+  /* COLORTERM is the common way to tell truecolor support. */
+  const char* colorterm = getenv("COLORTERM");
+  term_Caps env_caps = TERM_CAP_NONE;
+  if (colorterm != NULL && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0)) {
+    env_caps = TERM_CAP_TRUECOLOR;
+  }
+
+  char key[256], path[256];
+  bool cached = _caps_key(key, sizeof(key)) && _caps_cache_path(ctx, path, sizeof(path));
+  if (cached && _caps_cache_load(ctx, path, key)) {
+    ctx->caps |= env_caps;
+    return;
+  }
+
+  _out_puts(ctx, "\x1b[?2026$p");
+  _out_puts(ctx, "\x1bP+q726570\x1b\\\x1bP+q524742\x1b\\\x1bP+q5463\x1b\\");
+  _out_puts(ctx, "\x1b[?u\x1b[>0q\x1b[c");
+  _out_flush(ctx);
+
+  int64_t deadline = _time_ms() + PROBE_TIMEOUT_MS;
+  int32_t i = 0; /* Buffer index that has been scanned. */
+  bool replied = false; /* Read the DA1 reply before the deadline. */
+
+  while (!replied) {
+    const char* buff = (const char*) ctx->buff;
+
+    while (i < ctx->buffc) {
+      if (buff[i] != '\x1b') { i++; continue; }
+
+      uint32_t length = _escape_length(buff + i, ctx->buffc - i);
+      if (length == 0) break; /* Wait for the rest. */
+
+      if (!_device_reply(ctx, buff + i, length)) { i += length; continue; }
+
+      bool da1 = (buff[i + length - 1] == 'c');
+      memmove(ctx->buff + i, ctx->buff + i + length, ctx->buffc - i - length);
+      ctx->buffc -= length;
+      if (da1) { replied = true; break; }
+    }
+
+    if (replied) break;
+    int remaining = (int) (deadline - _time_ms());
+    if (remaining <= 0 || !_buff_reserve(ctx)) break;
+    _buff_fill(ctx, remaining);
+  }
+
+  /* A timed out probe may have missed replies, don't cache it. */
+  if (cached && replied) _caps_cache_store(ctx, path, key);
+  ctx->caps |= env_caps;
+}
+
+
+void _parse_escape_sequence(term_Ctx* ctx, const char* buff, uint32_t count, term_Event* event) {
+  assert(buff[0] == '\x1b');
+
+  if (count == 1) {
+    event->type = TERM_ET_KEY_DOWN;
+    event->key.ascii = *buff;
+    event->key.code = TERM_KC_ESC;
+    return;
+  }
+
+  if (count == 2) {
+    _key_event(buff[1], event);
+    event->key.modifiers |= TERM_MD_ALT;
+    return;
+  }
+
+
+  #define _SET_KEY(keycode)            \
+    do {                               \
+      event->type = TERM_ET_KEY_DOWN;  \
+      event->key.code = keycode;       \
+    } while (false)
+
+  #define _MATCH(str) \
+    ((count >= strlen(str) + 1) && (strncmp(buff + 1, (str), strlen(str)) == 0))
+
+  if (_MATCH("[<")) _mouse_event(buff + 3, count - 3, event);
 
   /*
-   * low two bits = button information.
-   * next three bits = modifiers.
-   * next bits = event type.
+   * ESC[1;2R is also Shift+F3 in some terminals so it's only a position
+   * report if we're waiting for one.
    */
-  int low = cb & 0b11;
-  int high = (cb & 0b11100) >> 2;
-  int type = cb >> 5;
+  else if (ctx->position_pending > 0 &&
+           _parse_position_report(buff, count, &event->position)) {
+    event->type = TERM_ET_CURSOR_POSITION;
+    ctx->position_pending--;
+    ctx->cursor = event->position;
+    ctx->cursor_known = true;
+  }
+
+  else if (_device_reply(ctx, buff, count)) {
+    /* Replies of the terminal queries aren't events. */
+  }
+
+  else if (buff[1] == '[' && _csi_key_event(buff, count, event)) {
+    /* Kitty keyboard protocol or a key with modifiers. */
+  }
+
+  else if (_MATCH("[A") || _MATCH("OA")) _SET_KEY(TERM_KC_UP);
+  else if (_MATCH("[B") || _MATCH("OB")) _SET_KEY(TERM_KC_DOWN);
+  else if (_MATCH("[C") || _MATCH("OC")) _SET_KEY(TERM_KC_RIGHT);
+  else if (_MATCH("[D") || _MATCH("OD")) _SET_KEY(TERM_KC_LEFT);
+  else if (_MATCH("[5~") || _MATCH("[[5~")) _SET_KEY(TERM_KC_PAGEUP);
+  else if (_MATCH("[6~") || _MATCH("[[6~")) _SET_KEY(TERM_KC_PAGEDOWN);
+
+  else if (_MATCH("[H") || _MATCH("OH") || _MATCH("[1~") || _MATCH("[[7~")) _SET_KEY(TERM_KC_HOME);
+  else if (_MATCH("[F") || _MATCH("OF") || _MATCH("[4~") || _MATCH("[[8~")) _SET_KEY(TERM_KC_END);
+
+  else if (_MATCH("[2~")) _SET_KEY(TERM_KC_INSERT);
+  else if (_MATCH("[3~")) _SET_KEY(TERM_KC_DELETE);
+
+  else if (_MATCH("OP") || _MATCH("[11~")) _SET_KEY(TERM_KC_F1);
+  else if (_MATCH("OQ") || _MATCH("[12~")) _SET_KEY(TERM_KC_F2);
+  else if (_MATCH("OR") || _MATCH("[13~")) _SET_KEY(TERM_KC_F3);
+  else if (_MATCH("OS") || _MATCH("[14~")) _SET_KEY(TERM_KC_F4);
+
+  else if (_MATCH("[15~")) _SET_KEY(TERM_KC_F5);
+  else if (_MATCH("[17~")) _SET_KEY(TERM_KC_F6);
+  else if (_MATCH("[18~")) _SET_KEY(TERM_KC_F7);
+  else if (_MATCH("[19~")) _SET_KEY(TERM_KC_F8);
+  else if (_MATCH("[20~")) _SET_KEY(TERM_KC_F9);
+  else if (_MATCH("[21~")) _SET_KEY(TERM_KC_F10);
+  else if (_MATCH("[23~")) _SET_KEY(TERM_KC_F11);
+  else if (_MATCH("[24~")) _SET_KEY(TERM_KC_F12);
+
+  #undef _MATCH
+  #undef _SET_KEY
+}
+
+
+static void _buff_shift(term_Ctx* ctx, uint32_t length) {
+  assert(ctx->buff != NULL);
+  if (length < ctx->buffc) {
+    memmove(ctx->buff, ctx->buff + length, ctx->buffc - length);
+    ctx->buffc -= length;
+  } else {
+    ctx->buffc = 0;
+  }
+}
+
+
+/*
+ * Returns the length of the SGR mouse report at the given offset of the input
+ * buffer or 0 if there isn't a complete one.
+ */
+static uint32_t _mouse_report_length(term_Ctx* ctx, uint32_t offset) {
+  const char* buff = (const char*) ctx->buff + offset;
+  uint32_t size = ctx->buffc - offset;
+
+  if (size < 4 || strncmp(buff, "\x1b[<", 3) != 0) return 0;
+  uint32_t length = _escape_length(buff, size);
+  if (length == 0) return 0;
+  if (buff[length - 1] != 'm' && buff[length - 1] != 'M') return 0;
+  return length;
+}
+
+
+/*
+ * Collapse the mouse reports queued after the event into it, according to the
+ * coalescing flags. Returns the new event length in the input buffer.
+ */
+static uint32_t _coalesce_mouse(term_Ctx* ctx, term_Event* event, uint32_t event_length) {
+
+  bool motion = (event->type == TERM_ET_MOUSE_MOVE || event->type == TERM_ET_MOUSE_DRAG);
+  bool scroll = (event->type == TERM_ET_MOUSE_SCROLL);
+
+  if (motion && !(ctx->coalesce & TERM_CO_MOTION)) return event_length;
+  if (scroll && !(ctx->coalesce & TERM_CO_SCROLL)) return event_length;
+  if (!motion && !scroll) return event_length;
+
+  uint32_t length;
+  while ((length = _mouse_report_length(ctx, event_length)) != 0) {
+    const char* next = (const char*) ctx->buff + event_length;
+
+    term_Event ev;
+    memset(&ev, 0, sizeof(term_Event));
+    _mouse_event(next + 3, length - 3, &ev);
+
+    if (ev.type != event->type) break;
+    if (ev.mouse.button != event->mouse.button) break;
+    if (ev.mouse.modifiers != event->mouse.modifiers) break;
+
+    if (scroll) {
+      if (ev.mouse.scroll != event->mouse.scroll) break;
+      ev.mouse.delta = event->mouse.delta + 1;
+    }
+
+    *event = ev;
+    event_length += length;
+    _STAT(ctx->stats.events_coalesced++);
+  }
+
+  return event_length;
+}
+
+
+static bool _read_event(term_Ctx* ctx, term_Event* event, int wait_ms) {
+
+  memset(event, 0, sizeof(term_Event));
+  event->type = TERM_ET_UNKNOWN;
+
+  /* A resize is checked before waiting for an input. */
+  if (ctx->buffc == 0) _check_resize(ctx);
+  if (ctx->resize_pending) {
+    ctx->resize_pending = false;
+    if (!(ctx->event_mask & TERM_EVENT_BIT(TERM_ET_RESIZE))) return false;
+    event->type = TERM_ET_RESIZE;
+    event->resize = ctx->screensize;
+    return true;
+  }
+
+  /* Don't wait for new input if there is something to parse already. */
+  _buff_fill(ctx, (ctx->buffc > 0) ? 0 : wait_ms);
+  if (ctx->buffc == 0) return false;
+
+  uint32_t event_length = 1; /* Num of character for the event in the buffer. */
+
+  if (*ctx->buff == '\x1b') {
+    const char* buff = (const char*) ctx->buff;
+    event_length = _escape_length(buff, ctx->buffc);
+
+    /*
+     * The sequence isn't complete, wait for the rest of it till the escape
+     * timeout. If nothing follows, it's a lone ESC key, or an Alt+key if
+     * there is a single byte after it (or a broken sequence, which will be
+     * read as ESC followed by the rest of the keys).
+     */
+    int64_t deadline = _time_ms() + ctx->esc_timeout;
+    while (event_length == 0) {
+      int remaining = (int) (deadline - _time_ms());
+      if (remaining <= 0 || ctx->buffc >= ctx->buff_size) {
+        event_length = (ctx->buffc == 2) ? 2 : 1;
+        break;
+      }
+      if (_buff_fill(ctx, remaining)) event_length = _escape_length(buff, ctx->buffc);
+    }
+
+    /* Drop the masked mouse reports before parsing them. */
+    if (event_length > 3 && strncmp(buff, "\x1b[<", 3) == 0) {
+      term_EventType type = _mouse_event_type(buff + 3, event_length - 3);
+      if (!(ctx->event_mask & TERM_EVENT_BIT(type))) {
+        _buff_shift(ctx, event_length);
+        _STAT(ctx->stats.events_dropped++);
+        return false;
+      }
+    }
+
+    _STAT_START(start);
+    _parse_escape_sequence(ctx, buff, event_length, event);
+    event_length = _coalesce_mouse(ctx, event, event_length);
+    _STAT(_hist_add(&ctx->stats.parse_ns, _time_ns() - start));
+    _STAT(ctx->stats.events_parsed++);
+
+    if (event->type == TERM_ET_MOUSE_MOVE) {
+      if (_veceq(ctx->mousepos, event->mouse.pos)) {
+        _buff_shift(ctx, event_length);
+        _STAT(ctx->stats.events_dropped++);
+        return false;
+      }
+      ctx->mousepos = event->mouse.pos;
+    }
+
+  } else {
+    if (!(ctx->event_mask & TERM_EVENT_BIT(TERM_ET_KEY_DOWN))) {
+      _buff_shift(ctx, event_length);
+      _STAT(ctx->stats.events_dropped++);
+      return false;
+    }
+    _STAT_START(start);
+    _key_event(ctx->buff[0], event);
+    _STAT(_hist_add(&ctx->stats.parse_ns, _time_ns() - start));
+    _STAT(ctx->stats.events_parsed++);
+  }
+
+  _buff_shift(ctx, event_length);
+
+  if (!(ctx->event_mask & TERM_EVENT_BIT(event->type)) || event->type == TERM_ET_UNKNOWN) {
+    _STAT(ctx->stats.events_dropped++);
+    return false;
+  }
+
+  return true;
+}
+
+#endif /* TERM_SYS_NIX */
+
+
+#ifdef TERM_REPLAY
+
+/*****************************************************************************/
+/* RECORD AND REPLAY                                                         */
+/*****************************************************************************/
+
+/*
+ * The record file starts with the magic bytes followed by the records of
+ * the time since the previous record in microseconds, the byte count (both
+ * LEB128 varints) and the bytes.
+ */
+#define RECORD_MAGIC "TRM\x01"
+
+#if defined(TERM_SYS_WIN)
+
+bool term_record_input(term_Ctx* ctx, const char* path) {
+  return false;
+}
+
+
+bool term_replay_input(term_Ctx* ctx, const char* path, bool realtime) {
+  return false;
+}
+
+
+bool term_replaying(term_Ctx* ctx) {
+  return false;
+}
+
+
+bool term_write_trace(const char* path, term_Trace trace) {
+  return false;
+}
+
+
+bool term_bench_input(const char* path, term_BenchResult* result) {
+  return false;
+}
+
+#elif defined(TERM_SYS_NIX)
+
+/* Returns the monotonic time in microseconds. */
+static int64_t _time_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void _write_varint(FILE* file, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) byte |= 0x80;
+    fputc(byte, file);
+  } while (value != 0);
+}
+
+
+/* Returns false at the end of the file. */
+static bool _read_varint(FILE* file, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = fgetc(file);
+    if (byte == EOF) return false;
+    *value |= (uint64_t) (byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+
+static void _write_record(FILE* file, uint64_t delta, const uint8_t* data, uint32_t size) {
+  _write_varint(file, delta);
+  _write_varint(file, size);
+  fwrite(data, 1, size, file);
+}
+
+
+static void _record(term_Ctx* ctx, const uint8_t* data, uint32_t size) {
+  int64_t now = _time_us();
+  _write_record(ctx->record, (uint64_t) (now - ctx->record_time), data, size);
+  ctx->record_time = now;
+}
+
+
+/* Open the record file and check the magic bytes. */
+static FILE* _open_record(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) return NULL;
+
+  char magic[4];
+  if (fread(magic, 1, 4, file) != 4 || memcmp(magic, RECORD_MAGIC, 4) != 0) {
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+
+/* Read the next record to the pending bytes, returns false at the end. */
+static bool _replay_next(term_Ctx* ctx) {
+  uint64_t delta, size;
+  if (!_read_varint(ctx->replay, &delta) || !_read_varint(ctx->replay, &size) ||
+      size > INPUT_BUFF_SZ || fread(ctx->replay_data, 1, size, ctx->replay) != size) {
+    fclose(ctx->replay);
+    ctx->replay = NULL;
+    return false;
+  }
+
+  ctx->replay_time += (int64_t) delta;
+  ctx->replay_count = (uint32_t) size;
+  ctx->replay_offset = 0;
+  return true;
+}
+
+
+/* Append the replayed bytes to the input buffer, as if they were read. */
+static bool _replay_fill(term_Ctx* ctx, int timeout_ms) {
+  if (ctx->buffc >= ctx->buff_size) return false;
+  if (ctx->replay_offset == ctx->replay_count && !_replay_next(ctx)) return false;
+
+  /* Wait till the time the bytes were read. */
+  if (ctx->replay_realtime) {
+    int64_t wait = ctx->replay_start + ctx->replay_time - _time_us();
+    if (wait > 0) {
+      if (timeout_ms >= 0 && wait > (int64_t) timeout_ms * 1000) {
+        poll(NULL, 0, timeout_ms);
+        return false;
+      }
+      poll(NULL, 0, (int) ((wait + 999) / 1000));
+    }
+  }
+
+  uint32_t space = (uint32_t) (ctx->buff_size - ctx->buffc);
+  uint32_t count = ctx->replay_count - ctx->replay_offset;
+  if (count > space) count = space;
+  memcpy(ctx->buff + ctx->buffc, ctx->replay_data + ctx->replay_offset, count);
+  ctx->replay_offset += count;
+  _STAT(ctx->stats.input_bytes += count);
+  ctx->buffc += count;
+  return true;
+}
+
+
+bool term_record_input(term_Ctx* ctx, const char* path) {
+  if (ctx->record != NULL) fclose(ctx->record);
+  ctx->record = NULL;
+  if (path == NULL) return true;
+
+  ctx->record = fopen(path, "wb");
+  if (ctx->record == NULL) return false;
+
+  fwrite(RECORD_MAGIC, 1, 4, ctx->record);
+  ctx->record_time = _time_us();
+  return true;
+}
+
+
+bool term_replay_input(term_Ctx* ctx, const char* path, bool realtime) {
+  FILE* file = _open_record(path);
+  if (file == NULL) return false;
+
+  if (ctx->replay != NULL) fclose(ctx->replay);
+  ctx->replay = file;
+  ctx->replay_realtime = realtime;
+  ctx->replay_start = _time_us();
+  ctx->replay_time = 0;
+  ctx->replay_count = ctx->replay_offset = 0;
+  return true;
+}
+
+
+bool term_replaying(term_Ctx* ctx) {
+  return ctx->replay != NULL;
+}
+
+
+bool term_write_trace(const char* path, term_Trace trace) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL) return false;
+  fwrite(RECORD_MAGIC, 1, 4, file);
+
+  /* The input is split into records of a full read() each, 1 ms apart. */
+  char chunk[INPUT_BUFF_SZ];
+  int size = 0;
+
+  #define _TRACE_APPEND(str)                                              \
+    do {                                                                   \
+      int length = (int) strlen(str);                                      \
+      if (size + length > INPUT_BUFF_SZ) {                                 \
+        _write_record(file, 1000, (const uint8_t*) chunk, size);           \
+        size = 0;                                                          \
+      }                                                                    \
+      memcpy(chunk + size, str, length);                                   \
+      size += length;                                                      \
+    } while (false)
+
+  char seq[32];
+  if (trace == TERM_TRACE_MOUSE_STORM) {
+    for (int i = 0; i < 100000; i++) {
+      snprintf(seq, sizeof(seq), "\x1b[<35;%i;%iM", 1 + (i * 7) % 200, 1 + (i / 200) % 60);
+      _TRACE_APPEND(seq);
+    }
+
+  } else if (trace == TERM_TRACE_PASTE) {
+    for (int i = 0; i < 20000; i++) {
+      snprintf(seq, sizeof(seq), "line %i of the pasted text.\r", i);
+      _TRACE_APPEND(seq);
+    }
+
+  } else if (trace == TERM_TRACE_FUNCTION_KEYS) {
+    static const char* keys[] = {
+      "\x1bOP", "\x1bOQ", "\x1bOR", "\x1bOS", "\x1b[15~", "\x1b[17~", "\x1b[18~",
+      "\x1b[19~", "\x1b[20~", "\x1b[21~", "\x1b[23~", "\x1b[24~", "\x1b[A", "\x1b[B",
+      "\x1b[C", "\x1b[D", "\x1b[1;5A", "\x1b[1;3D", "\x1b[H", "\x1b[F", "\x1b[2~",
+      "\x1b[3~", "\x1b[5~", "\x1b[6~", "\x1b[97;5u", "\x1b[1;2P",
+    };
+    int count = (int) (sizeof(keys) / sizeof(*keys));
+    for (int i = 0; i < 100000; i++) _TRACE_APPEND(keys[i % count]);
+  }
+
+  #undef _TRACE_APPEND
+
+  if (size > 0) _write_record(file, 1000, (const uint8_t*) chunk, size);
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+
+bool term_bench_input(const char* path, term_BenchResult* result) {
+  memset(result, 0, sizeof(term_BenchResult));
+
+  /* Read the whole input of the trace for the parser benchmark. */
+  FILE* file = _open_record(path);
+  if (file == NULL) return false;
+
+  uint8_t* input = NULL;
+  uint64_t capacity = 0, delta, size;
+  while (_read_varint(file, &delta) && _read_varint(file, &size) && size <= INPUT_BUFF_SZ) {
+    while (result->bytes + size > capacity) {
+      capacity = (capacity == 0) ? 64 * 1024 : capacity * 2;
+      input = (uint8_t*) realloc(input, capacity);
+      assert(input != NULL && "realloc() failed.");
+    }
+    if (fread(input + result->bytes, 1, size, file) != size) break;
+    result->bytes += size;
+  }
+  fclose(file);
+
+  term_Ctx* ctx = term_ctx_new(-1, -1);
+  if (ctx == NULL || !term_replay_input(ctx, path, false)) {
+    term_ctx_free(ctx);
+    free(input);
+    return false;
+  }
+
+  /* The event loop. */
+  term_Event event;
+  int64_t start = _time_ns();
+  while (ctx->replay != NULL || ctx->buffc > 0) {
+    if (term_read_event(ctx, &event)) result->events++;
+  }
+  int64_t loop = _time_ns() - start;
+
+  /* The escape sequence parser alone. */
+  uint64_t sequences = 0;
+  start = _time_ns();
+  for (uint64_t i = 0; i < result->bytes; sequences++) {
+    uint32_t length = 1;
+    if (input[i] == '\x1b') {
+      uint64_t remaining = result->bytes - i;
+      if (remaining > INPUT_BUFF_SZ) remaining = INPUT_BUFF_SZ;
+      length = _escape_length((const char*) input + i, (uint32_t) remaining);
+      if (length == 0) length = 1;
+      _parse_escape_sequence(ctx, (const char*) input + i, length, &event);
+    } else {
+      _key_event((char) input[i], &event);
+    }
+    i += length;
+  }
+  int64_t parse = _time_ns() - start;
+
+  if (result->events > 0) result->loop_ns = (double) loop / result->events;
+  if (sequences > 0) result->parse_ns = (double) parse / sequences;
+  if (loop > 0) result->events_per_sec = result->events * 1e9 / loop;
+
+  term_ctx_free(ctx);
+  free(input);
+  return true;
+}
 
-  /* Note that the modifiers won't work/incorrect in WSL. */
-  if (high & 0b001) event->mouse.modifiers |= TERM_MD_SHIFT;
-  if (high & 0b010) event->mouse.modifiers |= TERM_MD_ALT;
-  if (high & 0b100) event->mouse.modifiers |= TERM_MD_CTRL;
+#endif /* TERM_SYS_NIX */
 
-  event->mouse.pos.x = cx - 1;
-  event->mouse.pos.y = cy - 1;
+#endif /* TERM_REPLAY */
 
-  switch (type) {
-    case 0: {
-      event->type = (m == 'M') ? TERM_ET_MOUSE_DOWN : TERM_ET_MOUSE_UP;
-      event->mouse.button = (term_MouseBtn)(low + 1);
-    } break;
 
-    case 1: {
-      if (low == 0b11) {  /* Mouse move. */
-        event->type = TERM_ET_MOUSE_MOVE;
+#ifdef TERM_VIEWER
 
-      } else { /* Drag. */
-        event->type = TERM_ET_MOUSE_DRAG;
-        event->mouse.button = (term_MouseBtn)(low + 1);
+/*****************************************************************************/
+/* FILE VIEWER                                                               */
+/*****************************************************************************/
+
+#if defined(TERM_SYS_WIN)
+
+term_Viewer* term_viewer_open(term_Ctx* ctx, const char* path) {
+  return NULL;
+}
+
+
+void term_viewer_close(term_Viewer* viewer) {
+}
+
+
+void term_viewer_draw(term_Viewer* viewer, term_Vec pos, term_Vec size) {
+}
+
+
+void term_viewer_scroll(term_Viewer* viewer, int64_t lines) {
+}
+
+
+void term_viewer_hscroll(term_Viewer* viewer, int columns) {
+}
+
+
+void term_viewer_goto_line(term_Viewer* viewer, uint64_t line) {
+}
+
+
+void term_viewer_goto_percent(term_Viewer* viewer, double percent) {
+}
+
+
+void term_viewer_info(term_Viewer* viewer, term_ViewerInfo* info) {
+}
+
+#elif defined(TERM_SYS_NIX)
+
+struct term_Viewer {
+  term_Ctx* ctx;
+  const uint8_t* data; /* Mapped file, NULL if it's empty. */
+  uint64_t size;
+  uint64_t page; /* Page size to drop the scanned pages. */
+
+  pthread_t indexer; /* Index thread, valid if the file isn't empty. */
+  atomic_bool stop;
+  pthread_mutex_t lock; /* Guards the index below. */
+  uint64_t* marks; /* Offset of every VIEWER_INDEX_STRIDE th line. */
+  uint64_t markc, mark_cap;
+  uint64_t indexed; /* Number of bytes indexed. */
+  uint64_t newlines; /* Newlines in the indexed bytes. */
+
+  uint64_t top; /* Offset of the top line. */
+  int64_t top_line; /* Top line number, -1 if it's not known yet. */
+  int column; /* Column of the line at the left edge. */
+  uint64_t drawn_begin, drawn_end; /* Bytes read by the last draw. */
+};
+
+
+/*
+ * Returns the offset after the count th newline of data[begin, end), or end
+ * if there are fewer, and adds the number of newlines passed to *found. The
+ * newlines are compared 64 bytes at a time with SSE2 and counted from the
+ * bit masks, other targets use memchr() which is vectorized by the libc.
+ */
+static uint64_t _find_newlines(const uint8_t* data, uint64_t begin, uint64_t end,
+                               uint64_t count, uint64_t* found) {
+  uint64_t i = begin, n = 0;
+
+#ifdef __SSE2__
+  const __m128i nl = _mm_set1_epi8('\n');
+  while (n < count && i + 64 <= end) {
+    const __m128i* block = (const __m128i*) (data + i);
+    uint64_t mask = (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 0), nl));
+    mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 1), nl)) << 16;
+    mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 2), nl)) << 32;
+    mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 3), nl)) << 48;
+
+    uint64_t bits = (uint64_t) __builtin_popcountll(mask);
+    if (n + bits < count) {
+      n += bits;
+      i += 64;
+      continue;
+    }
+
+    /* The count th newline is in the block, clear the bits before it. */
+    while (n + 1 < count) { mask &= mask - 1; n++; }
+    *found += n + 1;
+    return i + (uint64_t) __builtin_ctzll(mask) + 1;
+  }
+#endif
+
+  while (n < count && i < end) {
+    const uint8_t* next = (const uint8_t*) memchr(data + i, '\n', end - i);
+    if (next == NULL) { i = end; break; }
+    i = (uint64_t) (next - data) + 1;
+    n++;
+  }
+
+  *found += n;
+  return i;
+}
+
+
+/* Drop the mapped pages which are entirely in [begin, end) from the memory.
+ * Without MADV_DONTNEED (hidden by a strict POSIX build on the BSDs) it's
+ * only a hint with posix_madvise(). */
+static void _viewer_drop(term_Viewer* viewer, uint64_t begin, uint64_t end) {
+  begin = (begin + viewer->page - 1) & ~(viewer->page - 1);
+  end &= ~(viewer->page - 1);
+  if (begin >= end) return;
+#ifdef MADV_DONTNEED
+  madvise((void*) (viewer->data + begin), end - begin, MADV_DONTNEED);
+#else
+  posix_madvise((void*) (viewer->data + begin), end - begin, POSIX_MADV_DONTNEED);
+#endif
+}
+
+
+/* Like _find_newlines() to the end of the file, drops the pages it passed. */
+static uint64_t _viewer_scan(term_Viewer* viewer, uint64_t begin, uint64_t count, uint64_t* found) {
+  uint64_t offset = begin, n = 0;
+  while (n < count && offset < viewer->size) {
+    uint64_t end = offset + VIEWER_CHUNK_SZ;
+    if (end > viewer->size) end = viewer->size;
+
+    uint64_t chunk = offset;
+    offset = _find_newlines(viewer->data, offset, end, count - n, &n);
+    if (n < count && offset < viewer->size) _viewer_drop(viewer, chunk, offset);
+  }
+  *found += n;
+  return offset;
+}
+
+
+static void* _viewer_index(void* arg) {
+  term_Viewer* viewer = (term_Viewer*) arg;
+  uint64_t offset = 0, newlines = 0;
+
+  while (offset < viewer->size && !atomic_load(&viewer->stop)) {
+    uint64_t chunk = offset;
+    uint64_t end = offset + VIEWER_CHUNK_SZ;
+    if (end > viewer->size) end = viewer->size;
+
+    while (offset < end) {
+      uint64_t count = VIEWER_INDEX_STRIDE - newlines % VIEWER_INDEX_STRIDE, found = 0;
+      offset = _find_newlines(viewer->data, offset, end, count, &found);
+      newlines += found;
+      if (found < count || offset == viewer->size) continue;
+
+      pthread_mutex_lock(&viewer->lock);
+      if (viewer->markc == viewer->mark_cap) {
+        viewer->mark_cap *= 2;
+        viewer->marks = (uint64_t*) realloc(viewer->marks, sizeof(uint64_t) * viewer->mark_cap);
+        assert(viewer->marks != NULL && "realloc() failed.");
       }
-    } break;
+      viewer->marks[viewer->markc++] = offset;
+      pthread_mutex_unlock(&viewer->lock);
+    }
 
-    case 2: { /* Scroll. */
-      event->type = TERM_ET_MOUSE_SCROLL;
+    pthread_mutex_lock(&viewer->lock);
+    viewer->indexed = offset;
+    viewer->newlines = newlines;
+    pthread_mutex_unlock(&viewer->lock);
 
-      if (low == 0) event->mouse.scroll = false;
-      else if (low == 1) event->mouse.scroll = true;
+    _viewer_drop(viewer, chunk, offset);
+  }
 
-    } break;
+  return NULL;
+}
+
+
+/* Returns the offset of the line which contains the offset. */
+static uint64_t _line_start(term_Viewer* viewer, uint64_t offset) {
+  while (offset > 0 && viewer->data[offset - 1] != '\n') offset--;
+  return offset;
+}
+
+
+/*
+ * Set the top line count lines after the line at the offset (its number is
+ * line or -1 if not known), or the last line if there are fewer.
+ */
+static void _viewer_forward(term_Viewer* viewer, uint64_t offset, int64_t line, uint64_t count) {
+  uint64_t found = 0;
+  uint64_t next = _viewer_scan(viewer, offset, count, &found);
+
+  /* Passed the last line, the newline at the end doesn't start a line. */
+  if (next == viewer->size) {
+    uint64_t end = viewer->size;
+    if (found > 0 && viewer->data[end - 1] == '\n') { end--; found--; }
+    next = _line_start(viewer, end);
   }
+
+  viewer->top = next;
+  viewer->top_line = (line < 0) ? -1 : line + (int64_t) found;
 }
 
 
-void _parse_escape_sequence(const char* buff, uint32_t count, term_Event* event) {
-  assert(buff[0] == '\x1b');
+term_Viewer* term_viewer_open(term_Ctx* ctx, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
 
-  if (count == 1) {
-    event->type = TERM_ET_KEY_DOWN;
-    event->key.ascii = *buff;
-    event->key.code = TERM_KC_ESC;
-    return;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
   }
 
-  if (count == 2) {
-    _key_event(buff[1], event);
-    event->key.modifiers |= TERM_MD_ALT;
+  term_Viewer* viewer = (term_Viewer*) calloc(1, sizeof(term_Viewer));
+  if (viewer == NULL) {
+    close(fd);
+    return NULL;
+  }
+
+  viewer->ctx = ctx;
+  viewer->size = (uint64_t) st.st_size;
+  viewer->page = (uint64_t) sysconf(_SC_PAGESIZE);
+  if (viewer->size > 0) {
+    void* data = mmap(NULL, viewer->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      free(viewer);
+      return NULL;
+    }
+    viewer->data = (const uint8_t*) data;
+  }
+  close(fd);
+
+  /* The first line starts at 0. */
+  viewer->mark_cap = 64;
+  viewer->marks = (uint64_t*) malloc(sizeof(uint64_t) * viewer->mark_cap);
+  assert(viewer->marks != NULL && "malloc() failed.");
+  viewer->marks[0] = 0;
+  viewer->markc = 1;
+
+  pthread_mutex_init(&viewer->lock, NULL);
+  atomic_init(&viewer->stop, false);
+  if (viewer->size > 0 && pthread_create(&viewer->indexer, NULL, _viewer_index, viewer) != 0) {
+    pthread_mutex_destroy(&viewer->lock);
+    munmap((void*) viewer->data, viewer->size);
+    free(viewer->marks);
+    free(viewer);
+    return NULL;
+  }
+
+  return viewer;
+}
+
+
+void term_viewer_close(term_Viewer* viewer) {
+  if (viewer == NULL) return;
+  if (viewer->size > 0) {
+    atomic_store(&viewer->stop, true);
+    pthread_join(viewer->indexer, NULL);
+    munmap((void*) viewer->data, viewer->size);
+  }
+  pthread_mutex_destroy(&viewer->lock);
+  free(viewer->marks);
+  free(viewer);
+}
+
+
+/*
+ * Draw the line at the offset to the row of the cells and returns the offset
+ * of the next line. Tabs are expanded, control characters are drawn as their
+ * control pictures (U+2400...) and invalid bytes as U+FFFD.
+ */
+static uint64_t _viewer_draw_line(term_Viewer* viewer, uint64_t offset, term_Vec pos, int width) {
+  const uint8_t* data = viewer->data;
+  int left = viewer->column, right = viewer->column + width;
+  int col = 0; /* Column of the next character in the line. */
+  int base = -1; /* Cell of the last character to append the combining marks. */
+  uint64_t base_offset = 0;
+
+  uint64_t i = offset;
+  while (i < viewer->size && data[i] != '\n' && col < right) {
+    int value = data[i], length = 1;
+    if (value >= 0x80) {
+      length = utf8_decodeBytesCount(data[i]);
+      if ((uint64_t) length > viewer->size - i || utf8_decodeBytes((uint8_t*) data + i, &value) <= 0) {
+        value = 0xfffd;
+        length = 1;
+      }
+    }
+
+    if (value == '\t') {
+      int end = col + VIEWER_TAB_SZ - col % VIEWER_TAB_SZ;
+      for (; col < end; col++) {
+        if (col >= left && col < right) term_setcell(viewer->ctx, term_vec(pos.x + col - left, pos.y), term_cell(' '));
+      }
+      i += length;
+      base = -1;
+      continue;
+    }
+
+    /* A carriage return of a CRLF line ending isn't visible. */
+    if (value == '\r' && (i + 1 == viewer->size || data[i + 1] == '\n')) {
+      i += length;
+      continue;
+    }
+
+    int w = utf8_charWidth(value);
+    if (w < 0) {
+      value = (value < 0x20) ? 0x2400 + value : (value == 0x7f) ? 0x2421 : 0xfffd;
+      w = 1;
+    }
+
+    /* Append the combining mark to the grapheme of the last character. */
+    if (w == 0) {
+      if (base >= 0 && i + length - base_offset <= 32) {
+        term_Cell cell = term_cell(term_grapheme(viewer->ctx, (const char*) data + base_offset,
+                                                 (int) (i + length - base_offset)));
+        term_setcell(viewer->ctx, term_vec(pos.x + base, pos.y), cell);
+      }
+      i += length;
+      continue;
+    }
+
+    /* A double width character cut by an edge is drawn as a space. */
+    base = -1;
+    if (col >= left && col + w <= right) {
+      base = col - left;
+      base_offset = i;
+      term_setcell(viewer->ctx, term_vec(pos.x + base, pos.y), term_cell(value));
+      if (w == 2) term_setcell(viewer->ctx, term_vec(pos.x + base + 1, pos.y), term_cell(' '));
+    } else if (col + w > left) {
+      int x = (col < left) ? left : col;
+      term_setcell(viewer->ctx, term_vec(pos.x + x - left, pos.y), term_cell(' '));
+    }
+
+    col += w;
+    i += length;
+  }
+
+  for (int x = (col > left) ? col - left : 0; x < width; x++) {
+    term_setcell(viewer->ctx, term_vec(pos.x + x, pos.y), term_cell(' '));
+  }
+
+  /* Skip the rest of the line which is past the right edge. */
+  if (i < viewer->size && data[i] != '\n') {
+    uint64_t found = 0;
+    return _viewer_scan(viewer, i, 1, &found);
+  }
+  return (i < viewer->size) ? i + 1 : i;
+}
+
+
+void term_viewer_draw(term_Viewer* viewer, term_Vec pos, term_Vec size) {
+  uint64_t offset = viewer->top;
+
+  for (int y = 0; y < size.y; y++) {
+    if (offset < viewer->size) {
+      offset = _viewer_draw_line(viewer, offset, term_vec(pos.x, pos.y + y), size.x);
+    } else {
+      for (int x = 0; x < size.x; x++) term_setcell(viewer->ctx, term_vec(pos.x + x, pos.y + y), term_cell(' '));
+    }
+  }
+
+  /* Drop the pages of the last draw if they aren't visible anymore. */
+  if (viewer->drawn_end <= viewer->top || offset <= viewer->drawn_begin) {
+    _viewer_drop(viewer, viewer->drawn_begin, viewer->drawn_end);
+  }
+  viewer->drawn_begin = viewer->top;
+  viewer->drawn_end = offset;
+}
+
+
+void term_viewer_scroll(term_Viewer* viewer, int64_t lines) {
+  if (lines > 0) {
+    _viewer_forward(viewer, viewer->top, viewer->top_line, (uint64_t) lines);
     return;
   }
 
+  /* Long jumps up use the index. */
+  if (viewer->top_line >= 0 && -lines > VIEWER_INDEX_STRIDE) {
+    term_viewer_goto_line(viewer, (viewer->top_line + lines < 0) ? 0 : (uint64_t) (viewer->top_line + lines));
+    return;
+  }
 
-  #define _SET_KEY(keycode)            \
-    do {                               \
-      event->type = TERM_ET_KEY_DOWN;  \
-      event->key.code = keycode;       \
-    } while (false)
+  for (; lines < 0 && viewer->top > 0; lines++) {
+    viewer->top = _line_start(viewer, viewer->top - 1);
+    if (viewer->top_line > 0) viewer->top_line--;
+  }
+}
 
-  #define _MATCH(str) \
-    ((count >= strlen(str) + 1) && (strncmp(buff + 1, (str), strlen(str)) == 0))
 
-  if (_MATCH("[<")) _mouse_event(buff + 3, count - 3, event);
+void term_viewer_hscroll(term_Viewer* viewer, int columns) {
+  viewer->column += columns;
+  if (viewer->column < 0) viewer->column = 0;
+}
 
-  else if (_MATCH("[A") || _MATCH("OA")) _SET_KEY(TERM_KC_UP);
-  else if (_MATCH("[B") || _MATCH("OB")) _SET_KEY(TERM_KC_DOWN);
-  else if (_MATCH("[C") || _MATCH("OC")) _SET_KEY(TERM_KC_RIGHT);
-  else if (_MATCH("[D") || _MATCH("OD")) _SET_KEY(TERM_KC_LEFT);
-  else if (_MATCH("[5~") || _MATCH("[[5~")) _SET_KEY(TERM_KC_PAGEUP);
-  else if (_MATCH("[6~") || _MATCH("[[6~")) _SET_KEY(TERM_KC_PAGEDOWN);
 
-  else if (_MATCH("[H") || _MATCH("OH") || _MATCH("[1~") || _MATCH("[[7~")) _SET_KEY(TERM_KC_HOME);
-  else if (_MATCH("[F") || _MATCH("OF") || _MATCH("[4~") || _MATCH("[[8~")) _SET_KEY(TERM_KC_END);
+void term_viewer_goto_line(term_Viewer* viewer, uint64_t line) {
+  pthread_mutex_lock(&viewer->lock);
+  uint64_t mark = line / VIEWER_INDEX_STRIDE;
+  if (mark >= viewer->markc) mark = viewer->markc - 1;
+  uint64_t offset = viewer->marks[mark];
+  pthread_mutex_unlock(&viewer->lock);
 
-  else if (_MATCH("[2~")) _SET_KEY(TERM_KC_INSERT);
-  else if (_MATCH("[3~")) _SET_KEY(TERM_KC_DELETE);
+  uint64_t first = mark * VIEWER_INDEX_STRIDE;
+  _viewer_forward(viewer, offset, (int64_t) first, line - first);
+}
 
-  else if (_MATCH("OP") || _MATCH("[11~")) _SET_KEY(TERM_KC_F1);
-  else if (_MATCH("OQ") || _MATCH("[12~")) _SET_KEY(TERM_KC_F2);
-  else if (_MATCH("OR") || _MATCH("[13~")) _SET_KEY(TERM_KC_F3);
-  else if (_MATCH("OS") || _MATCH("[14~")) _SET_KEY(TERM_KC_F4);
 
-  else if (_MATCH("[15~")) _SET_KEY(TERM_KC_F5);
-  else if (_MATCH("[17~")) _SET_KEY(TERM_KC_F6);
-  else if (_MATCH("[18~")) _SET_KEY(TERM_KC_F7);
-  else if (_MATCH("[19~")) _SET_KEY(TERM_KC_F8);
-  else if (_MATCH("[20~")) _SET_KEY(TERM_KC_F9);
-  else if (_MATCH("[21~")) _SET_KEY(TERM_KC_F10);
-  else if (_MATCH("[23~")) _SET_KEY(TERM_KC_F11);
-  else if (_MATCH("[24~")) _SET_KEY(TERM_KC_F12);
+void term_viewer_goto_percent(term_Viewer* viewer, double percent) {
+  if (percent <= 0 || viewer->size == 0) {
+    viewer->top = 0;
+    viewer->top_line = 0;
+    return;
+  }
 
-  #undef _MATCH
-  #undef _SET_KEY
+  uint64_t offset = (percent >= 100) ? viewer->size : (uint64_t) (viewer->size * (percent / 100));
+  if (offset >= viewer->size) offset = viewer->size - 1;
+  viewer->top = _line_start(viewer, offset);
+  viewer->top_line = (viewer->top == 0) ? 0 : -1;
 }
 
 
-static void _buff_shift(uint32_t length) {
-  assert(_ctx.buff != NULL);
-  if (length < _ctx.buffc) {
-    memmove(_ctx.buff, _ctx.buff + length, _ctx.buffc - length);
-    _ctx.buffc -= length;
-  } else {
-    _ctx.buffc = 0;
+void term_viewer_info(term_Viewer* viewer, term_ViewerInfo* info) {
+  pthread_mutex_lock(&viewer->lock);
+  uint64_t indexed = viewer->indexed, newlines = viewer->newlines;
+
+  /* Count the top line from the mark before it once it's indexed. */
+  uint64_t mark = 0, offset = 0;
+  if (viewer->top_line < 0 && viewer->top < indexed) {
+    uint64_t low = 0, high = viewer->markc - 1;
+    while (low < high) {
+      uint64_t mid = (low + high + 1) / 2;
+      if (viewer->marks[mid] <= viewer->top) low = mid;
+      else high = mid - 1;
+    }
+    mark = low;
+    offset = viewer->marks[low];
+  }
+  pthread_mutex_unlock(&viewer->lock);
+
+  if (viewer->top_line < 0 && viewer->top < indexed) {
+    uint64_t found = 0;
+    _find_newlines(viewer->data, offset, viewer->top, UINT64_MAX, &found);
+    viewer->top_line = (int64_t) (mark * VIEWER_INDEX_STRIDE + found);
   }
+
+  info->size = viewer->size;
+  info->offset = viewer->top;
+  info->line = viewer->top_line;
+  info->indexed = (indexed == viewer->size);
+  info->lines = newlines;
+  if (info->indexed && viewer->size > 0 && viewer->data[viewer->size - 1] != '\n') info->lines++;
 }
 
+#endif /* TERM_SYS_NIX */
 
-static bool _read_event(term_Event* event) {
+#endif /* TERM_VIEWER */
 
-  memset(event, 0, sizeof(term_Event));
-  event->type = TERM_ET_UNKNOWN;
 
-  int count = read(fileno(stdin), _ctx.buff + _ctx.buffc, INPUT_BUFF_SZ - _ctx.buffc);
-  if (count == 0) return false;
+#ifdef TERM_DRAW_QUEUE
 
-  _ctx.buffc += count;
+/*****************************************************************************/
+/* DRAW QUEUE                                                                */
+/*****************************************************************************/
 
-  int event_length = 1; /* Num of character for the event in the buffer. */
+struct term_Producer {
+  term_Ctx* ctx;
+  uint8_t* arena; /* Ring buffer of the batches. */
+  uint64_t capacity; /* Arena size, a multiple of 16. */
+  uint64_t allocated; /* Bytes allocated, updated by the producer. */
+  _Atomic uint64_t released; /* Bytes applied, updated by the render thread. */
+  _Atomic int refs; /* The producer and its batches in the queue. */
+  term_Batch* open; /* Begun batch which isn't submitted yet. */
+};
 
-  if (*_ctx.buff == '\x1b') {
-    event_length = _escape_length(_ctx.buff + 1, _ctx.buffc - 1) + 1;
-    _parse_escape_sequence(_ctx.buff, event_length, event);
-    if (event->type == TERM_ET_MOUSE_MOVE) {
-      if (_veceq(_ctx.mousepos, event->mouse.pos)) {
-        _buff_shift(event_length);
-        return false;
+
+struct term_Batch {
+  _DrawNode node; /* Must be the first. */
+  term_Producer* producer;
+  uint64_t end; /* Allocated bytes of the producer after the batch. */
+  term_Vec pos, size;
+  term_Cell cells[];
+};
+
+
+/*
+ * The queue is an intrusive multi producer single consumer queue (Dmitry
+ * Vyukov's), a producer pushes with a single atomic exchange and it's never
+ * blocked by the others or the consumer.
+ */
+static void _draw_push(term_Ctx* ctx, _DrawNode* node) {
+  atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+  _DrawNode* prev = atomic_exchange_explicit(&ctx->draw_tail, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+
+/*
+ * Returns the oldest batch or NULL if the queue is empty, or the next batch
+ * is still being pushed (it'll be returned by the next call).
+ */
+static term_Batch* _draw_pop(term_Ctx* ctx) {
+  _DrawNode* head = ctx->draw_head;
+  _DrawNode* next = atomic_load_explicit(&head->next, memory_order_acquire);
+
+  if (head == &ctx->draw_stub) {
+    if (next == NULL) return NULL;
+    ctx->draw_head = head = next;
+    next = atomic_load_explicit(&head->next, memory_order_acquire);
+  }
+
+  if (next != NULL) {
+    ctx->draw_head = next;
+    return (term_Batch*) head;
+  }
+
+  /* The head is the last node, push the stub to pop it. */
+  if (head != atomic_load_explicit(&ctx->draw_tail, memory_order_acquire)) return NULL;
+  _draw_push(ctx, &ctx->draw_stub);
+
+  next = atomic_load_explicit(&head->next, memory_order_acquire);
+  if (next == NULL) return NULL;
+  ctx->draw_head = next;
+  return (term_Batch*) head;
+}
+
+
+static void _producer_unref(term_Producer* producer) {
+  if (atomic_fetch_sub_explicit(&producer->refs, 1, memory_order_acq_rel) == 1) {
+    free(producer->arena);
+    free(producer);
+  }
+}
+
+
+/* Pop the submitted batches and apply them to the grid if apply is true. */
+static void _draw_drain(term_Ctx* ctx, bool apply) {
+  term_Batch* batch;
+  while ((batch = _draw_pop(ctx)) != NULL) {
+    if (apply) {
+      for (int y = 0; y < batch->size.y; y++) {
+        for (int x = 0; x < batch->size.x; x++) {
+          term_Vec pos = term_vec(batch->pos.x + x, batch->pos.y + y);
+          term_setcell(ctx, pos, batch->cells[y * batch->size.x + x]);
+        }
       }
-      _ctx.mousepos = event->mouse.pos;
     }
 
-  } else {
-    _key_event(_ctx.buff[0], event);
+    /* The batch memory can be reused by the producer after the release. */
+    term_Producer* producer = batch->producer;
+    atomic_store_explicit(&producer->released, batch->end, memory_order_release);
+    _producer_unref(producer);
   }
+}
 
-  _buff_shift(event_length);
 
-  return event->type != TERM_ET_UNKNOWN;
+term_Producer* term_producer_new(term_Ctx* ctx, uint32_t arena_size) {
+  term_Producer* producer = (term_Producer*) calloc(1, sizeof(term_Producer));
+  if (producer == NULL) return NULL;
+
+  if (arena_size == 0) arena_size = DRAW_ARENA_SZ;
+  producer->ctx = ctx;
+  producer->capacity = ((uint64_t) arena_size + 15) & ~(uint64_t) 15;
+  producer->arena = (uint8_t*) malloc(producer->capacity);
+  if (producer->arena == NULL) {
+    free(producer);
+    return NULL;
+  }
+
+  atomic_init(&producer->released, 0);
+  atomic_init(&producer->refs, 1);
+  return producer;
 }
 
-#endif /* TERM_SYS_NIX */
+
+void term_producer_free(term_Producer* producer) {
+  if (producer == NULL) return;
+  assert(producer->open == NULL && "The last batch isn't submitted.");
+  _producer_unref(producer);
+}
+
+
+term_Batch* term_batch_begin(term_Producer* producer, term_Vec pos, term_Vec size) {
+  assert(producer->open == NULL && "The last batch isn't submitted.");
+  if (size.x <= 0 || size.y <= 0) return NULL;
+
+  uint64_t bytes = sizeof(term_Batch) + sizeof(term_Cell) * (uint64_t) size.x * size.y;
+  bytes = (bytes + 15) & ~(uint64_t) 15;
+  if (bytes > producer->capacity) return NULL;
+
+  /* A batch doesn't wrap around, the rest of the arena is skipped. */
+  uint64_t offset = producer->allocated % producer->capacity;
+  uint64_t skip = (offset + bytes > producer->capacity) ? producer->capacity - offset : 0;
+
+  uint64_t released = atomic_load_explicit(&producer->released, memory_order_acquire);
+  if (producer->allocated + skip + bytes - released > producer->capacity) return NULL;
+
+  term_Batch* batch = (term_Batch*) (producer->arena + ((skip > 0) ? 0 : offset));
+  producer->allocated += skip + bytes;
+
+  batch->producer = producer;
+  batch->end = producer->allocated;
+  batch->pos = pos;
+  batch->size = size;
+  for (int i = 0; i < size.x * size.y; i++) batch->cells[i] = term_cell(' ');
+
+  producer->open = batch;
+  return batch;
+}
+
+
+void term_batch_setcell(term_Batch* batch, term_Vec pos, term_Cell cell) {
+  if (!BETWEEN(0, pos.x, batch->size.x - 1)) return;
+  if (!BETWEEN(0, pos.y, batch->size.y - 1)) return;
+  batch->cells[pos.y * batch->size.x + pos.x] = cell;
+}
+
+
+void term_batch_submit(term_Batch* batch) {
+  term_Producer* producer = batch->producer;
+  assert(producer->open == batch && "The batch is already submitted.");
+  producer->open = NULL;
+
+  atomic_fetch_add_explicit(&producer->refs, 1, memory_order_relaxed);
+  _draw_push(producer->ctx, &batch->node);
+}
+
+
+void term_apply_batches(term_Ctx* ctx) {
+  _draw_drain(ctx, true);
+}
+
+#endif /* TERM_DRAW_QUEUE */
 
 #endif /* TERM_IMPLEMENT */
@@ -86,6 +86,13 @@ int utf8_encodeValue(int value, uint8_t* bytes);
  * value */
 int utf8_decodeBytes(uint8_t* bytes, int* value);
 
+/** Returns the number of terminal columns the character [value] takes, 2 for
+ * the east asian wide, fullwidth and emoji characters, 0 for the combining
+ * marks and the zero width characters, -1 for the control characters and 1
+ * for the rest. It's an approximation of wcwidth() which doesn't depend on
+ * the locale. */
+int utf8_charWidth(int value);
+
 
 #endif // UTF8_H
 
@@ -200,6 +207,87 @@ int utf8_decodeBytes(uint8_t* bytes, int* value) {
 	return byte_count;
 }
 
+// Sorted, inclusive ranges of the zero width characters (the common
+// combining marks, format characters and variation selectors).
+static const int _utf8_zero_width[][2] = {
+	{ 0x0300, 0x036f }, { 0x0483, 0x0489 }, { 0x0591, 0x05bd }, { 0x05bf, 0x05bf },
+	{ 0x05c1, 0x05c2 }, { 0x05c4, 0x05c5 }, { 0x05c7, 0x05c7 }, { 0x0610, 0x061a },
+	{ 0x064b, 0x065f }, { 0x0670, 0x0670 }, { 0x06d6, 0x06dc }, { 0x06df, 0x06e4 },
+	{ 0x06e7, 0x06e8 }, { 0x06ea, 0x06ed }, { 0x0711, 0x0711 }, { 0x0730, 0x074a },
+	{ 0x07a6, 0x07b0 }, { 0x07eb, 0x07f3 }, { 0x0816, 0x082d }, { 0x0859, 0x085b },
+	{ 0x08d3, 0x08e1 }, { 0x08e3, 0x0902 }, { 0x093a, 0x093a }, { 0x093c, 0x093c },
+	{ 0x0941, 0x0948 }, { 0x094d, 0x094d }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 },
+	{ 0x0981, 0x0981 }, { 0x09bc, 0x09bc }, { 0x09c1, 0x09c4 }, { 0x09cd, 0x09cd },
+	{ 0x09e2, 0x09e3 }, { 0x0a01, 0x0a02 }, { 0x0a3c, 0x0a3c }, { 0x0a41, 0x0a51 },
+	{ 0x0a70, 0x0a71 }, { 0x0a75, 0x0a75 }, { 0x0a81, 0x0a82 }, { 0x0abc, 0x0abc },
+	{ 0x0ac1, 0x0ac8 }, { 0x0acd, 0x0acd }, { 0x0ae2, 0x0ae3 }, { 0x0b01, 0x0b01 },
+	{ 0x0b3c, 0x0b3c }, { 0x0b3f, 0x0b3f }, { 0x0b41, 0x0b44 }, { 0x0b4d, 0x0b4d },
+	{ 0x0b82, 0x0b82 }, { 0x0bc0, 0x0bc0 }, { 0x0bcd, 0x0bcd }, { 0x0c3e, 0x0c40 },
+	{ 0x0c46, 0x0c56 }, { 0x0cbc, 0x0cbc }, { 0x0ccc, 0x0ccd }, { 0x0d41, 0x0d44 },
+	{ 0x0d4d, 0x0d4d }, { 0x0dca, 0x0dca }, { 0x0dd2, 0x0dd6 }, { 0x0e31, 0x0e31 },
+	{ 0x0e34, 0x0e3a }, { 0x0e47, 0x0e4e }, { 0x0eb1, 0x0eb1 }, { 0x0eb4, 0x0ebc },
+	{ 0x0ec8, 0x0ecd }, { 0x0f18, 0x0f19 }, { 0x0f35, 0x0f39 }, { 0x0f71, 0x0f84 },
+	{ 0x0f86, 0x0f87 }, { 0x0f8d, 0x0fbc }, { 0x102d, 0x1030 }, { 0x1032, 0x1039 },
+	{ 0x1160, 0x11ff }, { 0x135d, 0x135f }, { 0x1712, 0x1714 }, { 0x17b4, 0x17b5 },
+	{ 0x17b7, 0x17bd }, { 0x17c6, 0x17c6 }, { 0x17c9, 0x17d3 }, { 0x180b, 0x180f },
+	{ 0x1ab0, 0x1aff }, { 0x1dc0, 0x1dff }, { 0x200b, 0x200f }, { 0x202a, 0x202e },
+	{ 0x2060, 0x2064 }, { 0x20d0, 0x20f0 }, { 0x302a, 0x302d }, { 0x3099, 0x309a },
+	{ 0xfe00, 0xfe0f }, { 0xfe20, 0xfe2f }, { 0xfeff, 0xfeff }, { 0x1f3fb, 0x1f3ff },
+	{ 0xe0001, 0xe007f }, { 0xe0100, 0xe01ef },
+};
+
+// Sorted, inclusive ranges of the east asian wide, fullwidth and the emoji
+// presentation characters.
+static const int _utf8_wide[][2] = {
+	{ 0x1100, 0x115f }, { 0x231a, 0x231b }, { 0x2329, 0x232a }, { 0x23e9, 0x23ec },
+	{ 0x23f0, 0x23f0 }, { 0x23f3, 0x23f3 }, { 0x25fd, 0x25fe }, { 0x2614, 0x2615 },
+	{ 0x2648, 0x2653 }, { 0x267f, 0x267f }, { 0x2693, 0x2693 }, { 0x26a1, 0x26a1 },
+	{ 0x26aa, 0x26ab }, { 0x26bd, 0x26be }, { 0x26c4, 0x26c5 }, { 0x26ce, 0x26ce },
+	{ 0x26d4, 0x26d4 }, { 0x26ea, 0x26ea }, { 0x26f2, 0x26f3 }, { 0x26f5, 0x26f5 },
+	{ 0x26fa, 0x26fa }, { 0x26fd, 0x26fd }, { 0x2705, 0x2705 }, { 0x270a, 0x270b },
+	{ 0x2728, 0x2728 }, { 0x274c, 0x274c }, { 0x274e, 0x274e }, { 0x2753, 0x2755 },
+	{ 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27b0, 0x27b0 }, { 0x27bf, 0x27bf },
+	{ 0x2b1b, 0x2b1c }, { 0x2b50, 0x2b50 }, { 0x2b55, 0x2b55 }, { 0x2e80, 0x303e },
+	{ 0x3041, 0x33ff }, { 0x3400, 0x4dbf }, { 0x4e00, 0x9fff }, { 0xa000, 0xa4cf },
+	{ 0xa960, 0xa97f }, { 0xac00, 0xd7a3 }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 },
+	{ 0xfe30, 0xfe6f }, { 0xff00, 0xff60 }, { 0xffe0, 0xffe6 }, { 0x16fe0, 0x16fe4 },
+	{ 0x17000, 0x18cff }, { 0x1b000, 0x1b2ff }, { 0x1f004, 0x1f004 }, { 0x1f0cf, 0x1f0cf },
+	{ 0x1f18e, 0x1f18e }, { 0x1f191, 0x1f19a }, { 0x1f200, 0x1f251 }, { 0x1f300, 0x1f3fa },
+	{ 0x1f400, 0x1f64f }, { 0x1f680, 0x1f6ff }, { 0x1f7e0, 0x1f7eb }, { 0x1f90c, 0x1f9ff },
+	{ 0x1fa70, 0x1faff }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd },
+};
+
+// Binary search the [value] in the sorted ranges.
+static int _utf8_inRanges(const int ranges[][2], int count, int value) {
+	int low = 0, high = count - 1;
+	if (value < ranges[0][0] || value > ranges[high][1]) return 0;
+
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (value < ranges[mid][0]) high = mid - 1;
+		else if (value > ranges[mid][1]) low = mid + 1;
+		else return 1;
+	}
+	return 0;
+}
+
+int utf8_charWidth(int value) {
+
+	if (value == 0) return 0;
+	if (value < 0x20 || (0x7f <= value && value < 0xa0)) return -1;
+
+	// Everything below the first combining mark is a single column.
+	if (value < 0x0300) return 1;
+
+	int count = sizeof(_utf8_zero_width) / sizeof(*_utf8_zero_width);
+	if (_utf8_inRanges(_utf8_zero_width, count, value)) return 0;
+
+	count = sizeof(_utf8_wide) / sizeof(*_utf8_wide);
+	if (_utf8_inRanges(_utf8_wide, count, value)) return 2;
+
+	return 1;
+}
+
 #undef B1
 #undef B2
 #undef B3
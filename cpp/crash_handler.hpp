@@ -31,6 +31,28 @@
 //   #define INCLUDE_CRASH_HANDLER_MAIN
 //   #define CRASH_HANDLER_IMPLEMENTATION
 //   #include "crash_handler.h"
+//
+// The crash handler is enabled in the debug builds (DEBUG_BUILD), define
+// CRASH_HANDLER_ENABLED to enable it in the release builds too.
+//
+// Crash records (linux): CrashHandler::set_record_fd() makes the handler write
+// a compact binary record to the fd (the pcs, the registers, the loaded
+// objects with their build-ids and /proc/self/maps) instead of symbolizing,
+// the record is symbolized later by the offline tool built from this file:
+//   g++ -DCRASH_SYMBOLIZER_MAIN -x c++ crash_handler.hpp -o crash_symbolize
+//   crash_symbolize <record> [directories of the binaries...]
+//
+// Trace events (linux): CH_TRACE("id", a, b) records an event to a ring buffer
+// of the thread, the last events of every thread are dumped with the backtrace.
+
+#ifdef CRASH_SYMBOLIZER_MAIN
+#define CRASH_HANDLER_ENABLED
+#define CRASH_HANDLER_IMPLEMENTATION
+#endif
+
+#if defined(DEBUG_BUILD) && !defined(CRASH_HANDLER_ENABLED)
+#define CRASH_HANDLER_ENABLED
+#endif
 
 #if defined(_WIN32)
 
@@ -49,7 +71,7 @@ extern DWORD CrashHandlerException(EXCEPTION_POINTERS* ep);
 #ifndef CRASH_HANDLER_X11_H
 #define CRASH_HANDLER_X11_H
 
-// LINK: 'dl'
+// LINK: 'dl', 'rt' (timer_create with glibc older than 2.34), 'pthread'
 
 class CrashHandler {
 
@@ -58,18 +80,149 @@ class CrashHandler {
 public:
 	void initialize();
 
+	// Write a binary crash record to the fd (opened in advance) instead of the
+	// symbolized backtrace, -1 to disable it. If it's set before initialize()
+	// the symbol tables aren't loaded at all.
+	void set_record_fd(int p_fd);
+
 	void disable();
 	bool is_disabled() const { return disabled; };
 
+	// The signal handler runs on an alternate stack so a stack overflow can be
+	// reported, but it's per thread and initialize() installs it for the calling
+	// thread only. Every other thread calls this once to have its own (freed
+	// when the thread exits), the register_thread() of the SamplingProfiler and
+	// the Watchdog call it too. A thread without it dies silently on a stack
+	// overflow.
+	static void register_thread();
+
 	CrashHandler();
 	~CrashHandler();
 };
 
+// Sampling cpu profiler, the registered threads are sampled every interval of
+// their own cpu time and the samples are written as folded stacks for the
+// flamegraph (flamegraph.pl out.folded > out.svg). The sampling doesn't
+// allocate or lock, the stacks are symbolized only when they're written.
+// CrashHandler::initialize() starts it for the main thread if the
+// CRASH_HANDLER_PROFILE environment variable is set to the output path, it's
+// written when the handler is disabled.
+class SamplingProfiler {
+public:
+	// Starts sampling the registered threads, returns false if failed.
+	static bool start(int p_interval_us = 1000);
+	static void stop();
+
+	// Every thread to be profiled registers itself and unregisters before it exits.
+	static bool register_thread();
+	static void unregister_thread();
+
+	// Writes the samples so far as "frame;frame;frame count" lines.
+	static bool write_folded(const char* p_path);
+	static void reset();
+};
+
+// Watchdog of the stalled threads, a watched thread posts a heartbeat (a
+// relaxed store to its own counter) at least every deadline while it's busy.
+// When it misses its deadline the monitor thread captures its stack with a
+// signal and logs it with the duration of the stall once it resumes. The
+// signal is sent once per stall, with SA_RESTART, but the sleeps (and a few
+// other syscalls) still return early with EINTR.
+class Watchdog {
+public:
+	// Starts the monitor thread checking the threads every p_check_ms, the
+	// stalls are logged to the fd.
+	static bool start(int p_fd = 2, int p_check_ms = 10);
+	static void stop();
+
+	// Every thread to be watched registers itself and unregisters before it exits.
+	static bool register_thread(const char* p_name, int p_deadline_ms);
+	static void unregister_thread();
+
+	static void heartbeat();
+
+	// The thread isn't watched till its next heartbeat (ex: waiting for work).
+	static void idle();
+};
+
+#ifdef CRASH_HANDLER_ENABLED
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+// Flight recorder: CH_TRACE("id", a, b) appends a fixed-size event (the time,
+// the id and up to 2 integer arguments) to the ring buffer of the calling
+// thread, and the crash handler dumps the last TRACE_DUMP_COUNT events of every
+// thread with the backtrace. The id must be a string literal (only its pointer
+// is stored). An event is a few plain stores and a release store of the ring's
+// head, the first event of a thread allocates its ring (so not in a signal
+// handler), the ring is reused by an other thread after it exits.
+#define CH_TRACE(...) _trace(__VA_ARGS__)
+
+// Number of events in the ring buffer of each thread (a power of two).
+#define TRACE_RING_SIZE 1024
+
+// Number of the last events of each thread in the crash report.
+#define TRACE_DUMP_COUNT 32
+
+struct _trace_record {
+	uint64_t time; // See _trace_time().
+	const char* id;
+	uint64_t args[2];
+};
+
+struct _trace_ring {
+	std::atomic<uint64_t> head{ 0 }; // Count of the events, written by the thread only.
+	std::atomic<int> tid{ 0 };       // 0 if the ring is free.
+	_trace_ring* next = nullptr;
+	_trace_record records[TRACE_RING_SIZE];
+};
+
+extern __thread _trace_ring* _trace_self;
+_trace_ring* _trace_register();
+
+// The cpu's timestamp counter where it's readable in the user space, the
+// CLOCK_MONOTONIC nanoseconds otherwise.
+static inline uint64_t _trace_time() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+static inline void _trace(const char* p_id, uint64_t p_a = 0, uint64_t p_b = 0) {
+	_trace_ring* ring = _trace_self;
+	if (__builtin_expect(ring == nullptr, 0)) {
+		ring = _trace_register();
+		if (ring == nullptr) return;
+	}
+	uint64_t head = ring->head.load(std::memory_order_relaxed);
+	_trace_record& record = ring->records[head & (TRACE_RING_SIZE - 1)];
+	record.time = _trace_time();
+	record.id = p_id;
+	record.args[0] = p_a;
+	record.args[1] = p_b;
+	ring->head.store(head + 1, std::memory_order_release);
+}
+#endif // CRASH_HANDLER_ENABLED
+
 #endif // CRASH_HANDLER_X11_H
 
 
 #endif
 
+// The events aren't recorded without the crash handler.
+#ifndef CH_TRACE
+#define CH_TRACE(...) ((void)0)
+#endif
+
 #ifdef INCLUDE_CRASH_HANDLER_MAIN
 
 /***************************************************************************************************************************/
@@ -286,222 +439,2042 @@ DWORD CrashHandlerException(EXCEPTION_POINTERS* ep) {
 #elif defined(__linux__)
 
 
-#ifdef DEBUG_BUILD
 #include <cxxabi.h>
 #include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
 #include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
-#include <unistd.h>
-#include <sys/wait.h>
-
-// TODO: move this to os related place
-std::string _get_exec_path() {
-	int len = 1024;
-	char pBuf[len];
-#ifdef _WIN32
-	int bytes = GetModuleFileName(NULL, pBuf, sizeof pBuf);
-	// TODO:  assert bytes > 0
-#elif __linux__
-	char szTmp[32];
-	sprintf(szTmp, "/proc/%d/exe", getpid());
-
-	// int bytes = min(readlink(szTmp, pBuf, len), len - 1);
-	int bytes = readlink(szTmp, pBuf, len);
-	if (bytes > len - 1) bytes = len - 1;
-
-	if (bytes >= 0)
-		pBuf[bytes] = '\0';
-#endif
-	return pBuf;
+
+// The crash handler is running in a signal handler of a process which could be
+// in any state (ex: crashed inside malloc with the heap lock held), so the
+// symbols and line tables are loaded when the handler is initialized and the
+// handler itself only uses async-signal-safe calls: no allocation, no stdio,
+// no locks, only reads of the preloaded tables and write().
+
+/***************************************************************************************************************************/
+/*                                                SIGNAL SAFE WRITER                                                       */
+/***************************************************************************************************************************/
+
+// Formats to a stack buffer and writes it to the fd with write() when it's full
+// or flushed, snprintf isn't async-signal-safe.
+class _SignalWriter {
+
+	int fd;
+	int length = 0;
+	char buffer[1024];
+
+public:
+	_SignalWriter(int p_fd) : fd(p_fd) {}
+	~_SignalWriter() { flush(); }
+
+	void flush() {
+		const char* data = buffer;
+		while (length > 0) {
+			ssize_t written = write(fd, data, length);
+			if (written <= 0) break; // Nothing else could be done in a crash.
+			data += written;
+			length -= (int)written;
+		}
+		length = 0;
+	}
+
+	_SignalWriter& chr(char c) {
+		if (length == sizeof(buffer)) flush();
+		buffer[length++] = c;
+		return *this;
+	}
+
+	_SignalWriter& str(const char* s) {
+		if (s == nullptr) s = "(null)";
+		while (*s) chr(*s++);
+		return *this;
+	}
+
+	_SignalWriter& dec(int64_t value) {
+		char digits[24];
+		int count = 0;
+		uint64_t magnitude = (value < 0) ? 0 - (uint64_t)value : (uint64_t)value;
+		do {
+			digits[count++] = (char)('0' + magnitude % 10);
+			magnitude /= 10;
+		} while (magnitude != 0);
+		if (value < 0) chr('-');
+		while (count > 0) chr(digits[--count]);
+		return *this;
+	}
+
+	_SignalWriter& hex(uint64_t value) {
+		char digits[16];
+		int count = 0;
+		do {
+			digits[count++] = "0123456789abcdef"[value & 0xf];
+			value >>= 4;
+		} while (value != 0);
+		str("0x");
+		while (count > 0) chr(digits[--count]);
+		return *this;
+	}
+};
+
+/***************************************************************************************************************************/
+/*                                                SYMBOLIZER                                                               */
+/***************************************************************************************************************************/
+
+// A function symbol, the address is relative to the load bias of its module.
+struct _sym_function {
+	uintptr_t address;
+	uintptr_t size;
+	const char* name;
+};
+
+// A file of the line tables, the directory is null if it's not known.
+struct _sym_file {
+	const char* dir;
+	const char* name;
+};
+
+// A row of the line table, the address is relative to the load bias.
+struct _sym_line {
+	uintptr_t address;
+	uint32_t file; // _SYM_LINE_END for the end of a sequence.
+	uint32_t line;
+};
+
+#define _SYM_LINE_END 0xffffffffu
+
+// A loaded object (the executable or a shared library), the strings point to
+// its file mapped in memory which is never unmapped.
+struct _sym_module {
+	uintptr_t start = 0; // Address range of its loaded segments.
+	uintptr_t end = 0;
+	uintptr_t bias = 0;
+	char path[256] = {};
+	uint32_t build_id_size = 0;
+	uint8_t build_id[32] = {};
+	const uint8_t* eh_frame_hdr = nullptr; // In memory, null if not loaded.
+
+	const uint8_t* image = nullptr;
+	size_t image_size = 0;
+
+	std::vector<_sym_function> functions; // Sorted by address.
+	std::vector<_sym_file> files;
+	std::vector<_sym_line> lines; // Sorted by address.
+};
+
+// Result of symbolizing an address, the fields are null/0 if not known.
+struct _sym_info {
+	const _sym_module* module;
+	const char* function;
+	uintptr_t offset; // From the start of the function (or the module).
+	const _sym_file* file;
+	uint32_t line;
+};
+
+// Never freed, the handler could still be running while exiting.
+static std::vector<_sym_module*>* _sym_modules = nullptr;
+
+// Guards the loading of the modules and of their symbols, which can be done
+// by initialize(), the profiler and the watchdog. The readers other than the
+// signal handlers take it too, the symbols of a module loaded without them
+// (the crash record mode) can be added later.
+static std::mutex _sym_mutex;
+static bool _sym_symbols_loaded = false; // Guarded by the _sym_mutex.
+
+// A bounds checked reader of the DWARF sections (little endian only).
+struct _DwarfReader {
+	const uint8_t* p;
+	const uint8_t* end;
+	bool fail = false;
+
+	_DwarfReader(const uint8_t* p_begin, const uint8_t* p_end) : p(p_begin), end(p_end) {}
+
+	uint64_t u(int p_size) {
+		if (end - p < p_size) {
+			fail = true;
+			p = end;
+			return 0;
+		}
+		uint64_t value = 0;
+		for (int i = 0; i < p_size; i++) value |= (uint64_t)p[i] << (8 * i);
+		p += p_size;
+		return value;
+	}
+
+	uint64_t uleb() {
+		uint64_t value = 0;
+		int shift = 0;
+		while (p < end) {
+			uint8_t byte = *p++;
+			if (shift < 64) value |= (uint64_t)(byte & 0x7f) << shift;
+			shift += 7;
+			if ((byte & 0x80) == 0) return value;
+		}
+		fail = true;
+		return 0;
+	}
+
+	int64_t sleb() {
+		int64_t value = 0;
+		int shift = 0;
+		while (p < end) {
+			uint8_t byte = *p++;
+			if (shift < 64) value |= (int64_t)(byte & 0x7f) << shift;
+			shift += 7;
+			if ((byte & 0x80) == 0) {
+				if (shift < 64 && (byte & 0x40)) value |= -((int64_t)1 << shift);
+				return value;
+			}
+		}
+		fail = true;
+		return 0;
+	}
+
+	const char* str() {
+		const uint8_t* s = p;
+		while (p < end && *p) p++;
+		if (p == end) {
+			fail = true;
+			return nullptr;
+		}
+		p++;
+		return (const char*)s;
+	}
+
+	void skip(uint64_t p_size) {
+		if ((uint64_t)(end - p) < p_size) {
+			fail = true;
+			p = end;
+		} else {
+			p += p_size;
+		}
+	}
+};
+
+// A section of the mapped ELF file.
+struct _elf_section {
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+};
+
+// The DWARF sections the line tables are read from.
+struct _dwarf_sections {
+	_elf_section line;
+	_elf_section line_str;
+	_elf_section str;
+};
+
+// DWARF constants used by the line table reader.
+enum {
+	_DW_LNS_copy = 1,
+	_DW_LNS_advance_pc = 2,
+	_DW_LNS_advance_line = 3,
+	_DW_LNS_set_file = 4,
+	_DW_LNS_const_add_pc = 8,
+	_DW_LNS_fixed_advance_pc = 9,
+
+	_DW_LNE_end_sequence = 1,
+	_DW_LNE_set_address = 2,
+
+	_DW_LNCT_path = 1,
+	_DW_LNCT_directory_index = 2,
+
+	_DW_FORM_block = 0x09,
+	_DW_FORM_data1 = 0x0b,
+	_DW_FORM_data2 = 0x05,
+	_DW_FORM_data4 = 0x06,
+	_DW_FORM_data8 = 0x07,
+	_DW_FORM_data16 = 0x1e,
+	_DW_FORM_string = 0x08,
+	_DW_FORM_strp = 0x0e,
+	_DW_FORM_udata = 0x0f,
+	_DW_FORM_line_strp = 0x1f,
+};
+
+static const char* _dwarf_section_str(const _elf_section& p_section, uint64_t p_offset) {
+	if (p_section.data == nullptr || p_offset >= p_section.size) return nullptr;
+	if (memchr(p_section.data + p_offset, 0, p_section.size - p_offset) == nullptr) return nullptr;
+	return (const char*)p_section.data + p_offset;
 }
 
-int _execute(const std::string& p_path, const std::vector<std::string>& p_arguments, bool p_blocking,
-	int* r_child_id, std::string* r_pipe, int* r_exitcode, bool read_stderr = true/*,Mutex *p_pipe_mutex*/) {
+// Reads an attribute of a DWARF 5 directory/file entry, returns its value as a
+// string or a number (the other one is left unchanged).
+static bool _dwarf_read_form(_DwarfReader& r, const _dwarf_sections& p_dwarf, uint64_t p_form, int p_offset_size,
+	const char** r_str, uint64_t* r_value) {
+
+	switch (p_form) {
+		case _DW_FORM_string: *r_str = r.str(); break;
+		case _DW_FORM_line_strp: *r_str = _dwarf_section_str(p_dwarf.line_str, r.u(p_offset_size)); break;
+		case _DW_FORM_strp: *r_str = _dwarf_section_str(p_dwarf.str, r.u(p_offset_size)); break;
+		case _DW_FORM_udata: *r_value = r.uleb(); break;
+		case _DW_FORM_data1: *r_value = r.u(1); break;
+		case _DW_FORM_data2: *r_value = r.u(2); break;
+		case _DW_FORM_data4: *r_value = r.u(4); break;
+		case _DW_FORM_data8: *r_value = r.u(8); break;
+		case _DW_FORM_data16: r.skip(16); break;
+		case _DW_FORM_block: r.skip(r.uleb()); break;
+		default: return false; // Not used by the compilers for the line tables.
+	}
+	return !r.fail;
+}
 
-#ifdef __EMSCRIPTEN__
-	// Don't compile this code at all to avoid undefined references.
-	// Actual virtual call goes to OS_JavaScript.
-	ERR_FAIL_V(ERR_BUG);
-#else
-	if (p_blocking && r_pipe) {
+// Reads a DWARF 5 directory or file name table, appends the directory indexes
+// (or 0) to the r_dirs if it's not null.
+static bool _dwarf_read_entries(_DwarfReader& r, const _dwarf_sections& p_dwarf, int p_offset_size,
+	std::vector<const char*>& r_names, std::vector<uint64_t>* r_dirs) {
+
+	uint64_t formats[16][2];
+	int format_count = (int)r.u(1);
+	if (format_count > 16) return false;
+	for (int i = 0; i < format_count; i++) {
+		formats[i][0] = r.uleb();
+		formats[i][1] = r.uleb();
+	}
 
-		std::string argss;
-		argss = "\"" + p_path + "\"";
+	uint64_t count = r.uleb();
+	for (uint64_t i = 0; i < count && !r.fail; i++) {
+		const char* name = nullptr;
+		uint64_t dir = 0;
+		for (int j = 0; j < format_count; j++) {
+			const char* str = nullptr;
+			uint64_t value = 0;
+			if (!_dwarf_read_form(r, p_dwarf, formats[j][1], p_offset_size, &str, &value)) return false;
+			if (formats[j][0] == _DW_LNCT_path) name = str;
+			if (formats[j][0] == _DW_LNCT_directory_index) dir = value;
+		}
+		r_names.push_back(name);
+		if (r_dirs) r_dirs->push_back(dir);
+	}
+	return !r.fail;
+}
 
-		for (int i = 0; i < p_arguments.size(); i++) {
+// Runs the line number program of a unit and appends its rows to the module.
+static void _dwarf_run_program(_DwarfReader& r, _sym_module* p_module, uint32_t p_file_base, uint32_t p_file_count,
+	int p_version, int p_min_inst_length, int p_line_base, int p_line_range, int p_opcode_base,
+	const uint8_t* p_opcode_lengths) {
+
+	uint64_t address = 0;
+	int64_t file = 1;
+	int64_t line = 1;
+	bool discarded = false; // Sequences of the functions removed by the linker start at 0.
+
+	auto emit = [&](bool p_end) {
+		if (discarded) return;
+		// The v5 file indexes start from 0, the older ones from 1.
+		int64_t index = (p_version >= 5) ? file : file - 1;
+		_sym_line row = { (uintptr_t)address, _SYM_LINE_END, 0 };
+		if (!p_end) {
+			row.file = (index >= 0 && index < p_file_count) ? p_file_base + (uint32_t)index : _SYM_LINE_END - 1;
+			row.line = (line > 0) ? (uint32_t)line : 0;
+
+			// Only the changes of the file and the line are kept.
+			std::vector<_sym_line>& lines = p_module->lines;
+			if (!lines.empty() && lines.back().file == row.file && lines.back().line == row.line) return;
+		}
+		p_module->lines.push_back(row);
+	};
+
+	while (r.p < r.end && !r.fail) {
+		uint8_t opcode = (uint8_t)r.u(1);
+
+		if (opcode >= p_opcode_base) {
+			int adjusted = opcode - p_opcode_base;
+			address += (adjusted / p_line_range) * p_min_inst_length;
+			line += p_line_base + adjusted % p_line_range;
+			emit(false);
+
+		} else if (opcode == 0) {
+			uint64_t length = r.uleb();
+			const uint8_t* next = r.p + length;
+			if (length == 0 || length > (uint64_t)(r.end - r.p)) return;
+			uint8_t sub = (uint8_t)r.u(1);
+			if (sub == _DW_LNE_end_sequence) {
+				emit(true);
+				address = 0, file = 1, line = 1, discarded = false;
+			} else if (sub == _DW_LNE_set_address) {
+				address = r.u((int)std::min<uint64_t>(length - 1, 8));
+				discarded = (address == 0);
+			}
+			r.p = next;
 
-			argss += std::string(" \"") + p_arguments[i] + "\"";
+		} else {
+			switch (opcode) {
+				case _DW_LNS_copy: emit(false); break;
+				case _DW_LNS_advance_pc: address += r.uleb() * p_min_inst_length; break;
+				case _DW_LNS_advance_line: line += r.sleb(); break;
+				case _DW_LNS_set_file: file = (int64_t)r.uleb(); break;
+				case _DW_LNS_const_add_pc: address += ((255 - p_opcode_base) / p_line_range) * p_min_inst_length; break;
+				case _DW_LNS_fixed_advance_pc: address += r.u(2); break;
+				default:
+					for (int i = 0; i < p_opcode_lengths[opcode - 1]; i++) r.uleb();
+			}
 		}
+	}
+}
+
+// Loads the line tables of all the units of the .debug_line section.
+static void _dwarf_load_lines(_sym_module* p_module, const _dwarf_sections& p_dwarf) {
+	_DwarfReader section(p_dwarf.line.data, p_dwarf.line.data + p_dwarf.line.size);
 
-		if (read_stderr) {
-			argss += " 2>&1"; // Read stderr too
+	while (section.p < section.end && !section.fail) {
+		int offset_size = 4;
+		uint64_t unit_length = section.u(4);
+		if (unit_length == 0xffffffff) {
+			offset_size = 8;
+			unit_length = section.u(8);
+		}
+		if (section.fail || unit_length > (uint64_t)(section.end - section.p)) break;
+		const uint8_t* unit_end = section.p + unit_length;
+		_DwarfReader r(section.p, unit_end);
+		section.p = unit_end;
+
+		int version = (int)r.u(2);
+		if (version < 2 || version > 5) continue;
+		if (version >= 5) r.u(2); // Address and segment selector sizes.
+		uint64_t header_length = r.u(offset_size);
+		if (header_length > (uint64_t)(r.end - r.p)) continue;
+		const uint8_t* program = r.p + header_length;
+
+		int min_inst_length = (int)r.u(1);
+		if (version >= 4) r.u(1); // Maximum operations per instruction (VLIW only).
+		r.u(1); // Default is_stmt, every row is kept.
+		int line_base = (int8_t)r.u(1);
+		int line_range = (int)r.u(1);
+		int opcode_base = (int)r.u(1);
+		const uint8_t* opcode_lengths = r.p;
+		r.skip(opcode_base > 0 ? opcode_base - 1 : 0);
+		if (r.fail || line_range == 0 || opcode_base == 0) continue;
+
+		std::vector<const char*> dirs;
+		std::vector<const char*> names;
+		std::vector<uint64_t> name_dirs;
+
+		if (version >= 5) {
+			if (!_dwarf_read_entries(r, p_dwarf, offset_size, dirs, nullptr)) continue;
+			if (!_dwarf_read_entries(r, p_dwarf, offset_size, names, &name_dirs)) continue;
 		} else {
-			argss += " 2>/dev/null"; //silence stderr
+			dirs.push_back(nullptr); // The compilation directory isn't in the line table.
+			while (const char* dir = r.str()) {
+				if (*dir == '\0') break;
+				dirs.push_back(dir);
+			}
+			while (const char* name = r.str()) {
+				if (*name == '\0') break;
+				name_dirs.push_back(r.uleb());
+				r.uleb(); // Modification time and the file size.
+				r.uleb();
+				names.push_back(name);
+			}
+			if (r.fail) continue;
 		}
-		FILE* f = popen(argss.c_str(), "r");
 
-		if (!f) {
-			printf("ERR_CANT_OPEN, Cannot pipe stream from process running with following arguments\n\t%s.\n", argss.c_str());
-			return -1;
+		uint32_t file_base = (uint32_t)p_module->files.size();
+		for (size_t i = 0; i < names.size(); i++) {
+			const char* dir = (name_dirs[i] < dirs.size()) ? dirs[name_dirs[i]] : nullptr;
+			p_module->files.push_back({ dir, names[i] ? names[i] : "??" });
 		}
 
-		char buf[65535];
+		r.p = program;
+		_dwarf_run_program(r, p_module, file_base, (uint32_t)names.size(), version, min_inst_length,
+			line_base, line_range, opcode_base, opcode_lengths);
+	}
+}
 
-		while (fgets(buf, 65535, f)) {
-			(*r_pipe) += std::string(buf);
+// Finds the GNU build-id in the ELF notes, returns its size (0 if not found).
+static uint32_t _elf_build_id(const uint8_t* p_notes, size_t p_size, uint8_t* r_id) {
+	size_t offset = 0;
+	while (offset + sizeof(ElfW(Nhdr)) <= p_size) {
+		const ElfW(Nhdr)* note = (const ElfW(Nhdr)*)(p_notes + offset);
+		size_t name = offset + sizeof(ElfW(Nhdr));
+		size_t desc = name + ((note->n_namesz + 3) & ~3u);
+		offset = desc + ((note->n_descsz + 3) & ~3u);
+		if (offset > p_size) break;
+		if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 && memcmp(p_notes + name, "GNU", 4) == 0 &&
+			note->n_descsz <= 32) {
+			memcpy(r_id, p_notes + desc, note->n_descsz);
+			return note->n_descsz;
 		}
-		int rv = pclose(f);
-		if (r_exitcode)
-			*r_exitcode = rv;
+	}
+	return 0;
+}
+
+// Maps the ELF file of the module and loads its function symbols and its line
+// tables. If the module's build-id is known the file must have the same one.
+static bool _sym_load_file(_sym_module* p_module, const char* p_path) {
+	int fd = open(p_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	struct stat st;
+	void* image = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(ElfW(Ehdr))) {
+		image = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (image == MAP_FAILED) return false;
+
+	const uint8_t* data = (const uint8_t*)image;
+	size_t size = (size_t)st.st_size;
+	const ElfW(Ehdr)* header = (const ElfW(Ehdr)*)data;
+	bool valid = memcmp(header->e_ident, ELFMAG, SELFMAG) == 0 &&
+		header->e_ident[EI_CLASS] == (sizeof(void*) == 8 ? ELFCLASS64 : ELFCLASS32) &&
+		header->e_shentsize == sizeof(ElfW(Shdr)) && header->e_shstrndx < header->e_shnum &&
+		header->e_shoff + (uint64_t)header->e_shnum * sizeof(ElfW(Shdr)) <= size;
+
+	const ElfW(Shdr)* sections = (const ElfW(Shdr)*)(data + header->e_shoff);
+	if (valid && p_module->build_id_size != 0) {
+		uint8_t build_id[32];
+		uint32_t build_id_size = 0;
+		for (int i = 0; i < header->e_shnum && build_id_size == 0; i++) {
+			if (sections[i].sh_type != SHT_NOTE || sections[i].sh_offset + sections[i].sh_size > size) continue;
+			build_id_size = _elf_build_id(data + sections[i].sh_offset, sections[i].sh_size, build_id);
+		}
+		valid = build_id_size == p_module->build_id_size && memcmp(build_id, p_module->build_id, build_id_size) == 0;
+	}
+	if (!valid) {
+		munmap(image, size);
+		return false;
+	}
+
+	p_module->image = data;
+	p_module->image_size = size;
+
+	const ElfW(Shdr)& names = sections[header->e_shstrndx];
+	auto section_data = [&](const ElfW(Shdr)& p_section) {
+		_elf_section section;
+		if (p_section.sh_type != SHT_NOBITS && (p_section.sh_flags & SHF_COMPRESSED) == 0 &&
+			p_section.sh_offset + p_section.sh_size <= size) {
+			section.data = data + p_section.sh_offset;
+			section.size = p_section.sh_size;
+		}
+		return section;
+	};
+
+	const ElfW(Shdr)* symtab = nullptr;
+	const ElfW(Shdr)* dynsym = nullptr;
+	_dwarf_sections dwarf;
+
+	for (int i = 0; i < header->e_shnum; i++) {
+		if (sections[i].sh_name >= names.sh_size || names.sh_offset + names.sh_size > size) continue;
+		const char* name = (const char*)data + names.sh_offset + sections[i].sh_name;
+		if (sections[i].sh_type == SHT_SYMTAB) symtab = &sections[i];
+		else if (sections[i].sh_type == SHT_DYNSYM) dynsym = &sections[i];
+		else if (strcmp(name, ".debug_line") == 0) dwarf.line = section_data(sections[i]);
+		else if (strcmp(name, ".debug_line_str") == 0) dwarf.line_str = section_data(sections[i]);
+		else if (strcmp(name, ".debug_str") == 0) dwarf.str = section_data(sections[i]);
+	}
+
+	// The .symtab has the local functions too, stripped objects only have .dynsym.
+	if (symtab == nullptr) symtab = dynsym;
+	if (symtab != nullptr && symtab->sh_link < header->e_shnum) {
+		_elf_section symbols = section_data(*symtab);
+		_elf_section strings = section_data(sections[symtab->sh_link]);
+		size_t count = symbols.size / sizeof(ElfW(Sym));
+		for (size_t i = 0; i < count && strings.data; i++) {
+			const ElfW(Sym)* sym = (const ElfW(Sym)*)symbols.data + i;
+			int type = ELF64_ST_TYPE(sym->st_info);
+			if (type != STT_FUNC && type != STT_GNU_IFUNC) continue;
+			if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0 || sym->st_name >= strings.size) continue;
+			p_module->functions.push_back({ (uintptr_t)sym->st_value, (uintptr_t)sym->st_size,
+				(const char*)strings.data + sym->st_name });
+		}
+		std::sort(p_module->functions.begin(), p_module->functions.end(),
+			[](const _sym_function& a, const _sym_function& b) { return a.address < b.address; });
+	}
 
+	if (dwarf.line.data != nullptr) {
+		_dwarf_load_lines(p_module, dwarf);
+		// The end of a sequence goes before a row at the same address.
+		std::stable_sort(p_module->lines.begin(), p_module->lines.end(), [](const _sym_line& a, const _sym_line& b) {
+			if (a.address != b.address) return a.address < b.address;
+			return a.file == _SYM_LINE_END && b.file != _SYM_LINE_END;
+		});
+	}
+
+	return true;
+}
+
+static int _sym_load_object(struct dl_phdr_info* p_info, size_t, void* p_symbols) {
+	_sym_module* module = new _sym_module();
+	module->bias = p_info->dlpi_addr;
+	module->start = UINTPTR_MAX;
+	for (int i = 0; i < p_info->dlpi_phnum; i++) {
+		const ElfW(Phdr)& phdr = p_info->dlpi_phdr[i];
+		if (phdr.p_type == PT_NOTE && module->build_id_size == 0) {
+			const uint8_t* notes = (const uint8_t*)(p_info->dlpi_addr + phdr.p_vaddr);
+			module->build_id_size = _elf_build_id(notes, phdr.p_memsz, module->build_id);
+		}
+		if (phdr.p_type == PT_GNU_EH_FRAME) module->eh_frame_hdr = (const uint8_t*)(p_info->dlpi_addr + phdr.p_vaddr);
+		if (phdr.p_type != PT_LOAD) continue;
+		module->start = std::min<uintptr_t>(module->start, p_info->dlpi_addr + phdr.p_vaddr);
+		module->end = std::max<uintptr_t>(module->end, p_info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz);
+	}
+	if (module->start >= module->end) {
+		delete module;
 		return 0;
 	}
 
-	pid_t pid = fork();
-	if (pid < 0) {
-		printf("ERR_CANT_FORK\n");
-		return -1;
+	// The executable has an empty name.
+	const char* path = p_info->dlpi_name;
+	if (path == nullptr || *path == '\0') {
+		ssize_t length = readlink("/proc/self/exe", module->path, sizeof(module->path) - 1);
+		if (length > 0) module->path[length] = '\0';
+		path = "/proc/self/exe";
+	} else {
+		strncpy(module->path, path, sizeof(module->path) - 1);
+	}
+
+	// The vdso doesn't have a file, only its name is known.
+	if (p_symbols != nullptr) _sym_load_file(module, path);
+	_sym_modules->push_back(module);
+	return 0;
+}
+
+static void _sym_sort_modules() {
+	std::sort(_sym_modules->begin(), _sym_modules->end(),
+		[](const _sym_module* a, const _sym_module* b) { return a->start < b->start; });
+}
+
+// Loads the address ranges and the build-ids of the executable and the shared
+// objects loaded so far, and their symbols if p_symbols. The symbols are
+// loaded once, so the tables don't change under the crash handler.
+static void _sym_load(bool p_symbols) {
+	std::lock_guard<std::mutex> lock(_sym_mutex);
+	if (_sym_modules == nullptr) {
+		_sym_modules = new std::vector<_sym_module*>();
+		dl_iterate_phdr(_sym_load_object, p_symbols ? (void*)1 : nullptr);
+		_sym_sort_modules();
+		_sym_symbols_loaded = p_symbols;
+		return;
 	}
 
-	if (pid == 0) {
-		// is child
+	// Loaded without the symbols before (the crash record mode).
+	if (p_symbols && !_sym_symbols_loaded) {
+		for (_sym_module* module : *_sym_modules) {
+			if (module->image == nullptr && module->path[0] == '/') _sym_load_file(module, module->path);
+		}
+		_sym_symbols_loaded = true;
+	}
+}
 
-		if (!p_blocking) {
-			// For non blocking calls, create a new session-ID so parent won't wait for it.
-			// This ensures the process won't go zombie at end.
-			setsid();
+// Symbolize the address from the preloaded tables, async-signal-safe.
+static bool _symbolize(uintptr_t p_address, _sym_info* r_info) {
+	*r_info = {};
+	if (_sym_modules == nullptr) return false;
+
+	auto module = std::upper_bound(_sym_modules->begin(), _sym_modules->end(), p_address,
+		[](uintptr_t address, const _sym_module* m) { return address < m->start; });
+	if (module == _sym_modules->begin() || p_address >= (*--module)->end) return false;
+
+	const _sym_module* m = *module;
+	uintptr_t address = p_address - m->bias;
+	r_info->module = m;
+	r_info->offset = address;
+
+	auto function = std::upper_bound(m->functions.begin(), m->functions.end(), address,
+		[](uintptr_t a, const _sym_function& f) { return a < f.address; });
+	if (function != m->functions.begin()) {
+		--function;
+		if (function->size == 0 || address < function->address + function->size) {
+			r_info->function = function->name;
+			r_info->offset = address - function->address;
 		}
+	}
 
-		std::vector<std::string> cs;
+	auto line = std::upper_bound(m->lines.begin(), m->lines.end(), address,
+		[](uintptr_t a, const _sym_line& l) { return a < l.address; });
+	if (line != m->lines.begin()) {
+		--line;
+		if (line->file < m->files.size() && line->line != 0) {
+			r_info->file = &m->files[line->file];
+			r_info->line = line->line;
+		}
+	}
 
-		cs.push_back(p_path);
-		for (int i = 0; i < p_arguments.size(); i++)
-			cs.push_back(p_arguments[i]);
+	return true;
+}
 
-		std::vector<char*> args;
-		for (int i = 0; i < cs.size(); i++)
-			args.push_back((char*)cs[i].c_str());
-		args.push_back(0);
+/***************************************************************************************************************************/
+/*                                                UNWINDER                                                                 */
+/***************************************************************************************************************************/
 
-		execvp(p_path.c_str(), &args[0]);
-		// still alive? something failed..
-		fprintf(stderr, "**ERROR** OS_Unix::execute - Could not create child process while executing: %s\n", p_path.c_str());
-		abort();
+// Unwinds the stack from the registers of a signal context, without glibc's
+// backtrace() which could allocate and dlopen libgcc. On x86_64 each frame is
+// unwound with the CFI rule of its pc from the .eh_frame of its module (found
+// with the .eh_frame_hdr search table, mapped in memory), the rules are cached
+// by pc so a sampled stack is usually unwound with a hash lookup and 2 loads
+// per frame. The frames without CFI (JIT code, a module loaded after the
+// handler) are unwound with the frame pointer.
+//
+// The CFI comes first and the frame pointer is the fallback, not the other
+// way around: even in a binary built with -fno-omit-frame-pointer, libc,
+// libstdc++ and the leaf functions (-momit-leaf-frame-pointer) don't keep it,
+// and nothing in the ELF tells which functions do. Following rbp through such
+// a frame silently skips its caller or reads garbage, while a cached CFI rule
+// costs about the same as the frame pointer walk (2 loads).
+//
+// Every read of the stack is clamped to the bounds of the thread's stack,
+// which are known for the registered threads (see _unwind_thread_init()), the
+// frame pointer is followed only on those.
+//
+// Other architectures still use backtrace(), only the x86_64 CFI is parsed
+// here. It's not async-signal-safe on its own: the first call loads libgcc,
+// which is why _unwind_init() calls it once before the handlers are
+// installed. Afterwards it still takes the loader's lock (dl_iterate_phdr()),
+// a crash during a dlopen() could hang instead of being reported.
+
+// Number of the cached CFI rules (a power of 2).
+#define UNWIND_CACHE_SIZE 4096
+
+// Maximum size of a stack frame, a larger one means the stack is corrupted.
+#define UNWIND_MAX_FRAME (1 << 20)
+
+// Bounds of the calling thread's stack, 0 if they're not known.
+static __thread uintptr_t _unwind_stack_low = 0;
+static __thread uintptr_t _unwind_stack_high = 0;
+
+// Records the bounds of the calling thread's stack (pthread_getattr_np()
+// isn't async-signal-safe).
+static void _unwind_thread_init() {
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0) return;
+	void* address;
+	size_t size;
+	if (pthread_attr_getstack(&attr, &address, &size) == 0) {
+		_unwind_stack_low = (uintptr_t)address;
+		_unwind_stack_high = (uintptr_t)address + size;
 	}
+	pthread_attr_destroy(&attr);
+}
+
+// Returns the program counter of the signal context, 0 if not known.
+static inline uintptr_t _context_pc(void* p_context) {
+	ucontext_t* context = (ucontext_t*)p_context;
+#if defined(__x86_64__)
+	return (uintptr_t)context->uc_mcontext.gregs[REG_RIP];
+#elif defined(__i386__)
+	return (uintptr_t)context->uc_mcontext.gregs[REG_EIP];
+#elif defined(__aarch64__)
+	return (uintptr_t)context->uc_mcontext.pc;
+#else
+	return 0;
+#endif
+}
 
-	if (p_blocking) {
+#if defined(__x86_64__)
+
+// How to unwind a frame, the CFA (the sp before the call) is the sp or the fp
+// plus an offset, the return address and the caller's fp are saved at offsets
+// from the CFA. It's 8 bytes so a cache slot is a pair of atomic words.
+struct _unwind_rule {
+	int32_t cfa_offset;
+	uint8_t cfa_base;      // _UNWIND_CFA_*
+	uint8_t plt_threshold; // See _UNWIND_CFA_PLT.
+	int8_t ra_offset;      // In words.
+	int8_t fp_offset;      // In words, 0 if the fp isn't changed by the frame.
+};
 
-		int status;
-		waitpid(pid, &status, 0);
-		if (r_exitcode)
-			*r_exitcode = status;
+enum {
+	_UNWIND_CFA_SP = 0,
+	_UNWIND_CFA_FP = 1,
+	// The CFA expression of the PLT entries, the sp plus the offset and 8
+	// more after the push of the entry: (pc & 15) >= plt_threshold.
+	_UNWIND_CFA_PLT = 2,
+};
+
+// The rule of the outermost frame (its return address is undefined).
+#define _UNWIND_RULE_END 0x7fffffff
+
+// DWARF register numbers of x86_64.
+enum {
+	_DW_REG_RBP = 6,
+	_DW_REG_RSP = 7,
+	_DW_REG_RA = 16,
+};
+
+// A slot is claimed by the writer (key = 1) before writing the rule, so a
+// reader which sees the same key before and after reading the rule has read
+// the rule written with that key.
+struct _unwind_slot {
+	std::atomic<uint64_t> key;
+	std::atomic<uint64_t> rule;
+};
+static _unwind_slot _unwind_cache[UNWIND_CACHE_SIZE];
+
+static bool _unwind_cache_get(uintptr_t p_pc, _unwind_rule* r_rule) {
+	if (p_pc <= 1) return false; // The keys of the empty and the claimed slots.
+	_unwind_slot& slot = _unwind_cache[(p_pc * 0x9e3779b97f4a7c15ull) >> 52 & (UNWIND_CACHE_SIZE - 1)];
+	if (slot.key.load(std::memory_order_acquire) != p_pc) return false;
+	uint64_t rule = slot.rule.load(std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (slot.key.load(std::memory_order_relaxed) != p_pc) return false;
+	memcpy(r_rule, &rule, sizeof(rule));
+	return true;
+}
+
+static void _unwind_cache_put(uintptr_t p_pc, const _unwind_rule& p_rule) {
+	if (p_pc <= 1) return;
+	_unwind_slot& slot = _unwind_cache[(p_pc * 0x9e3779b97f4a7c15ull) >> 52 & (UNWIND_CACHE_SIZE - 1)];
+	uint64_t key = slot.key.load(std::memory_order_relaxed);
+	if (key == 1 || !slot.key.compare_exchange_strong(key, 1, std::memory_order_acquire)) return;
+	uint64_t rule;
+	memcpy(&rule, &p_rule, sizeof(rule));
+	slot.rule.store(rule, std::memory_order_relaxed);
+	slot.key.store(p_pc, std::memory_order_release);
+}
 
+// Reads a pointer encoded value of the .eh_frame (DW_EH_PE_*), the data
+// relative values are relative to the p_data_base.
+static bool _eh_read_pointer(_DwarfReader& r, uint8_t p_encoding, uintptr_t p_data_base, uintptr_t* r_value) {
+	if (p_encoding == 0xff) return false; // DW_EH_PE_omit
+	uintptr_t base = 0;
+	switch (p_encoding & 0x70) {
+		case 0x00: break;                            // absptr
+		case 0x10: base = (uintptr_t)r.p; break;     // pcrel
+		case 0x30: base = p_data_base; break;        // datarel
+		default: return false;                       // textrel, funcrel and aligned aren't used.
+	}
+
+	uint64_t value;
+	switch (p_encoding & 0x0f) {
+		case 0x00: value = r.u(sizeof(uintptr_t)); break;
+		case 0x01: value = r.uleb(); break;
+		case 0x02: value = r.u(2); break;
+		case 0x03: value = r.u(4); break;
+		case 0x04: value = r.u(8); break;
+		case 0x09: value = (uint64_t)r.sleb(); break;
+		case 0x0a: value = (uint64_t)(int16_t)r.u(2); break;
+		case 0x0b: value = (uint64_t)(int32_t)r.u(4); break;
+		case 0x0c: value = r.u(8); break;
+		default: return false;
+	}
+	if (r.fail) return false;
+	if (p_encoding & 0x80) return false; // Indirect, only used by the personality.
+	*r_value = base + (uintptr_t)value;
+	return true;
+}
+
+// Finds the FDE of the pc with the .eh_frame_hdr binary search table.
+static const uint8_t* _eh_find_fde(const uint8_t* p_hdr, uintptr_t p_pc) {
+	// Only the table of the GNU linkers (datarel sdata4) is supported.
+	if (p_hdr[0] != 1 || p_hdr[3] != 0x3b) return nullptr;
+	_DwarfReader r(p_hdr + 4, p_hdr + 4 + 16);
+	uintptr_t eh_frame, count;
+	if (!_eh_read_pointer(r, p_hdr[1], (uintptr_t)p_hdr, &eh_frame)) return nullptr;
+	if (!_eh_read_pointer(r, p_hdr[2], (uintptr_t)p_hdr, &count)) return nullptr;
+
+	const int32_t* table = (const int32_t*)r.p;
+	int64_t target = (int64_t)(p_pc - (uintptr_t)p_hdr);
+	size_t low = 0, high = count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		if (table[2 * mid] <= target) low = mid + 1;
+		else high = mid;
+	}
+	if (low == 0) return nullptr;
+	return p_hdr + table[2 * (low - 1) + 1];
+}
+
+// State of the CFA program, only the registers needed to unwind are tracked.
+struct _cfa_state {
+	int cfa_register;
+	int64_t cfa_offset;
+	const uint8_t* cfa_expression; // Null if the CFA is a register and an offset.
+	uint64_t cfa_expression_size;
+	int64_t ra_offset; // INT64_MIN if undefined.
+	int64_t fp_offset; // INT64_MIN if the same value.
+};
+
+// Runs the CFA instructions till the location passes the pc.
+static bool _cfa_execute(_DwarfReader r, uintptr_t p_location, uintptr_t p_pc, uint64_t p_code_align,
+	int64_t p_data_align, const _cfa_state& p_initial, _cfa_state& state) {
+
+	_cfa_state stack[8];
+	int depth = 0;
+
+	auto set_offset = [&](uint64_t reg, int64_t offset) {
+		if (reg == _DW_REG_RA) state.ra_offset = offset;
+		if (reg == _DW_REG_RBP) state.fp_offset = offset;
+	};
+	auto restore = [&](uint64_t reg) {
+		if (reg == _DW_REG_RA) state.ra_offset = p_initial.ra_offset;
+		if (reg == _DW_REG_RBP) state.fp_offset = p_initial.fp_offset;
+	};
+	auto advance = [&](uint64_t delta) {
+		p_location += delta * p_code_align;
+		return p_location <= p_pc;
+	};
+
+	while (r.p < r.end && !r.fail) {
+		uint8_t opcode = (uint8_t)r.u(1);
+		uint8_t operand = opcode & 0x3f;
+		switch (opcode >> 6) {
+			case 1: if (!advance(operand)) return true; continue; // DW_CFA_advance_loc
+			case 2: set_offset(operand, (int64_t)r.uleb() * p_data_align); continue; // DW_CFA_offset
+			case 3: restore(operand); continue; // DW_CFA_restore
+		}
+
+		switch (opcode) {
+			case 0x00: break; // nop
+			case 0x02: if (!advance(r.u(1))) return true; break;
+			case 0x03: if (!advance(r.u(2))) return true; break;
+			case 0x04: if (!advance(r.u(4))) return true; break;
+			case 0x05: { uint64_t reg = r.uleb(); set_offset(reg, (int64_t)r.uleb() * p_data_align); } break;
+			case 0x06: restore(r.uleb()); break;
+			case 0x07: { uint64_t reg = r.uleb(); if (reg == _DW_REG_RA) state.ra_offset = INT64_MIN; } break;
+			case 0x08: { uint64_t reg = r.uleb(); if (reg == _DW_REG_RBP) state.fp_offset = INT64_MIN; } break;
+			case 0x09: { uint64_t reg = r.uleb(); r.uleb(); if (reg == _DW_REG_RA || reg == _DW_REG_RBP) return false; } break;
+			case 0x0a: if (depth == 8) return false; stack[depth++] = state; break;
+			case 0x0b: if (depth == 0) return false; state = stack[--depth]; break;
+			case 0x0c: state.cfa_register = (int)r.uleb(); state.cfa_offset = (int64_t)r.uleb(); state.cfa_expression = nullptr; break;
+			case 0x0d: state.cfa_register = (int)r.uleb(); state.cfa_expression = nullptr; break;
+			case 0x0e: state.cfa_offset = (int64_t)r.uleb(); break;
+			case 0x0f:
+				state.cfa_expression_size = r.uleb();
+				state.cfa_expression = r.p;
+				r.skip(state.cfa_expression_size);
+				break;
+			case 0x10: { uint64_t reg = r.uleb(); r.skip(r.uleb()); if (reg == _DW_REG_RA || reg == _DW_REG_RBP) return false; } break;
+			case 0x11: { uint64_t reg = r.uleb(); set_offset(reg, r.sleb() * p_data_align); } break;
+			case 0x12: state.cfa_register = (int)r.uleb(); state.cfa_offset = r.sleb() * p_data_align; state.cfa_expression = nullptr; break;
+			case 0x13: state.cfa_offset = r.sleb() * p_data_align; break;
+			case 0x14: case 0x15: { uint64_t reg = r.uleb(); r.uleb(); if (reg == _DW_REG_RA || reg == _DW_REG_RBP) return false; } break;
+			case 0x16: { uint64_t reg = r.uleb(); r.skip(r.uleb()); if (reg == _DW_REG_RA || reg == _DW_REG_RBP) return false; } break;
+			case 0x2e: r.uleb(); break; // DW_CFA_GNU_args_size
+			case 0x2f: { uint64_t reg = r.uleb(); set_offset(reg, -(int64_t)r.uleb() * p_data_align); } break;
+			default: return false;
+		}
+	}
+	return !r.fail;
+}
+
+// Computes the unwind rule of the pc from the CFI of the module, async-signal-safe.
+static bool _unwind_rule_of(const uint8_t* p_hdr, uintptr_t p_pc, _unwind_rule* r_rule) {
+	const uint8_t* fde = _eh_find_fde(p_hdr, p_pc);
+	if (fde == nullptr) return false;
+
+	// The FDE and its CIE, the 64 bit lengths aren't used in the .eh_frame.
+	_DwarfReader f(fde, fde + 4);
+	uint32_t fde_length = (uint32_t)f.u(4);
+	if (fde_length == 0 || fde_length == 0xffffffff) return false;
+	f = _DwarfReader(fde + 4, fde + 4 + fde_length);
+	uint32_t cie_pointer = (uint32_t)f.u(4);
+	if (cie_pointer == 0) return false;
+	const uint8_t* cie = fde + 4 - cie_pointer;
+
+	_DwarfReader c(cie, cie + 4);
+	uint32_t cie_length = (uint32_t)c.u(4);
+	if (cie_length == 0 || cie_length == 0xffffffff) return false;
+	c = _DwarfReader(cie + 4, cie + 4 + cie_length);
+	if (c.u(4) != 0) return false; // The CIE id.
+	int version = (int)c.u(1);
+	const char* augmentation = c.str();
+	if (augmentation == nullptr || (augmentation[0] != '\0' && augmentation[0] != 'z')) return false;
+	uint64_t code_align = c.uleb();
+	int64_t data_align = c.sleb();
+	uint64_t ra_register = (version == 1) ? c.u(1) : c.uleb();
+	if (ra_register != _DW_REG_RA) return false;
+
+	uint8_t fde_encoding = 0;
+	if (augmentation[0] == 'z') {
+		uint64_t length = c.uleb();
+		const uint8_t* end = c.p + length;
+		for (const char* a = augmentation + 1; *a && !c.fail; a++) {
+			if (*a == 'R') fde_encoding = (uint8_t)c.u(1);
+			else if (*a == 'L') c.u(1);
+			else if (*a == 'P') {
+				uint8_t encoding = (uint8_t)c.u(1);
+				uintptr_t personality;
+				_eh_read_pointer(c, encoding & 0x7f, 0, &personality);
+			} else if (*a != 'S') break;
+		}
+		c.p = end;
+	}
+	if (c.fail) return false;
+
+	uintptr_t pc_begin, pc_range;
+	if (!_eh_read_pointer(f, fde_encoding, 0, &pc_begin)) return false;
+	if (!_eh_read_pointer(f, fde_encoding & 0x0f, 0, &pc_range)) return false;
+	if (p_pc < pc_begin || p_pc >= pc_begin + pc_range) return false;
+	if (augmentation[0] == 'z') f.skip(f.uleb());
+	if (f.fail) return false;
+
+	_cfa_state initial = { _DW_REG_RSP, 8, nullptr, 0, INT64_MIN, INT64_MIN };
+	if (!_cfa_execute(c, 0, 0, code_align, data_align, initial, initial)) return false;
+	_cfa_state state = initial;
+	if (!_cfa_execute(f, pc_begin, p_pc, code_align, data_align, initial, state)) return false;
+
+	_unwind_rule rule = {};
+	if (state.cfa_expression != nullptr) {
+		// Only the expression the linkers emit for the PLT is supported:
+		// rsp + 8 + (((rip & 15) >= 11) << 3), 10 with the IBT PLT.
+		static const uint8_t plt[] = { 0x77, 0x08, 0x80, 0x00, 0x3f, 0x1a, 0x00, 0x2a, 0x33, 0x24, 0x22 };
+		const uint8_t* e = state.cfa_expression;
+		if (state.cfa_expression_size != sizeof(plt) || memcmp(e, plt, 6) != 0 || memcmp(e + 7, plt + 7, 4) != 0) return false;
+		if (e[6] < 0x30 || e[6] > 0x4f) return false; // DW_OP_lit0-31
+		rule.cfa_base = _UNWIND_CFA_PLT;
+		rule.plt_threshold = e[6] - 0x30;
+		state.cfa_offset = 8;
+	} else if (state.cfa_register == _DW_REG_RSP || state.cfa_register == _DW_REG_RBP) {
+		rule.cfa_base = (state.cfa_register == _DW_REG_RBP) ? _UNWIND_CFA_FP : _UNWIND_CFA_SP;
 	} else {
+		return false;
+	}
+	if (state.cfa_offset < 0 || state.cfa_offset >= _UNWIND_RULE_END) return false;
+	rule.cfa_offset = (int32_t)state.cfa_offset;
+	if (state.ra_offset == INT64_MIN) {
+		rule.cfa_offset = _UNWIND_RULE_END;
+	} else {
+		if (state.ra_offset % 8 != 0 || state.ra_offset < -1024 || state.ra_offset > 1016) return false;
+		rule.ra_offset = (int8_t)(state.ra_offset / 8);
+	}
+	if (state.fp_offset != INT64_MIN) {
+		if (state.fp_offset % 8 != 0 || state.fp_offset == 0 || state.fp_offset < -1024 || state.fp_offset > 1016) return false;
+		rule.fp_offset = (int8_t)(state.fp_offset / 8);
+	}
+	*r_rule = rule;
+	return true;
+}
+
+// Returns the module of the pc, null if it's not in a known module.
+static const _sym_module* _unwind_module(uintptr_t p_pc) {
+	if (_sym_modules == nullptr) return nullptr;
+	auto module = std::upper_bound(_sym_modules->begin(), _sym_modules->end(), p_pc,
+		[](uintptr_t address, const _sym_module* m) { return address < m->start; });
+	if (module == _sym_modules->begin() || p_pc >= (*--module)->end) return nullptr;
+	return *module;
+}
+
+#endif // __x86_64__
+
+// Writes the pcs of the stack from the signal context to the frames, the
+// first one is the interrupted pc and the others are return addresses.
+// Returns the number of the frames, async-signal-safe.
+static int _unwind(void* p_context, uintptr_t* r_frames, int p_max) {
+	if (p_max <= 0) return 0;
+
+#if defined(__x86_64__)
+	ucontext_t* context = (ucontext_t*)p_context;
+	uintptr_t pc = (uintptr_t)context->uc_mcontext.gregs[REG_RIP];
+	uintptr_t sp = (uintptr_t)context->uc_mcontext.gregs[REG_RSP];
+	uintptr_t fp = (uintptr_t)context->uc_mcontext.gregs[REG_RBP];
+
+	// Without the bounds the words up to UNWIND_MAX_FRAME above the sp are
+	// assumed to be mapped, which is the case for the CFA of a valid CFI rule.
+	uintptr_t low = _unwind_stack_low, high = _unwind_stack_high;
+	bool bounded = high != 0;
+	auto readable = [&](uintptr_t address) {
+		if (bounded) return address >= low && address + 8 <= high;
+		return address >= sp && address - sp < UNWIND_MAX_FRAME;
+	};
+
+	int count = 0;
+	r_frames[count++] = pc;
+	while (count < p_max) {
+		// A return address is after the call, its rule is the one of the call.
+		uintptr_t lookup = (count == 1) ? pc : pc - 1;
+		_unwind_rule rule;
+		const _sym_module* module = nullptr;
+		bool found = _unwind_cache_get(lookup, &rule);
+		if (!found) {
+			module = _unwind_module(lookup);
+			found = module != nullptr && module->eh_frame_hdr != nullptr &&
+				_unwind_rule_of(module->eh_frame_hdr, lookup, &rule);
+			if (found) _unwind_cache_put(lookup, rule);
+		}
+
+		uintptr_t cfa, ra, caller_fp = fp;
+		if (!found && count == 1 && module == nullptr) {
+			// Called an invalid address (ex: a null function pointer), the
+			// return address was just pushed.
+			if (!readable(sp)) break;
+			cfa = sp + 8;
+			ra = *(const uintptr_t*)sp;
+		} else if (found) {
+			if (rule.cfa_offset == _UNWIND_RULE_END) break;
+			cfa = ((rule.cfa_base == _UNWIND_CFA_FP) ? fp : sp) + rule.cfa_offset;
+			if (rule.cfa_base == _UNWIND_CFA_PLT && (pc & 15) >= rule.plt_threshold) cfa += 8;
+			if (cfa <= sp || cfa - sp > UNWIND_MAX_FRAME || (cfa & 7) != 0) break;
+			if (!readable(cfa + rule.ra_offset * 8)) break;
+			if (rule.fp_offset != 0 && !readable(cfa + rule.fp_offset * 8)) break;
+			ra = *(const uintptr_t*)(cfa + rule.ra_offset * 8);
+			if (rule.fp_offset != 0) caller_fp = *(const uintptr_t*)(cfa + rule.fp_offset * 8);
+		} else {
+			// No CFI, the frame pointer is the only way (with the bounds only,
+			// it could point anywhere).
+			if (!bounded || fp < sp || fp - sp > UNWIND_MAX_FRAME || (fp & 7) != 0) break;
+			if (!readable(fp) || !readable(fp + 8)) break;
+			cfa = fp + 16;
+			ra = ((const uintptr_t*)fp)[1];
+			caller_fp = ((const uintptr_t*)fp)[0];
+		}
 
-		if (r_child_id)
-			*r_child_id = pid;
+		if (ra == 0) break;
+		pc = ra, sp = cfa, fp = caller_fp;
+		r_frames[count++] = pc;
 	}
+	return count;
 
-	return 0;
+#else
+	// The frames of the signal handler are skipped, up to the interrupted pc
+	// (or the handler and the signal trampoline if it's not found).
+	void* frames[256];
+	int size = backtrace(frames, 256);
+	uintptr_t pc = _context_pc(p_context);
+	int first = 0;
+	while (first < size && (uintptr_t)frames[first] != pc) first++;
+
+	int count = 0;
+	if (first == size) {
+		r_frames[count++] = pc;
+		first = 2;
+	}
+	for (int i = first; i < size && count < p_max; i++) r_frames[count++] = (uintptr_t)frames[i];
+	return count;
+#endif
+}
+
+// Loads what the unwinder needs, before the signal handlers are installed.
+static void _unwind_init() {
+	_sym_load(false);
+#if !defined(__x86_64__)
+	// glibc loads libgcc on the first backtrace().
+	void* warmup[1];
+	backtrace(warmup, 1);
 #endif
 }
 
-// FIXME: chage it to string split
-std::string _func_offset(const char* string_symbol) {
+// Demangles the function name outside of a signal handler (the watchdog and
+// the offline symbolizer), null in the handler.
+typedef void (*_demangle_fn)(_SignalWriter& out, const char* p_name);
+
+// Writes a symbolized frame as "[index] function at dir/file:line".
+static void _write_frame(_SignalWriter& out, int p_index, uintptr_t p_address, bool p_return_address,
+	_demangle_fn p_demangle = nullptr) {
+	// A return address points after the call, the call itself is looked up.
+	_sym_info info;
+	bool found = _symbolize(p_return_address ? p_address - 1 : p_address, &info);
+
+	out.chr('[').dec(p_index).str("] ");
+	if (!found || (info.function == nullptr && info.file == nullptr)) {
+		out.str("<<unresolved symbols>> at ");
+		if (found) out.str(info.module->path).str("(+").hex(p_address - info.module->bias).str(") ");
+		out.chr('[').hex(p_address).str("]\n");
+		return;
+	}
 
-	// the backtrace_symbol output:
-	// /home/thakeenathees/dev/carbon/bin/carbon.x11.debug.64(+0x2801) [0x55c5aa0a2801]
-	// from that it'll extract the offset (0x2801) and feed to addr2line
+	if (info.function == nullptr) out.str("??");
+	else if (p_demangle != nullptr) p_demangle(out, info.function);
+	else out.str(info.function);
 
-	size_t i = 0;
-	bool copy = false;
-	std::string offset;
-	while (char c = string_symbol[i++]) {
-		if (c == ')') break;
-		if (copy) offset += c;
-		if (c == '+') copy = true;
+	out.str(" at ");
+	if (info.file != nullptr) {
+		if (info.file->dir != nullptr && info.file->name[0] != '/') out.str(info.file->dir).chr('/');
+		out.str(info.file->name).chr(':').dec(info.line);
+	} else {
+		out.str(info.module->path).str("+").hex(info.offset);
 	}
-	return offset;
+	out.chr('\n');
+}
+
+// Demangles with __cxa_demangle() which allocates, not in a signal handler.
+static void _demangle(_SignalWriter& out, const char* p_name) {
+	int status;
+	char* demangled = abi::__cxa_demangle(p_name, nullptr, nullptr, &status);
+	out.str((status == 0 && demangled) ? demangled : p_name);
+	free(demangled);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-static void handle_crash(int sig) {
+#ifdef CRASH_HANDLER_ENABLED
+/***************************************************************************************************************************/
+/*                                                FLIGHT RECORDER                                                          */
+/***************************************************************************************************************************/
+
+// The rings are in a list which only grows, the crash handler walks it while
+// the other threads keep recording. The events are copied like a seqlock: the
+// ones overwritten while they're copied are detected by re-reading the head.
 
-	void* bt_buffer[256];
-	size_t size = backtrace(bt_buffer, 256);
-	std::string _execpath = _get_exec_path();
+static std::atomic<_trace_ring*> _trace_rings{ nullptr };
+__thread _trace_ring* _trace_self = nullptr;
+static __thread bool _trace_exited = false;
 
-	// Dump the backtrace to stderr with a message to the user
-	fprintf(stderr, "%s: Program crashed with signal %d\n", __FUNCTION__, sig);
+// The time and the CLOCK_MONOTONIC at initialize(), the crash handler converts
+// the ticks of the events to nanoseconds with the elapsed time since.
+static uint64_t _trace_base_time = 0;
+static int64_t _trace_base_ns = 0;
 
-	fprintf(stderr, "Dumping the backtrace.\n");
-	char** strings = backtrace_symbols(bt_buffer, size);
-	if (strings) {
-		for (size_t i = 1; i < size; i++) {
-
-			/* fname not working like it works in godot!! using backtrace_symbol string instead to get method
-						char fname[1024];
-						Dl_info info;
-						snprintf(fname, 1024, "%s", strings[i]);
-						// Try to demangle the function name to provide a more readable one
-						if (dladdr(bt_buffer[i], &info) && info.dli_sname) {
-							if (info.dli_sname[0] == '_') {
-								int status;
-								char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
-								if (status == 0 && demangled) {
-									snprintf(fname, 1024, "%s", demangled);
-								}
-								if (demangled)
-									free(demangled);
-							}
-						}
-			*/
-			std::vector<std::string> args;
-
-			//char str[1024];
-			//snprintf(str, 1024, "%p", bt_buffer[i]);
-			// godot using this but It's not working for some reason
-			// but the offset from the backtrace_symbols working, why?
-			// using args.push_back(_func_offset(strings[i])); instead
-
-			args.push_back(_func_offset(strings[i]));
-			args.push_back("-e");
-			args.push_back(_execpath);
-			args.push_back("-f");
-			args.push_back("--demangle");
-			args.push_back("-p");
-
-			std::string output = "";
-
-			// Try to get the file/line number using addr2line
-			int ret;
-			int err = _execute("addr2line", args, true, nullptr, &output, &ret);
-			if (err == 0) {
-				output.erase(output.length() - 1, 1);
-			}
+static int64_t _trace_clock_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-			if (output.find(" ??:") != std::string::npos) { // _start at ??:0 no symbol found
-				fprintf(stderr, "[%ld] <<unresolved symbols>> at %s\n", (long int)i, /*fname,*/ strings[i]);
-			} else {
-				fprintf(stderr, "[%ld] %s\n", (long int)i, /*fname,*/ output.c_str());
-			}
+static void _trace_calibrate() {
+	_trace_base_ns = _trace_clock_ns();
+	_trace_base_time = _trace_time();
+}
+
+// Frees the ring of the thread when it exits, the events after that (from the
+// other thread_local destructors) aren't recorded.
+struct _trace_owner {
+	~_trace_owner() {
+		_trace_ring* ring = _trace_self;
+		_trace_self = nullptr;
+		_trace_exited = true;
+		if (ring != nullptr) ring->tid.store(0, std::memory_order_release);
+	}
+};
 
+_trace_ring* _trace_register() {
+	if (_trace_exited) return nullptr;
+	static thread_local _trace_owner owner;
+	(void)owner;
+
+	int tid = (int)syscall(SYS_gettid);
+	for (_trace_ring* ring = _trace_rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+		int free = 0;
+		if (ring->tid.compare_exchange_strong(free, tid)) {
+			ring->head.store(0, std::memory_order_release);
+			_trace_self = ring;
+			return ring;
 		}
+	}
 
-		free(strings);
+	_trace_ring* ring = new _trace_ring();
+	ring->tid.store(tid, std::memory_order_relaxed);
+	ring->next = _trace_rings.load(std::memory_order_relaxed);
+	while (!_trace_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release)) {
 	}
-	fprintf(stderr, "-- END OF BACKTRACE --\n");
+	_trace_self = ring;
+	return ring;
+}
+
+// Copies the last events of the ring (at most p_max, the oldest first) and
+// returns their count.
+static int _trace_snapshot(_trace_ring* p_ring, _trace_record* r_records, int p_max) {
+	uint64_t head = p_ring->head.load(std::memory_order_acquire);
+	uint64_t count = std::min<uint64_t>(head, (uint64_t)p_max);
+	uint64_t first = head - count;
+	for (uint64_t i = 0; i < count; i++) r_records[i] = p_ring->records[(first + i) & (TRACE_RING_SIZE - 1)];
+
+	// The event at the new head could be being written, and the ones a ring
+	// before it were overwritten.
+	std::atomic_thread_fence(std::memory_order_acquire);
+	uint64_t last = p_ring->head.load(std::memory_order_relaxed);
+	uint64_t overwritten = (last + 1 > first + TRACE_RING_SIZE) ? last + 1 - TRACE_RING_SIZE - first : 0;
+	if (overwritten >= count) return 0;
+	for (uint64_t i = overwritten; i < count; i++) r_records[i - overwritten] = r_records[i];
+	return (int)(count - overwritten);
+}
+
+// Nanoseconds per tick of _trace_time() measured since initialize().
+static double _trace_ns_per_tick(uint64_t p_now_time, int64_t p_now_ns) {
+	if (_trace_base_time == 0 || p_now_time <= _trace_base_time) return 1.0;
+	return (double)(p_now_ns - _trace_base_ns) / (double)(p_now_time - _trace_base_time);
+}
+
+// Writes an event as "-<age> us  id args...".
+static void _trace_write_event(_SignalWriter& out, int64_t p_age_ns, const char* p_id, const uint64_t* p_args) {
+	out.str("  -").dec(p_age_ns / 1000).chr('.');
+	int64_t fraction = p_age_ns % 1000;
+	out.chr((char)('0' + fraction / 100)).chr((char)('0' + fraction / 10 % 10)).chr((char)('0' + fraction % 10));
+	out.str(" us  ").str(p_id);
+	for (int i = 0; i < 2; i++) {
+		int64_t value = (int64_t)p_args[i];
+		out.chr(' ');
+		// Small integers in decimal, pointers and the like in hex.
+		if (value > -(1ll << 32) && value < (1ll << 32)) out.dec(value);
+		else out.hex(p_args[i]);
+	}
+	out.chr('\n');
+}
+
+// Writes the last events of every thread with their age at the crash.
+static void _trace_dump(_SignalWriter& out, int p_crashed_tid) {
+	if (_trace_rings.load(std::memory_order_acquire) == nullptr) return;
+	uint64_t now_time = _trace_time();
+	double ns_per_tick = _trace_ns_per_tick(now_time, _trace_clock_ns());
+
+	out.str("Dumping the recent trace events.\n");
+	for (_trace_ring* ring = _trace_rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+		int tid = ring->tid.load(std::memory_order_acquire);
+		if (tid == 0) continue;
+		_trace_record records[TRACE_DUMP_COUNT];
+		int count = _trace_snapshot(ring, records, TRACE_DUMP_COUNT);
+		out.str("thread ").dec(tid).str((tid == p_crashed_tid) ? " (crashed)\n" : "\n");
+		for (int i = 0; i < count; i++) {
+			int64_t age = (int64_t)((double)(int64_t)(now_time - records[i].time) * ns_per_tick);
+			_trace_write_event(out, age, records[i].id, records[i].args);
+		}
+	}
+	out.str("-- END OF TRACE --\n");
+}
+
+/***************************************************************************************************************************/
+/*                                                CRASH RECORD                                                             */
+/***************************************************************************************************************************/
+
+// The binary crash record is a sequence of sections, each one is a
+// _crash_section header followed by its data, starting with the
+// _CRASH_SECTION_HEADER and ending with the _CRASH_SECTION_END. The integers
+// are in the native byte order of the crashed process.
+#define _CRASH_RECORD_MAGIC "CRASHREC"
+#define _CRASH_RECORD_VERSION 2
+
+enum {
+	_CRASH_SECTION_HEADER = 1,    // _crash_header
+	_CRASH_SECTION_REGISTERS = 2, // uint64_t registers of the signal context, see _context_registers().
+	_CRASH_SECTION_FRAMES = 3,    // uint64_t pcs of the backtrace, the first one is the interrupted pc (v2).
+	_CRASH_SECTION_MODULE = 4,    // _crash_module, one per loaded object.
+	_CRASH_SECTION_MAPS = 5,      // A chunk of the /proc/self/maps text.
+	_CRASH_SECTION_END = 6,       // Empty, the record is complete.
+	_CRASH_SECTION_TRACE = 7,     // _crash_trace followed by its _crash_trace_event's, one per thread.
+};
+
+struct _crash_section {
+	uint32_t type;
+	uint32_t size;
+};
+
+struct _crash_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t machine; // ELF e_machine of the process (EM_X86_64, ...).
+	int32_t signal;
+	int32_t code;
+	uint64_t address; // The faulting address (si_addr).
+	uint64_t pc;      // The pc of the signal context, 0 if not known.
+	int32_t pid;
+	int32_t tid;
+	int64_t time; // Unix time in seconds.
+};
+
+struct _crash_module {
+	uint64_t start;
+	uint64_t end;
+	uint64_t bias;
+	uint32_t build_id_size;
+	uint32_t reserved;
+	uint8_t build_id[32];
+	char path[256];
+};
+
+struct _crash_trace {
+	int32_t tid;
+	uint32_t count;
+};
+
+struct _crash_trace_event {
+	int64_t age; // Nanoseconds before the crash.
+	uint64_t args[2];
+	char id[48]; // Truncated.
+};
+
+#if defined(__x86_64__)
+#define _CRASH_MACHINE EM_X86_64
+#elif defined(__i386__)
+#define _CRASH_MACHINE EM_386
+#elif defined(__aarch64__)
+#define _CRASH_MACHINE EM_AARCH64
+#else
+#define _CRASH_MACHINE EM_NONE
+#endif
+
+// The fd of the crash records, -1 if the backtrace is symbolized instead.
+static volatile int _crash_record_fd = -1;
+
+static void _record_write(int p_fd, const void* p_data, size_t p_size) {
+	const char* data = (const char*)p_data;
+	while (p_size > 0) {
+		ssize_t written = write(p_fd, data, p_size);
+		if (written <= 0) return;
+		data += written;
+		p_size -= written;
+	}
+}
+
+static void _record_section(int p_fd, uint32_t p_type, const void* p_data, uint32_t p_size) {
+	_crash_section section = { p_type, p_size };
+	_record_write(p_fd, &section, sizeof(section));
+	_record_write(p_fd, p_data, p_size);
+}
+
+// Copies the general purpose registers of the signal context, returns their
+// count (the layout is the one of the machine's mcontext_t).
+static int _context_registers(void* p_context, uint64_t* r_registers) {
+	ucontext_t* context = (ucontext_t*)p_context;
+	int count = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	for (; count < NGREG; count++) r_registers[count] = (uint64_t)context->uc_mcontext.gregs[count];
+#elif defined(__aarch64__)
+	for (; count < 31; count++) r_registers[count] = context->uc_mcontext.regs[count];
+	r_registers[count++] = context->uc_mcontext.sp;
+	r_registers[count++] = context->uc_mcontext.pc;
+	r_registers[count++] = context->uc_mcontext.pstate;
+#endif
+	return count;
+}
+
+// Writes the crash record, only with write() and the data preloaded by initialize().
+static void _write_crash_record(int p_fd, int sig, siginfo_t* info, void* context, const uintptr_t* p_frames, int p_count) {
+	_crash_header header = {};
+	memcpy(header.magic, _CRASH_RECORD_MAGIC, sizeof(header.magic));
+	header.version = _CRASH_RECORD_VERSION;
+	header.machine = _CRASH_MACHINE;
+	header.signal = sig;
+	header.code = info ? info->si_code : 0;
+	header.address = info ? (uint64_t)(uintptr_t)info->si_addr : 0;
+	header.pc = _context_pc(context);
+	header.pid = (int32_t)getpid();
+	header.tid = (int32_t)syscall(SYS_gettid);
+	struct timespec now;
+	if (clock_gettime(CLOCK_REALTIME, &now) == 0) header.time = now.tv_sec;
+	_record_section(p_fd, _CRASH_SECTION_HEADER, &header, sizeof(header));
+
+	uint64_t registers[64];
+	int count = _context_registers(context, registers);
+	_record_section(p_fd, _CRASH_SECTION_REGISTERS, registers, count * sizeof(uint64_t));
+
+	uint64_t frames[256];
+	for (int i = 0; i < p_count; i++) frames[i] = p_frames[i];
+	_record_section(p_fd, _CRASH_SECTION_FRAMES, frames, p_count * sizeof(uint64_t));
+
+	uint64_t now_time = _trace_time();
+	double ns_per_tick = _trace_ns_per_tick(now_time, _trace_clock_ns());
+	for (_trace_ring* ring = _trace_rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+		_crash_trace trace = { ring->tid.load(std::memory_order_acquire), 0 };
+		if (trace.tid == 0) continue;
+		_trace_record records[TRACE_DUMP_COUNT];
+		trace.count = (uint32_t)_trace_snapshot(ring, records, TRACE_DUMP_COUNT);
+
+		_crash_section section = { _CRASH_SECTION_TRACE, (uint32_t)(sizeof(trace) + trace.count * sizeof(_crash_trace_event)) };
+		_record_write(p_fd, &section, sizeof(section));
+		_record_write(p_fd, &trace, sizeof(trace));
+		for (uint32_t i = 0; i < trace.count; i++) {
+			_crash_trace_event event = {};
+			event.age = (int64_t)((double)(int64_t)(now_time - records[i].time) * ns_per_tick);
+			event.args[0] = records[i].args[0];
+			event.args[1] = records[i].args[1];
+			for (size_t j = 0; j + 1 < sizeof(event.id) && records[i].id && records[i].id[j]; j++) event.id[j] = records[i].id[j];
+			_record_write(p_fd, &event, sizeof(event));
+		}
+	}
+
+	if (_sym_modules != nullptr) {
+		for (const _sym_module* m : *_sym_modules) {
+			_crash_module module = {};
+			module.start = m->start;
+			module.end = m->end;
+			module.bias = m->bias;
+			module.build_id_size = m->build_id_size;
+			memcpy(module.build_id, m->build_id, sizeof(module.build_id));
+			memcpy(module.path, m->path, sizeof(module.path));
+			_record_section(p_fd, _CRASH_SECTION_MODULE, &module, sizeof(module));
+		}
+	}
+
+	int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (maps >= 0) {
+		char buffer[4096];
+		ssize_t size;
+		while ((size = read(maps, buffer, sizeof(buffer))) > 0) {
+			_record_section(p_fd, _CRASH_SECTION_MAPS, buffer, (uint32_t)size);
+		}
+		close(maps);
+	}
+
+	_record_section(p_fd, _CRASH_SECTION_END, nullptr, 0);
+}
+
+static void handle_crash(int sig, siginfo_t* info, void* context) {
+
+	uintptr_t frames[256];
+	int size = _unwind(context, frames, 256);
+
+	int record_fd = _crash_record_fd;
+	if (record_fd >= 0) {
+		_write_crash_record(record_fd, sig, info, context, frames, size);
+		_SignalWriter out(STDERR_FILENO);
+		out.str(__FUNCTION__).str(": Program crashed with signal ").dec(sig).str(", crash record written.\n");
+		out.flush();
+		abort();
+	}
+
+	// Dump the backtrace to stderr with a message to the user
+	_SignalWriter out(STDERR_FILENO);
+	out.str(__FUNCTION__).str(": Program crashed with signal ").dec(sig).str("\n");
+	out.str("Dumping the backtrace.\n");
+
+	// The frames are return addresses except the one which raised the signal.
+	for (int i = 0; i < size; i++) {
+		_write_frame(out, i + 1, frames[i], i != 0);
+	}
+
+	out.str("-- END OF BACKTRACE --\n");
+	_trace_dump(out, (int)syscall(SYS_gettid));
+	out.flush();
 
 	// Abort to pass the error to the OS
 	abort();
 }
+
+// Size of the alternate stack of the signal handler, so a stack overflow could
+// be reported.
+#define CRASH_STACK_SIZE (64 * 1024)
+
+// Alternate stack of the thread which called initialize().
+static char _crash_stack[CRASH_STACK_SIZE];
+
+// Unmaps the alternate stack of a thread when it exits.
+struct _crash_thread_stack {
+	void* stack = nullptr;
+
+	~_crash_thread_stack() {
+		if (stack == nullptr) return;
+		stack_t disable = {};
+		disable.ss_flags = SS_DISABLE;
+		sigaltstack(&disable, nullptr);
+		munmap(stack, CRASH_STACK_SIZE);
+	}
+};
+
+// Installs an alternate stack for the calling thread if it has none yet.
+static void _crash_thread_init() {
+	static thread_local _crash_thread_stack owner;
+	stack_t current;
+	if (sigaltstack(nullptr, &current) == 0 && !(current.ss_flags & SS_DISABLE)) return;
+
+	void* stack = mmap(nullptr, CRASH_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) return;
+	stack_t alternate = {};
+	alternate.ss_sp = stack;
+	alternate.ss_size = CRASH_STACK_SIZE;
+	if (sigaltstack(&alternate, nullptr) != 0) {
+		munmap(stack, CRASH_STACK_SIZE);
+		return;
+	}
+	owner.stack = stack;
+}
+#endif // CRASH_HANDLER_ENABLED
+
+/***************************************************************************************************************************/
+/*                                                SAMPLING PROFILER                                                        */
+/***************************************************************************************************************************/
+
+// Each registered thread has a timer of its own cpu time which sends it SIGPROF,
+// the signal handler captures the stack of the thread to its own ring buffer
+// (single producer: the thread itself, single consumer: the collector thread)
+// without allocating or locking. The collector drains the rings to a table of
+// the unique stacks, which are symbolized only when they're written.
+
+// Maximum number of frames of a sample.
+#define PROFILER_MAX_DEPTH 64
+
+// Size of the ring buffer of each thread in words (a sample is its depth
+// followed by its pcs).
+#define PROFILER_RING_SIZE (1 << 15)
+
+// Interval of the collector thread draining the rings in milliseconds.
+#define PROFILER_COLLECT_MS 20
+
+struct _prof_thread {
+	std::atomic<uint64_t> head{ 0 }; // Written by the signal handler.
+	std::atomic<uint64_t> tail{ 0 }; // Written by the collector.
+	std::atomic<uint64_t> dropped{ 0 };
+	std::atomic<int> state{ 0 }; // _PROF_THREAD_*
+	pid_t tid = 0;
+	timer_t timer = {};
+	_prof_thread* next = nullptr;
+	uintptr_t ring[PROFILER_RING_SIZE];
+};
+
+enum {
+	_PROF_THREAD_FREE = 0,    // Could be reused by a new thread.
+	_PROF_THREAD_CLAIMED = 1, // Being registered by a thread.
+	_PROF_THREAD_ACTIVE = 2,  // Registered, its timer is valid.
+	_PROF_THREAD_EXITED = 3,  // Unregistered, the collector frees it once drained.
+};
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
 #endif
 
+// The registered threads, an entry is never freed only reused.
+static std::atomic<_prof_thread*> _prof_threads{ nullptr };
+static thread_local _prof_thread* _prof_self = nullptr;
+
+static std::mutex _prof_mutex; // Guards the fields below.
+static std::thread _prof_collector;
+static std::atomic<bool> _prof_running{ false };
+static int _prof_interval_us = 0;
+static std::map<std::vector<uintptr_t>, uint64_t> _prof_stacks;
+static uint64_t _prof_dropped = 0;
+
+static void _prof_signal(int, siginfo_t*, void* context) {
+	int saved_errno = errno;
+	_prof_thread* thread = _prof_self;
+	if (thread != nullptr && thread->state.load(std::memory_order_relaxed) == _PROF_THREAD_ACTIVE) {
+		uintptr_t frames[PROFILER_MAX_DEPTH];
+		int count = _unwind(context, frames, PROFILER_MAX_DEPTH);
+
+		uint64_t head = thread->head.load(std::memory_order_relaxed);
+		uint64_t tail = thread->tail.load(std::memory_order_acquire);
+		uint64_t size = 1 + count;
+		if (head + size - tail > PROFILER_RING_SIZE) {
+			thread->dropped.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			thread->ring[head % PROFILER_RING_SIZE] = count;
+			for (int i = 0; i < count; i++) thread->ring[(head + 1 + i) % PROFILER_RING_SIZE] = frames[i];
+			thread->head.store(head + size, std::memory_order_release);
+		}
+	}
+	errno = saved_errno;
+}
+
+static void _prof_arm(_prof_thread* p_thread, int p_interval_us) {
+	struct itimerspec spec = {};
+	spec.it_interval.tv_sec = p_interval_us / 1000000;
+	spec.it_interval.tv_nsec = (p_interval_us % 1000000) * 1000;
+	spec.it_value = spec.it_interval;
+	timer_settime(p_thread->timer, 0, &spec, nullptr);
+}
+
+// Drains the rings to the stack table, must be called with the _prof_mutex.
+static void _prof_collect() {
+	std::vector<uintptr_t> stack;
+	for (_prof_thread* thread = _prof_threads.load(); thread != nullptr; thread = thread->next) {
+		int state = thread->state.load(std::memory_order_acquire);
+		if (state == _PROF_THREAD_FREE || state == _PROF_THREAD_CLAIMED) continue;
+
+		uint64_t tail = thread->tail.load(std::memory_order_relaxed);
+		uint64_t head = thread->head.load(std::memory_order_acquire);
+		while (tail < head) {
+			uint64_t depth = thread->ring[tail % PROFILER_RING_SIZE];
+			stack.clear();
+			for (uint64_t i = 0; i < depth; i++) stack.push_back(thread->ring[(tail + 1 + i) % PROFILER_RING_SIZE]);
+			_prof_stacks[stack]++;
+			tail += 1 + depth;
+		}
+		thread->tail.store(tail, std::memory_order_release);
+		_prof_dropped += thread->dropped.exchange(0, std::memory_order_relaxed);
+
+		// Its timer is deleted, no more samples after the ones drained.
+		if (state == _PROF_THREAD_EXITED) thread->state.store(_PROF_THREAD_FREE, std::memory_order_release);
+	}
+}
+
+static void _prof_collector_main() {
+	while (_prof_running.load()) {
+		struct timespec interval = { 0, PROFILER_COLLECT_MS * 1000000L };
+		nanosleep(&interval, nullptr);
+		std::lock_guard<std::mutex> lock(_prof_mutex);
+		_prof_collect();
+	}
+}
+
+// Returns the name of the frame for the folded stacks, ';' separates the frames.
+static std::string _prof_frame_name(uintptr_t p_address, bool p_return_address) {
+	_sym_info info;
+	std::string name;
+	if (_symbolize(p_return_address ? p_address - 1 : p_address, &info) && info.function != nullptr) {
+		int status;
+		char* demangled = abi::__cxa_demangle(info.function, nullptr, nullptr, &status);
+		name = (status == 0 && demangled) ? demangled : info.function;
+		free(demangled);
+	} else {
+		char buffer[300];
+		if (info.module != nullptr) snprintf(buffer, sizeof(buffer), "%s+0x%zx", info.module->path, (size_t)info.offset);
+		else snprintf(buffer, sizeof(buffer), "0x%zx", (size_t)p_address);
+		name = buffer;
+	}
+	std::replace(name.begin(), name.end(), ';', ':');
+	return name;
+}
+
+bool SamplingProfiler::register_thread() {
+	if (_prof_self != nullptr) return true;
+
+	// Reuse a freed entry or push a new one to the list.
+	_prof_thread* thread = nullptr;
+	for (_prof_thread* t = _prof_threads.load(); t != nullptr && thread == nullptr; t = t->next) {
+		int expected = _PROF_THREAD_FREE;
+		if (t->state.compare_exchange_strong(expected, _PROF_THREAD_CLAIMED)) thread = t;
+	}
+	if (thread == nullptr) {
+		thread = new _prof_thread();
+		thread->state.store(_PROF_THREAD_CLAIMED);
+		thread->next = _prof_threads.load();
+		while (!_prof_threads.compare_exchange_weak(thread->next, thread)) {}
+	}
+
+	thread->tid = (pid_t)syscall(SYS_gettid);
+	struct sigevent event = {};
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = thread->tid;
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &thread->timer) != 0) {
+		thread->state.store(_PROF_THREAD_FREE);
+		return false;
+	}
+
+	_prof_self = thread; // Accessed here first, the handler never allocates its TLS.
+	CrashHandler::register_thread();
+	thread->state.store(_PROF_THREAD_ACTIVE, std::memory_order_release);
+
+	std::lock_guard<std::mutex> lock(_prof_mutex);
+	if (_prof_running.load()) _prof_arm(thread, _prof_interval_us);
+	return true;
+}
+
+void SamplingProfiler::unregister_thread() {
+	_prof_thread* thread = _prof_self;
+	if (thread == nullptr) return;
+
+	std::lock_guard<std::mutex> lock(_prof_mutex);
+	thread->state.store(_PROF_THREAD_EXITED, std::memory_order_release);
+	timer_delete(thread->timer);
+	_prof_self = nullptr;
+}
+
+bool SamplingProfiler::start(int p_interval_us) {
+	std::lock_guard<std::mutex> lock(_prof_mutex);
+	if (_prof_running.load()) return true;
+	if (p_interval_us <= 0) return false;
+
+	// Everything the handler needs is loaded before the first sample.
+	_unwind_init();
+
+	struct sigaction action = {};
+	action.sa_sigaction = _prof_signal;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, nullptr) != 0) return false;
+
+	_prof_interval_us = p_interval_us;
+	_prof_running.store(true);
+	for (_prof_thread* thread = _prof_threads.load(); thread != nullptr; thread = thread->next) {
+		if (thread->state.load() == _PROF_THREAD_ACTIVE) _prof_arm(thread, p_interval_us);
+	}
+	_prof_collector = std::thread(_prof_collector_main);
+	return true;
+}
+
+void SamplingProfiler::stop() {
+	{
+		std::lock_guard<std::mutex> lock(_prof_mutex);
+		if (!_prof_running.load()) return;
+		_prof_running.store(false);
+		for (_prof_thread* thread = _prof_threads.load(); thread != nullptr; thread = thread->next) {
+			if (thread->state.load() == _PROF_THREAD_ACTIVE) _prof_arm(thread, 0);
+		}
+	}
+	_prof_collector.join();
+
+	// A signal which was already pending is ignored.
+	signal(SIGPROF, SIG_IGN);
+}
+
+bool SamplingProfiler::write_folded(const char* p_path) {
+	FILE* file = fopen(p_path, "w");
+	if (!file) return false;
+
+	std::lock_guard<std::mutex> lock(_prof_mutex);
+	_prof_collect();
+
+	// Symbolized only now, each address once.
+	_sym_load(true);
+	std::lock_guard<std::mutex> symbols(_sym_mutex);
+	std::map<std::pair<uintptr_t, bool>, std::string> names;
+	for (const auto& sample : _prof_stacks) {
+		const std::vector<uintptr_t>& stack = sample.first;
+		std::string line;
+		for (size_t i = stack.size(); i-- > 0;) {
+			auto key = std::make_pair(stack[i], i != 0); // The leaf isn't a return address.
+			auto name = names.find(key);
+			if (name == names.end()) name = names.emplace(key, _prof_frame_name(stack[i], i != 0)).first;
+			if (!line.empty()) line += ';';
+			line += name->second;
+		}
+		fprintf(file, "%s %llu\n", line.empty() ? "[unknown]" : line.c_str(), (unsigned long long)sample.second);
+	}
+	if (_prof_dropped != 0) fprintf(file, "[dropped] %llu\n", (unsigned long long)_prof_dropped);
+
+	return fclose(file) == 0;
+}
+
+void SamplingProfiler::reset() {
+	std::lock_guard<std::mutex> lock(_prof_mutex);
+	_prof_collect();
+	_prof_stacks.clear();
+	_prof_dropped = 0;
+}
+
+/***************************************************************************************************************************/
+/*                                                WATCHDOG                                                                 */
+/***************************************************************************************************************************/
+
+// A watched thread posts heartbeats by bumping its own counter, the monitor
+// thread only sees whether the counter changed since its last check. A thread
+// with no heartbeat past its deadline is sent the WATCHDOG_SIGNAL, which
+// unwinds its stack (like the crash handler) to its entry, and the monitor
+// logs the stack and the duration of the stall when it ends.
+
+// Maximum number of frames of a stalled thread's stack.
+#define WATCHDOG_MAX_DEPTH 64
+
+// Maximum time to wait for a stalled thread to capture its stack in milliseconds.
+#define WATCHDOG_CAPTURE_MS 100
+
+// The signal which captures the stack of a stalled thread.
+#define WATCHDOG_SIGNAL (SIGRTMIN + 3)
+
+enum {
+	_WD_CAPTURE_NONE,
+	_WD_CAPTURE_REQUESTED,
+	_WD_CAPTURE_RUNNING,
+};
+
+struct _wd_thread {
+	std::atomic<uint64_t> state{ 0 }; // Heartbeat count << 1 | idle, written by the thread.
+	char name[32] = {};
+	pid_t tid = 0;
+	int deadline_ms = 0;
+
+	// Guarded by the _wd_mutex.
+	uint64_t last_state = 0;
+	int64_t last_change_ms = 0;
+	bool stalled = false;
+	bool reporting = false;    // The monitor captures its stack without the lock.
+	int64_t unregistered_ms = 0; // Unregistered while reporting, the monitor frees it.
+
+	// The signal handler only captures the stack once the monitor requested it,
+	// a late signal (ex: delayed by a syscall) after the monitor gave up on it
+	// doesn't touch the frames.
+	std::atomic<int> capture{ _WD_CAPTURE_NONE };
+	std::atomic<int> frame_count{ -1 };
+	uintptr_t frames[WATCHDOG_MAX_DEPTH];
+};
+
+static std::mutex _wd_mutex; // Guards the fields below.
+static std::vector<_wd_thread*> _wd_threads;
+static std::thread _wd_monitor;
+static std::atomic<bool> _wd_running{ false };
+static int _wd_fd = STDERR_FILENO;
+static int _wd_check_ms = 0;
+static thread_local _wd_thread* _wd_self = nullptr;
+
+static int64_t _wd_now_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void _wd_signal(int, siginfo_t*, void* context) {
+	int saved_errno = errno;
+	_wd_thread* thread = _wd_self;
+	int requested = _WD_CAPTURE_REQUESTED;
+	if (thread != nullptr && thread->capture.compare_exchange_strong(requested, _WD_CAPTURE_RUNNING)) {
+		int count = _unwind(context, thread->frames, WATCHDOG_MAX_DEPTH);
+		thread->frame_count.store(count, std::memory_order_release);
+	}
+	errno = saved_errno;
+}
+
+static void _wd_log_resumed(const char* p_name, pid_t p_tid, int64_t p_stall_ms) {
+	_SignalWriter out(_wd_fd);
+	out.str("watchdog: thread '").str(p_name).str("' (tid ").dec(p_tid);
+	out.str(") resumed after ").dec(p_stall_ms).str(" ms\n");
+}
+
+// Sends the signal to the stalled thread and logs its stack, without the
+// _wd_mutex (the thread is kept alive by its reporting flag).
+static void _wd_report_stall(_wd_thread* p_thread, int64_t p_stall_ms) {
+	p_thread->frame_count.store(-1, std::memory_order_relaxed);
+	p_thread->capture.store(_WD_CAPTURE_REQUESTED);
+	bool sent = syscall(SYS_tgkill, getpid(), p_thread->tid, WATCHDOG_SIGNAL) == 0;
+
+	int count = -1;
+	for (int waited = 0; sent && waited < WATCHDOG_CAPTURE_MS; waited++) {
+		count = p_thread->frame_count.load(std::memory_order_acquire);
+		if (count >= 0) break;
+		struct timespec interval = { 0, 1000000 };
+		nanosleep(&interval, nullptr);
+	}
+
+	// Withdraws the request, unless the handler is already unwinding which
+	// finishes shortly.
+	int requested = _WD_CAPTURE_REQUESTED;
+	if (count < 0 && !p_thread->capture.compare_exchange_strong(requested, _WD_CAPTURE_NONE)) {
+		while ((count = p_thread->frame_count.load(std::memory_order_acquire)) < 0) sched_yield();
+	}
+	p_thread->capture.store(_WD_CAPTURE_NONE);
+
+	_SignalWriter out(_wd_fd);
+	out.str("watchdog: thread '").str(p_thread->name).str("' (tid ").dec(p_thread->tid);
+	out.str(") stalled for ").dec(p_stall_ms).str(" ms\n");
+	if (count < 0) {
+		out.str("(couldn't capture the stack)\n");
+		return;
+	}
+	std::lock_guard<std::mutex> lock(_sym_mutex);
+	for (int i = 0; i < count; i++) _write_frame(out, i + 1, p_thread->frames[i], i != 0, _demangle);
+	out.str("-- END OF BACKTRACE --\n");
+}
+
+// Checks the threads with the _wd_mutex, the stalls are reported after it's
+// released so the (un)registering threads don't wait for the captures.
+static void _wd_monitor_main() {
+	std::vector<std::pair<_wd_thread*, int64_t>> stalls;
+	while (_wd_running.load()) {
+		struct timespec interval = { _wd_check_ms / 1000, (_wd_check_ms % 1000) * 1000000L };
+		nanosleep(&interval, nullptr);
+
+		stalls.clear();
+		{
+			std::lock_guard<std::mutex> lock(_wd_mutex);
+			int64_t now = _wd_now_ms();
+			for (_wd_thread* thread : _wd_threads) {
+				uint64_t state = thread->state.load(std::memory_order_relaxed);
+				if (state != thread->last_state) {
+					if (thread->stalled) _wd_log_resumed(thread->name, thread->tid, now - thread->last_change_ms);
+					thread->last_state = state;
+					thread->last_change_ms = now;
+					thread->stalled = false;
+					continue;
+				}
+
+				int64_t stall = now - thread->last_change_ms;
+				if ((state & 1) == 0 && !thread->stalled && stall > thread->deadline_ms) {
+					thread->stalled = true;
+					thread->reporting = true;
+					stalls.push_back({ thread, stall });
+				}
+			}
+		}
+
+		for (auto& stall : stalls) {
+			_wd_thread* thread = stall.first;
+			_wd_report_stall(thread, stall.second);
+
+			std::lock_guard<std::mutex> lock(_wd_mutex);
+			thread->reporting = false;
+			if (thread->unregistered_ms != 0) {
+				_wd_log_resumed(thread->name, thread->tid, thread->unregistered_ms - thread->last_change_ms);
+				delete thread;
+			}
+		}
+	}
+}
+
+bool Watchdog::start(int p_fd, int p_check_ms) {
+	std::lock_guard<std::mutex> lock(_wd_mutex);
+	if (_wd_running.load()) return true;
+	if (p_check_ms <= 0) return false;
+
+	// Everything the handler needs is loaded before the first stall, the
+	// stacks are symbolized by the monitor.
+	_sym_load(true);
+	_unwind_init();
+
+	struct sigaction action = {};
+	action.sa_sigaction = _wd_signal;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(WATCHDOG_SIGNAL, &action, nullptr) != 0) return false;
+
+	_wd_fd = p_fd;
+	_wd_check_ms = p_check_ms;
+	int64_t now = _wd_now_ms();
+	for (_wd_thread* thread : _wd_threads) thread->last_change_ms = now;
+	_wd_running.store(true);
+	_wd_monitor = std::thread(_wd_monitor_main);
+	return true;
+}
+
+void Watchdog::stop() {
+	{
+		std::lock_guard<std::mutex> lock(_wd_mutex);
+		if (!_wd_running.load()) return;
+		_wd_running.store(false);
+	}
+	_wd_monitor.join();
+}
+
+bool Watchdog::register_thread(const char* p_name, int p_deadline_ms) {
+	if (_wd_self != nullptr || p_deadline_ms <= 0) return false;
+
+	_wd_thread* thread = new _wd_thread();
+	strncpy(thread->name, p_name ? p_name : "", sizeof(thread->name) - 1);
+	thread->tid = (pid_t)syscall(SYS_gettid);
+	thread->deadline_ms = p_deadline_ms;
+	CrashHandler::register_thread();
+
+	std::lock_guard<std::mutex> lock(_wd_mutex);
+	thread->last_change_ms = _wd_now_ms();
+	_wd_threads.push_back(thread);
+	_wd_self = thread; // Accessed here first, the handler never allocates its TLS.
+	return true;
+}
+
+void Watchdog::unregister_thread() {
+	_wd_thread* thread = _wd_self;
+	if (thread == nullptr) return;
+
+	std::lock_guard<std::mutex> lock(_wd_mutex);
+	_wd_threads.erase(std::find(_wd_threads.begin(), _wd_threads.end(), thread));
+
+	// A signal sent before could still be handled, not after this.
+	_wd_self = nullptr;
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+
+	// The thread is running again, so an open stall ends here. If its stack is
+	// still being reported, the monitor logs the end after it and frees it.
+	int64_t now = _wd_now_ms();
+	if (thread->reporting) {
+		thread->unregistered_ms = now;
+		return;
+	}
+	if (thread->stalled) _wd_log_resumed(thread->name, thread->tid, now - thread->last_change_ms);
+	delete thread;
+}
+
+void Watchdog::heartbeat() {
+	_wd_thread* thread = _wd_self;
+	if (thread == nullptr) return;
+	uint64_t state = thread->state.load(std::memory_order_relaxed);
+	thread->state.store((state | 1) + 1, std::memory_order_relaxed);
+}
+
+void Watchdog::idle() {
+	_wd_thread* thread = _wd_self;
+	if (thread == nullptr) return;
+	uint64_t state = thread->state.load(std::memory_order_relaxed);
+	if ((state & 1) == 0) thread->state.store(state + 1, std::memory_order_relaxed);
+}
+
 CrashHandler::CrashHandler() {
 	disabled = false;
 }
@@ -514,24 +2487,246 @@ void CrashHandler::disable() {
 	if (disabled)
 		return;
 
-#ifdef DEBUG_BUILD
-	signal(SIGSEGV, nullptr);
-	signal(SIGFPE, nullptr);
-	signal(SIGILL, nullptr);
+	if (const char* path = getenv("CRASH_HANDLER_PROFILE")) {
+		SamplingProfiler::stop();
+		SamplingProfiler::write_folded(path);
+	}
+
+#ifdef CRASH_HANDLER_ENABLED
+	signal(SIGSEGV, SIG_DFL);
+	signal(SIGFPE, SIG_DFL);
+	signal(SIGILL, SIG_DFL);
+	signal(SIGBUS, SIG_DFL);
 #endif
 
 	disabled = true;
 }
 
+void CrashHandler::set_record_fd(int p_fd) {
+#ifdef CRASH_HANDLER_ENABLED
+	_crash_record_fd = p_fd;
+#else
+	(void)p_fd;
+#endif
+}
+
+void CrashHandler::register_thread() {
+	_unwind_thread_init();
+#ifdef CRASH_HANDLER_ENABLED
+	_crash_thread_init();
+#endif
+}
+
 void CrashHandler::initialize() {
-#ifdef DEBUG_BUILD
-	signal(SIGSEGV, handle_crash);
-	signal(SIGFPE, handle_crash);
-	signal(SIGILL, handle_crash);
+#ifdef CRASH_HANDLER_ENABLED
+	// Everything the handler needs is loaded here and not inside the handler.
+	_sym_load(_crash_record_fd < 0);
+	_unwind_init();
+	_unwind_thread_init();
+	_trace_calibrate();
+
+	stack_t stack = {};
+	stack.ss_sp = _crash_stack;
+	stack.ss_size = sizeof(_crash_stack);
+	sigaltstack(&stack, nullptr);
+
+	struct sigaction action = {};
+	action.sa_sigaction = handle_crash;
+	action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND; // A crash in the handler kills the process.
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGSEGV, &action, nullptr);
+	sigaction(SIGFPE, &action, nullptr);
+	sigaction(SIGILL, &action, nullptr);
+	sigaction(SIGBUS, &action, nullptr);
 #endif
+
+	if (getenv("CRASH_HANDLER_PROFILE")) {
+		SamplingProfiler::register_thread();
+		SamplingProfiler::start();
+	}
 }
 
 
 #endif
 #endif // CRASH_HANDLER_IMPLEMENTATION
 
+#ifdef CRASH_SYMBOLIZER_MAIN
+/***************************************************************************************************************************/
+/*                                                OFFLINE SYMBOLIZER                                                       */
+/***************************************************************************************************************************/
+
+#if defined(__linux__)
+
+static const char* _register_name(uint32_t p_machine, int p_index) {
+	static const char* x86_64[] = {
+		"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "rdi", "rsi", "rbp", "rbx",
+		"rdx", "rax", "rcx", "rsp", "rip", "eflags", "csgsfs", "err", "trapno", "oldmask", "cr2",
+	};
+	static const char* i386[] = {
+		"gs", "fs", "es", "ds", "edi", "esi", "ebp", "esp", "ebx", "edx", "ecx", "eax",
+		"trapno", "err", "eip", "cs", "eflags", "uesp", "ss",
+	};
+	static const char* aarch64[] = { "sp", "pc", "pstate" };
+	static char name[8];
+
+	if (p_machine == EM_X86_64 && p_index < 23) return x86_64[p_index];
+	if (p_machine == EM_386 && p_index < 19) return i386[p_index];
+	if (p_machine == EM_AARCH64 && p_index >= 31 && p_index < 34) return aarch64[p_index - 31];
+	snprintf(name, sizeof(name), p_machine == EM_AARCH64 ? "x%d" : "r%d", p_index);
+	return name;
+}
+
+// Loads the symbols of the recorded module from the first file with the same
+// build-id: in the directories, at its recorded path or in /usr/lib/debug.
+static bool _load_recorded_module(_sym_module* p_module, const std::vector<std::string>& p_dirs) {
+	const char* slash = strrchr(p_module->path, '/');
+	std::string name = slash ? slash + 1 : p_module->path;
+
+	std::vector<std::string> candidates;
+	for (const std::string& dir : p_dirs) candidates.push_back(dir + "/" + name);
+	candidates.push_back(p_module->path);
+	if (p_module->build_id_size > 1) {
+		char hex[65];
+		for (uint32_t i = 0; i < p_module->build_id_size; i++) snprintf(hex + 2 * i, 3, "%02x", p_module->build_id[i]);
+		candidates.push_back(std::string("/usr/lib/debug/.build-id/") + std::string(hex, 2) + "/" + (hex + 2) + ".debug");
+	}
+
+	for (const std::string& path : candidates) {
+		if (_sym_load_file(p_module, path.c_str())) return true;
+	}
+	return false;
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <crash record> [directories of the binaries...]\n", argv[0]);
+		return 1;
+	}
+
+	FILE* file = fopen(argv[1], "rb");
+	if (!file) {
+		fprintf(stderr, "error: cannot open '%s'\n", argv[1]);
+		return 1;
+	}
+	std::vector<uint8_t> record;
+	uint8_t chunk[65536];
+	size_t size;
+	while ((size = fread(chunk, 1, sizeof(chunk), file)) > 0) record.insert(record.end(), chunk, chunk + size);
+	fclose(file);
+
+	std::vector<std::string> dirs(argv + 2, argv + argc);
+	_crash_header header = {};
+	std::vector<uint64_t> registers;
+	std::vector<uint64_t> frames;
+	std::string maps;
+	std::vector<std::pair<_crash_trace, std::vector<_crash_trace_event>>> traces;
+	bool complete = false;
+	_sym_modules = new std::vector<_sym_module*>();
+
+	size_t offset = 0;
+	while (offset + sizeof(_crash_section) <= record.size() && !complete) {
+		_crash_section section;
+		memcpy(&section, record.data() + offset, sizeof(section));
+		offset += sizeof(section);
+		if (section.size > record.size() - offset) break; // Truncated while writing.
+		const uint8_t* data = record.data() + offset;
+		offset += section.size;
+
+		switch (section.type) {
+			case _CRASH_SECTION_HEADER:
+				memcpy(&header, data, std::min<size_t>(section.size, sizeof(header)));
+				break;
+			case _CRASH_SECTION_REGISTERS:
+				registers.resize(section.size / sizeof(uint64_t));
+				memcpy(registers.data(), data, registers.size() * sizeof(uint64_t));
+				break;
+			case _CRASH_SECTION_FRAMES:
+				frames.resize(section.size / sizeof(uint64_t));
+				memcpy(frames.data(), data, frames.size() * sizeof(uint64_t));
+				break;
+			case _CRASH_SECTION_MODULE: {
+				_crash_module recorded = {};
+				memcpy(&recorded, data, std::min<size_t>(section.size, sizeof(recorded)));
+				_sym_module* module = new _sym_module();
+				module->start = recorded.start;
+				module->end = recorded.end;
+				module->bias = recorded.bias;
+				module->build_id_size = std::min<uint32_t>(recorded.build_id_size, sizeof(module->build_id));
+				memcpy(module->build_id, recorded.build_id, sizeof(module->build_id));
+				memcpy(module->path, recorded.path, sizeof(module->path) - 1);
+				if (!_load_recorded_module(module, dirs) && module->path[0] == '/') {
+					fprintf(stderr, "warning: no binary with the build-id of '%s'\n", module->path);
+				}
+				_sym_modules->push_back(module);
+			} break;
+			case _CRASH_SECTION_MAPS:
+				maps.append((const char*)data, section.size);
+				break;
+			case _CRASH_SECTION_TRACE: {
+				_crash_trace trace = {};
+				memcpy(&trace, data, std::min<size_t>(section.size, sizeof(trace)));
+				size_t count = std::min<size_t>(trace.count, (section.size - std::min<size_t>(section.size, sizeof(trace))) / sizeof(_crash_trace_event));
+				std::vector<_crash_trace_event> events(count);
+				memcpy(events.data(), data + sizeof(trace), count * sizeof(_crash_trace_event));
+				traces.push_back({ trace, events });
+			} break;
+			case _CRASH_SECTION_END:
+				complete = true;
+				break;
+		}
+	}
+	_sym_sort_modules();
+
+	if (memcmp(header.magic, _CRASH_RECORD_MAGIC, sizeof(header.magic)) != 0 || header.version < 1 ||
+		header.version > _CRASH_RECORD_VERSION) {
+		fprintf(stderr, "error: '%s' isn't a crash record\n", argv[1]);
+		return 1;
+	}
+	if (header.machine != _CRASH_MACHINE) {
+		fprintf(stderr, "warning: the record is from an other machine (e_machine %u)\n", header.machine);
+	}
+
+	time_t crash_time = (time_t)header.time;
+	char time_str[64];
+	strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime(&crash_time));
+
+	_SignalWriter out(STDOUT_FILENO);
+	out.str("Program crashed with signal ").dec(header.signal).str(" (").str(strsignal(header.signal));
+	out.str(", code ").dec(header.code).str(") at address ").hex(header.address).chr('\n');
+	out.str("pid ").dec(header.pid).str(", tid ").dec(header.tid).str(", ").str(time_str).chr('\n');
+	if (!complete) out.str("warning: the record is incomplete\n");
+
+	out.str("\nRegisters:\n");
+	for (size_t i = 0; i < registers.size(); i++) {
+		out.str("  ").str(_register_name(header.machine, (int)i)).str(" = ").hex(registers[i]);
+		out.chr((i % 4 == 3 || i + 1 == registers.size()) ? '\n' : '\t');
+	}
+
+	out.str("\nDumping the backtrace.\n");
+	// The v1 records have the frame of the signal handler first.
+	size_t first = (header.version == 1) ? 1 : 0;
+	for (size_t i = first; i < frames.size(); i++) {
+		bool return_address = (header.version == 1) ? frames[i] != header.pc : i != 0;
+		_write_frame(out, (int)(i + 1 - first), (uintptr_t)frames[i], return_address, _demangle);
+	}
+	out.str("-- END OF BACKTRACE --\n");
+
+	if (!traces.empty()) {
+		out.str("\nDumping the recent trace events.\n");
+		for (auto& trace : traces) {
+			out.str("thread ").dec(trace.first.tid).str((trace.first.tid == header.tid) ? " (crashed)\n" : "\n");
+			for (_crash_trace_event& event : trace.second) {
+				event.id[sizeof(event.id) - 1] = '\0';
+				_trace_write_event(out, event.age, event.id, event.args);
+			}
+		}
+		out.str("-- END OF TRACE --\n");
+	}
+
+	out.str("\nMemory map:\n").flush();
+	_record_write(STDOUT_FILENO, maps.data(), maps.size());
+	return 0;
+}
+
+#endif // __linux__
+#endif // CRASH_SYMBOLIZER_MAIN